@@ -37,9 +37,20 @@
 #include "Util/Annotation/MetadataInfo.h"
 #include "llvm/IR/IRBuilder.h"
 
+#include "llvm/Analysis/AssumptionCache.h"
 #include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 
 #include "../../Utils/SkelUtils/CallingDAE.cpp"
+#include "../../Utils/SkelUtils/CombineStores.cpp"
+#include "../../Utils/SkelUtils/ForwardAddresses.cpp"
+#include "../../Utils/SkelUtils/InlinePrefetch.cpp"
+#include "../../Utils/SkelUtils/Interleave.cpp"
+#include "../../Utils/SkelUtils/PrefetchIdioms.cpp"
+#include "../../Utils/SkelUtils/ReorderChunks.cpp"
+#include "../../Utils/SkelUtils/Utils.cpp"
 
 #define LIBRARYNAME "FKernelPrefetch"
 #define PRINTSTREAM errs() // raw_ostream
@@ -78,6 +89,139 @@ static cl::opt<bool> KeepRedPrefs(
         "Keep prefeches made redundant by the presens of corresponding load"),
     cl::Hidden);
 
+// Loads (by DAELoadID) that dae-sim found never benefit from a prefetch.
+static cl::opt<std::string> PruneFile(
+    "prune-prefetches",
+    cl::desc("File listing loads whose prefetches should be skipped"),
+    cl::value_desc("filename"));
+
+// YAML remarks: one document per candidate load and per kernel.
+static cl::opt<std::string> RemarksFile(
+    "dae-remarks",
+    cl::desc("Write a YAML remark for every prefetch decision to file"),
+    cl::value_desc("filename"));
+
+// Range (CSR) and pointer-chasing inner loops get dedicated access code
+// instead of the generic slice, see PrefetchIdioms.cpp.
+static cl::opt<bool>
+    NoIdioms("no-prefetch-idioms",
+             cl::desc("Use the generic slice for every access phase loop"));
+
+static cl::opt<unsigned>
+    IdiomLineSize("idiom-line-size",
+                  cl::desc("Cache line size of range prefetches"),
+                  cl::value_desc("bytes"), cl::init(64));
+
+static cl::opt<unsigned> IdiomMaxLines(
+    "idiom-max-lines",
+    cl::desc("Max cache lines prefetched per range, or nodes per chain, "
+             "and iteration"),
+    cl::value_desc("unsigned"), cl::init(64));
+
+// Two-level access: super-chunks of granularity_l2 iterations are
+// prefetched into L2 ahead of the per-chunk (L1) access phases.
+static cl::opt<bool> TwoLevel(
+    "two-level",
+    cl::desc("Add an L2 access phase per super-chunk (granularity_l2)"));
+
+// Fused phases: the access phase is inlined next to the execute phase,
+// in the chunk loop of the caller, instead of being called per chunk.
+static cl::opt<bool> FusePhases(
+    "fuse-phases",
+    cl::desc("Inline the access phase, separated by a barrier"));
+
+// Pipelined chunks: the access phase called before the execute phase of
+// chunk k prefetches chunk k + 1 (and chunk 0 on the first call), see
+// insertPipelinedAccess.
+static cl::opt<bool> PipelineChunks(
+    "pipeline-chunks",
+    cl::desc("Prefetch the next chunk during the current execute phase"));
+
+static cl::opt<unsigned> ChunkLookahead(
+    "chunk-lookahead",
+    cl::desc("Iterations of the chunk after next also prefetched"),
+    cl::value_desc("unsigned"), cl::init(0));
+
+// Helper thread: the access phase runs on the sibling hyperthread of the
+// calling thread while the execute phase runs (task_DAE, libDAE_helper).
+static cl::opt<bool> HelperThread(
+    "helper-thread",
+    cl::desc("Run the access phase on an SMT helper thread"));
+
+// Interleaved chains (the AMAC target): instead of being decoupled, the
+// kernels whose iterations walk a chain of pointers walk up to
+// -dae-interleave-group chains at once, see Interleave.cpp.
+static cl::opt<bool> InterleaveChains(
+    "dae-interleave",
+    cl::desc("Interleave the pointer chains walked by independent iterations"));
+
+static cl::opt<unsigned>
+    InterleaveGroup("dae-interleave-group",
+                    cl::desc("Chains walked at once by an interleaved kernel"),
+                    cl::value_desc("unsigned"), cl::init(8));
+
+// Inline prefetches (the SWPF target): instead of being decoupled, the
+// kernels prefetch the loads of their chunk loop from within the loop, a
+// distance ahead, see InlinePrefetch.cpp. The distance is the per-loop
+// "llvm.loop.dae.distance", or -prefetch-distance, or if both are 0 the
+// number of iterations that covers -prefetch-latency.
+static cl::opt<bool> InlinePrefetch(
+    "inline-prefetch",
+    cl::desc("Prefetch a distance ahead within the loop, not decoupled"));
+
+static cl::opt<unsigned> PrefetchDistance(
+    "prefetch-distance",
+    cl::desc("Iterations between an inline prefetch and its load (0: auto)"),
+    cl::value_desc("unsigned"), cl::init(0));
+
+static cl::opt<unsigned> PrefetchLatency(
+    "prefetch-latency",
+    cl::desc("Cycles an inline prefetch should cover (for -prefetch-distance "
+             "0)"),
+    cl::value_desc("unsigned"), cl::init(200));
+
+// Reordered chunks: the access phase inspects the chunk, and the execute
+// phase runs its independent iterations sorted by the line (or page,
+// -dae-reorder-shift) of their deepest prefetch, see ReorderChunks.cpp.
+static cl::opt<bool> ReorderChunks(
+    "dae-reorder",
+    cl::desc("Run the iterations of a chunk in the order of their accesses"));
+
+static cl::opt<unsigned> ReorderShift(
+    "dae-reorder-shift",
+    cl::desc("log2 of the block that an iteration is sorted by (12: page)"),
+    cl::value_desc("unsigned"), cl::init(12));
+
+// Forwarded addresses: the access phase stores the addresses it prefetches
+// in a per-thread buffer, from which the execute phase reads them instead of
+// loading the levels of their indirections again, see ForwardAddresses.cpp.
+static cl::opt<bool> ForwardAddresses(
+    "dae-forward",
+    cl::desc("Forward prefetched addresses from the access to the execute "
+             "phase"));
+
+// Gathered values: the access phase copies the values of the read-only
+// gathers it would forward into their column of the buffer, so that the
+// execute phase reads them with unit stride. The per-loop
+// "llvm.loop.dae.gather" overrides -dae-gather.
+static cl::opt<bool> GatherValues(
+    "dae-gather",
+    cl::desc("Copy read-only gathers into a dense buffer in the access "
+             "phase"));
+
+// Combined stores: the execute phase stages the stores of its chunk loop
+// whose addresses it loads, and writes them once the chunk is done, grouped
+// by the line (or page, -dae-combine-shift) they land on, see
+// CombineStores.cpp.
+static cl::opt<bool> CombineStores(
+    "dae-combine",
+    cl::desc("Write the scattered stores of a chunk grouped by line"));
+
+static cl::opt<unsigned> CombineShift(
+    "dae-combine-shift",
+    cl::desc("log2 of the block that staged stores are grouped by (12: page)"),
+    cl::value_desc("unsigned"), cl::init(6));
+
 namespace {
 struct FKernelPrefetch : public ModulePass {
   static char ID;
@@ -89,48 +233,122 @@ public:
     AU.addRequired<LoopInfoWrapperPass>();
     AU.addRequired<AssumptionCacheTracker>();
     AU.addRequired<TargetLibraryInfoWrapperPass>();
+    AU.addRequired<DependenceAnalysis>();
   }
 
   virtual bool runOnModule(Module &M) {
     bool change = false;
 
+    if (!PruneFile.empty()) {
+      loadPruneFile();
+    }
+
+    std::unique_ptr<raw_fd_ostream> RemarksOS;
+    if (!RemarksFile.empty()) {
+      std::error_code EC;
+      RemarksOS.reset(new raw_fd_ostream(RemarksFile, EC, sys::fs::F_Text));
+      if (EC) {
+        printStart() << "Cannot open remarks file " << RemarksFile << ": "
+                     << EC.message() << "\n";
+        RemarksOS.reset();
+      }
+    }
+    Remarks = RemarksOS.get();
+
     for (Module::iterator fI = M.begin(), fE = M.end(); fI != fE; ++fI) {
       if (isFKernel(*fI)) {
         PRINTSTREAM << "\n";
         printStart().write_escaped(fI->getName()) << ":\n";
-        printStart() << "Max indirs: " << IndirThresh << "\n";
+
+        // A per-loop "llvm.loop.dae.indirection" overrides -indir-thresh.
+        MaxIndirs = IndirThresh;
+        getDAEFnHint(&*fI, DAE_ATTR_INDIRECTION, MaxIndirs);
+        printStart() << "Max indirs: " << MaxIndirs << "\n";
 
         LI = &getAnalysis<LoopInfoWrapperPass>(*fI).getLoopInfo();
         BasicAAResult BAR(createLegacyPMBasicAAResult(*this, *fI));
         AAResults AAR(createLegacyPMAAResults(*this, *fI, BAR));
         AA = &AAR;
 
+        if (InterleaveChains) {
+          change |= interleaveKernel(*fI);
+          continue;
+        }
+        if (InlinePrefetch) {
+          change |= inlineKernel(*fI);
+          continue;
+        }
+
         Function *access = &*fI; // the original
         Function *execute = cloneFunction(access);
         change = true; // as the function is cloned (and inserted)
 
         list<LoadInst *> toPref;   // LoadInsts to prefetch
         set<Instruction *> toKeep; // Instructions to keep
+        unsigned idioms = 0;       // inner loops with idiom code
+        IdiomLoads.clear();
+        IdiomWalks.clear();
+        if (!NoIdioms) {
+          idioms = insertIdioms(*access, toKeep);
+        }
         if (findAccessInsts(*access, toKeep, toPref)) {
           // insert prefetches
           int prefs = insertPrefetches(toPref, toKeep, true);
-          if (prefs > 0) {
+          if (prefs > 0 || idioms > 0) {
             // remove unwanted instructions
-            removeUnlisted(*access, toKeep);
+            unsigned removed = removeUnlisted(*access, toKeep);
+            emitKernelRemark(*access, "Decoupled", prefs, removed);
 
-            // - No inlining of the A phase.
-            access->removeFnAttr(Attribute::AlwaysInline);
-            access->addFnAttr(Attribute::NoInline);
+            // - The access phase is called, not invoked, once no call that
+            //   may throw is left in its slice.
+            if (!mayThrow(*access)) {
+              access->addFnAttr(Attribute::NoUnwind);
+            }
+            // - No inlining of the A phase, unless fused.
+            if (!FusePhases) {
+              access->removeFnAttr(Attribute::AlwaysInline);
+              access->addFnAttr(Attribute::NoInline);
+            }
+            if (TwoLevel) {
+              insertSuperChunkAccess(access);
+            }
+            if (PipelineChunks) {
+              insertPipelinedAccess(access);
+            }
+            bool helper = HelperThread && canRunOnHelper(access, execute);
+            bool reordered = false;
+            if (ReorderChunks) {
+              reordered =
+                  reorderChunks(access, execute, PipelineChunks || helper);
+            }
+            unsigned gather = GatherValues;
+            getDAEFnHint(access, DAE_ATTR_GATHER, gather);
+            if (ForwardAddresses || gather) {
+              forwardAddresses(access, execute, PipelineChunks || helper,
+                               reordered, gather);
+            }
+            if (CombineStores) {
+              combineStores(execute);
+            }
             // Following instructions asssumes that the first
             // operand is the original and the second the clone.
-            insertCallToAccessFunctionSequential(access, execute);
+            if (helper) {
+              insertCallToAccessFunction(access, execute);
+            } else {
+              insertCallToAccessFunctionSequential(access, execute,
+                                                   FusePhases);
+            }
           } else {
             printStart() << "Disqualified: no prefetches\n";
+            emitKernelRemark(*access, "NoPrefetches", 0, 0);
           }
         } else {
           printStart() << "Disqualified: CFG error\n";
+          emitKernelRemark(*access, "CFGError", 0, 0, Blocking);
         }
-      } else if (isMain(*fI)) {
+      } else if (isMain(*fI) && !InterleaveChains && !InlinePrefetch) {
+        // (interleaved and inline kernels are timed by -papi-orig, as CAE
+        // kernels)
         insertCallInitPAPI(&*fI);
         change = true;
       }
@@ -142,6 +360,67 @@ public:
 protected:
   AliasAnalysis *AA;
   LoopInfo *LI;
+  unsigned MaxIndirs; // indirection limit of the current kernel
+  raw_ostream *Remarks; // null unless -dae-remarks is given
+  Instruction *Blocking; // instruction that made the last followDeps fail
+  set<string> PrunedLoads;
+  set<LoadInst *> IdiomLoads; // covered by idiom code in this kernel
+  set<LoadInst *> IdiomWalks; // loads of the idiom code itself
+
+  // Inserts the access code of the idioms found in the inner loops of F
+  // and adds it to toKeep. Loops left with nothing to do are bypassed.
+  // Returns the number of idioms found.
+  unsigned insertIdioms(Function &F, set<Instruction *> &toKeep) {
+    static const char *Kinds[] = {"Range", "Chase"};
+    std::vector<PrefetchIdiom> Idioms;
+    findPrefetchIdioms(*LI, Idioms);
+
+    bool bypassed = false;
+    for (auto &I : Idioms) {
+      string header = I.L->getHeader()->getName().str();
+      bool bypass =
+          applyPrefetchIdiom(I, toKeep, IdiomLineSize, IdiomMaxLines);
+      IdiomLoads.insert(I.Covered.begin(), I.Covered.end());
+      IdiomWalks.insert(I.Walk.begin(), I.Walk.end());
+      bypassed = bypassed || bypass;
+
+      printStart() << "Idiom: " << Kinds[I.Kind] << " in " << header
+                   << "  (Streams: " << I.Streams.size()
+                   << "  Covered: " << I.Covered.size()
+                   << (bypass ? "  bypassed" : "") << ")\n";
+      if (Remarks) {
+        *Remarks << "--- !Analysis\n"
+                 << "Pass:            " << "f-kernel-prefetch" << "\n"
+                 << "Name:            " << Kinds[I.Kind] << "Idiom\n"
+                 << "Function:        '" << F.getName() << "'\n"
+                 << "Loop:            '" << header << "'\n"
+                 << "Streams:         " << I.Streams.size() << "\n"
+                 << "Covered:         " << I.Covered.size() << "\n"
+                 << "Bypassed:        " << (bypass ? "true" : "false") << "\n"
+                 << "...\n";
+      }
+    }
+    if (bypassed) {
+      removeUnreachableBlocks(F);
+    }
+    return Idioms.size();
+  }
+
+  // Reads the load IDs listed (one per line) in the -prune-prefetches file.
+  void loadPruneFile() {
+    std::ifstream in(PruneFile.c_str());
+    if (!in) {
+      printStart() << "Cannot read prune file " << PruneFile << "\n";
+      return;
+    }
+    string line;
+    while (std::getline(in, line)) {
+      StringRef id = StringRef(line).trim();
+      if (!id.empty()) {
+        PrunedLoads.insert(id.str());
+      }
+    }
+  }
 
   // Anotates stores in fun with the closest alias type to
   // any of the loads in toPref. (To be clear alias analysis are
@@ -218,6 +497,9 @@ protected:
     list<LoadInst *> LoadList;
     findLoads(fun, LoadList);
     findVisibleLoads(LoadList, toPref);
+    // the walks of chase idioms prefetch their own nodes
+    toPref.remove_if(
+        [this](LoadInst *LInst) { return IdiomWalks.count(LInst) != 0; });
     // anotate stores
     anotateStores(fun, toPref);
     // Find Instructions required to follow the CFG.
@@ -230,10 +512,617 @@ protected:
     return res;
   }
 
+  // Rewrites the chunk loop of F to walk InterleaveGroup chains at once. A
+  // walk yields where the slice of its next pointer ends, at the latch of
+  // the chase loop; that slice must be free of calls and stores, as the
+  // slices of prefetches. Returns true iff F changed.
+  bool interleaveKernel(Function &F) {
+    // (DependenceAnalysis first: it recomputes the loops of F)
+    DependenceAnalysis *DA = &getAnalysis<DependenceAnalysis>(F);
+    LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+    DominatorTree DT(F);
+
+    ICmpInst *Cond = getChunkCond(&F);
+    Loop *C = Cond ? LI->getLoopFor(Cond->getParent()) : nullptr;
+    InterleavedLoop IL;
+    set<Instruction *> Deps;
+    string why;
+    Blocking = nullptr;
+    if (!C || C->getHeader() != Cond->getParent()) {
+      why = "no chunk loop";
+    } else if (analyzeInterleave(C, DT, DA, IL, why) &&
+               !followDeps(IL.Next, Deps)) {
+      why = "the next node depends on a call or a store";
+    }
+    if (!why.empty()) {
+      printStart() << "Not interleaved: " << why << "\n";
+      emitKernelRemark(F, "NotInterleaved", 0, 0, Blocking);
+      return false;
+    }
+
+    string header = IL.L->getHeader()->getName().str();
+    interleaveLoop(IL, DT, InterleaveGroup);
+    printStart() << "Interleaved: " << InterleaveGroup << " walks of "
+                 << header << "  (Slice: " << Deps.size()
+                 << "  Saved: " << IL.LiveIn.size() << ")\n";
+    emitKernelRemark(F, "Interleaved", 0, 0);
+    return true;
+  }
+
+  // Prefetches the loads of the chunk loop of F from within the loop, a
+  // distance ahead. The loads are chosen as for an access phase (visible,
+  // not pruned, a slice free of calls and stores and under the indirection
+  // limit); their slices must also run ahead, see InlinePrefetch.cpp.
+  // Returns true iff F changed.
+  bool inlineKernel(Function &F) {
+    ICmpInst *Cond = getChunkCond(&F);
+    PHINode *VI = Cond ? dyn_cast<PHINode>(Cond->getOperand(0)) : nullptr;
+    if (!VI) {
+      printStart() << "Not prefetched inline: no chunk loop\n";
+      emitKernelRemark(F, "NoChunkLoop", 0, 0);
+      return false;
+    }
+
+    // (DependenceAnalysis first: it recomputes the loops of F)
+    DependenceAnalysis *DA = &getAnalysis<DependenceAnalysis>(F);
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    AssumptionCache AC(F);
+    TargetLibraryInfoImpl TLII(Triple(F.getParent()->getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    ScalarEvolution SE(F, TLI, AC, DT, LI);
+
+    Loop *L = LI.getLoopFor(VI->getParent());
+    if (!L || L->getHeader() != VI->getParent() || !L->getLoopPreheader() ||
+        !L->getLoopLatch()) {
+      printStart() << "Not prefetched inline: no chunk loop\n";
+      emitKernelRemark(F, "NoChunkLoop", 0, 0);
+      return false;
+    }
+    const SCEV *Limit;
+    BasicBlock *Exit;
+    if (!getAheadLimit(L, Cond->getParent(), SE, Limit, Exit)) {
+      printStart() << "Not prefetched inline: exit " << Exit->getName()
+                   << " not computable\n";
+      emitKernelRemark(F, "NoPrefetches", 0, 0, Exit->getTerminator());
+      return false;
+    }
+
+    unsigned Distance = 0;
+    getDAEFnHint(&F, DAE_ATTR_DISTANCE, Distance);
+    if (!Distance) {
+      Distance = PrefetchDistance;
+    }
+    if (!Distance) {
+      Distance = aheadDistance(L, PrefetchLatency);
+    }
+
+    list<LoadInst *> LoadList, toPref;
+    findLoads(F, LoadList);
+    findVisibleLoads(LoadList, toPref);
+    map<LoadInst *, AheadSlice> Slices;
+    set<Value *> Pointers;
+    for (list<LoadInst *>::iterator I = toPref.begin(), E = toPref.end();
+         I != E; ++I) {
+      PrefDecision D;
+      D.Load = *I;
+      D.Result = Inserted;
+      D.Blocking = nullptr;
+      D.SliceSize = D.Indirs = 0;
+
+      set<Instruction *> Deps;
+      AheadSlice Slice;
+      if (PrunedLoads.count(getInstructionMD(*I, DAE_LOAD_ID_MD))) {
+        D.Result = Pruned;
+      } else if (!followDeps(*I, Deps)) {
+        D.Result = BadDeps;
+        D.Blocking = Blocking;
+      } else if (!isUnderThreshold(Deps)) {
+        D.Result = IndirLimit;
+      } else if (LI.getLoopFor((*I)->getParent()) != L) {
+        D.Result = BadDeps; // in an inner loop: no distance to run ahead
+        D.Blocking = *I;
+      } else if (!getAheadSlice(L, LI, DT, SE, DA, *AA, *I, Slice,
+                                D.Blocking)) {
+        D.Result = BadDeps;
+      } else if (!Pointers.insert((*I)->getPointerOperand()).second) {
+        D.Result = Redundant;
+      } else {
+        Slices[*I] = Slice;
+      }
+      D.SliceSize = Deps.size();
+      D.Indirs = countLoads(Deps);
+      emitLoadRemark(D);
+    }
+
+    if (Slices.empty()) {
+      printStart() << "Not prefetched inline: no prefetches\n";
+      emitKernelRemark(F, "NoPrefetches", 0, 0);
+      return false;
+    }
+    map<LoadInst *, unsigned> Ahead;
+    staggerAhead(Slices, Distance, Ahead);
+    unsigned prefs = insertAheadPrefetches(L, SE, Limit, Slices, Ahead);
+    printStart() << "Prefetched inline: " << prefs << "/" << toPref.size()
+                 << "  (Distance: " << Distance << ")\n";
+    emitKernelRemark(F, "PrefetchedInline", prefs, 0);
+    return true;
+  }
+
+  // Makes the access phase record where each iteration of its chunk loop
+  // goes, and the execute phase run them in that order. Both phases must
+  // run one after the other, not Ahead of each other: the execute phase
+  // reads the order of the chunk that the access phase last walked.
+  // Returns true iff the phases changed.
+  bool reorderChunks(Function *access, Function *execute, bool Ahead) {
+    string why;
+    ICmpInst *ACond = getChunkCond(access);
+    ICmpInst *ECond = getChunkCond(execute);
+    PHINode *AVI = ACond ? dyn_cast<PHINode>(ACond->getOperand(0)) : nullptr;
+    PHINode *EVI = ECond ? dyn_cast<PHINode>(ECond->getOperand(0)) : nullptr;
+    if (Ahead) {
+      printStart() << "Not reordered: the access phase runs ahead\n";
+      emitKernelRemark(*execute, "NotReordered", 0, 0);
+      return false;
+    }
+    if (!AVI || !EVI) {
+      printStart() << "Not reordered: no chunk loop\n";
+      emitKernelRemark(*execute, "NotReordered", 0, 0);
+      return false;
+    }
+
+    // (DependenceAnalysis first: it recomputes the loops of execute)
+    DependenceAnalysis *DA = &getAnalysis<DependenceAnalysis>(*execute);
+    DominatorTree EDT(*execute);
+    LoopInfo ELI(EDT);
+    AssumptionCache AC(*execute);
+    TargetLibraryInfoImpl TLII(Triple(execute->getParent()->getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    ScalarEvolution SE(*execute, TLI, AC, EDT, ELI);
+    DominatorTree ADT(*access);
+    LoopInfo ALI(ADT);
+
+    Loop *EL = ELI.getLoopFor(EVI->getParent());
+    Loop *AL = ALI.getLoopFor(AVI->getParent());
+    IntrinsicInst *Pref = nullptr;
+    unsigned Loads = 0;
+    ReorderedLoop R;
+    Blocking = nullptr;
+    if (!EL || EL->getHeader() != EVI->getParent() || !AL ||
+        AL->getHeader() != AVI->getParent()) {
+      why = "no chunk loop";
+    } else if (!(Pref = findInspectedPrefetch(AL, ADT, ALI, Loads))) {
+      why = "no prefetch in every iteration";
+    } else {
+      analyzeReorder(EL, EVI, SE, DA, R, why);
+    }
+    if (!why.empty()) {
+      printStart() << "Not reordered: " << why << "\n";
+      emitKernelRemark(*execute, "NotReordered", 0, 0);
+      return false;
+    }
+
+    GlobalVariable *Buf = inspectBuffer(access);
+    insertInspector(AL, AVI, Pref, Buf, ReorderShift);
+    reorderIterations(R, EDT, Buf);
+    printStart() << "Reordered: " << EL->getHeader()->getName()
+                 << "  (Key loads: " << Loads << "  IVs: " << R.IVs.size()
+                 << "  Recomputed: " << R.Remat.size() << ")\n";
+    emitKernelRemark(*execute, "Reordered", 0, 0);
+    return true;
+  }
+
+  // Makes the access phase store the indirect addresses it prefetches, and
+  // the execute phase read them instead of computing them again; with
+  // Gather, the values of read-only gathers instead of their addresses (and
+  // only those, without -dae-forward). Both phases must run one after the
+  // other, not Ahead of each other, and the execute phase must run the
+  // iterations in the same order, not Reordered. Returns true iff the
+  // phases changed.
+  bool forwardAddresses(Function *access, Function *execute, bool Ahead,
+                        bool Reordered, bool Gather) {
+    string why;
+    ICmpInst *ACond = getChunkCond(access);
+    ICmpInst *ECond = getChunkCond(execute);
+    PHINode *AVI = ACond ? dyn_cast<PHINode>(ACond->getOperand(0)) : nullptr;
+    PHINode *EVI = ECond ? dyn_cast<PHINode>(ECond->getOperand(0)) : nullptr;
+    if (Ahead) {
+      why = "the access phase runs ahead";
+    } else if (Reordered) {
+      why = "reordered iterations";
+    } else if (!AVI || !EVI) {
+      why = "no chunk loop";
+    }
+    if (!why.empty()) {
+      printStart() << "Not forwarded: " << why << "\n";
+      emitKernelRemark(*execute, "NotForwarded", 0, 0);
+      return false;
+    }
+
+    // (DependenceAnalysis first: it recomputes the loops of execute)
+    DependenceAnalysis *DA = &getAnalysis<DependenceAnalysis>(*execute);
+    DominatorTree EDT(*execute);
+    LoopInfo ELI(EDT);
+    DominatorTree ADT(*access);
+    LoopInfo ALI(ADT);
+    BasicAAResult BAR(createLegacyPMBasicAAResult(*this, *execute));
+    AAResults AAR(createLegacyPMAAResults(*this, *execute, BAR));
+
+    Loop *EL = ELI.getLoopFor(EVI->getParent());
+    Loop *AL = ALI.getLoopFor(AVI->getParent());
+    if (!EL || EL->getHeader() != EVI->getParent() ||
+        !EL->getLoopPreheader() || !AL ||
+        AL->getHeader() != AVI->getParent() || !AL->getLoopPreheader()) {
+      printStart() << "Not forwarded: no chunk loop\n";
+      emitKernelRemark(*execute, "NotForwarded", 0, 0);
+      return false;
+    }
+
+    // the prefetches run by every iteration, by load
+    map<string, IntrinsicInst *> Prefs;
+    for (BasicBlock *BB : AL->blocks()) {
+      if (ALI.getLoopFor(BB) != AL || !ADT.dominates(BB, AL->getLoopLatch())) {
+        continue;
+      }
+      for (Instruction &I : *BB) {
+        IntrinsicInst *II = dyn_cast<IntrinsicInst>(&I);
+        if (II && II->getIntrinsicID() == Intrinsic::prefetch &&
+            InstrhasMetadataKind(II, DAE_LOAD_ID_MD)) {
+          Prefs[getInstructionMD(II, DAE_LOAD_ID_MD)] = II;
+        }
+      }
+    }
+
+    vector<ForwardedLoad> Loads;
+    unsigned total = 0, gathered = 0;
+    Blocking = nullptr;
+    if (!hasChunkLength(AL, AVI, ACond) || !hasChunkLength(EL, EVI, ECond)) {
+      why = "no chunk bound";
+    } else if (!isForwardableLoop(EL, DA, AAR, Blocking)) {
+      why = "the exits read memory the loop writes";
+    } else {
+      for (BasicBlock *BB : EL->blocks()) {
+        for (Instruction &I : *BB) {
+          LoadInst *LD = dyn_cast<LoadInst>(&I);
+          if (!LD || !InstrhasMetadataKind(LD, DAE_LOAD_ID_MD)) {
+            continue;
+          }
+          map<string, IntrinsicInst *>::iterator P =
+              Prefs.find(getInstructionMD(LD, DAE_LOAD_ID_MD));
+          if (P == Prefs.end()) {
+            continue;
+          }
+          ++total;
+          Instruction *B;
+          if (!isForwardable(EL, ELI, DA, AAR, LD, B)) {
+            continue;
+          }
+          ForwardedLoad FL = {P->second, LD, false};
+          FL.Value = Gather && isGatherable(EL, EDT, DA, AAR, LD);
+          if (FL.Value || ForwardAddresses) {
+            Loads.push_back(FL);
+            gathered += FL.Value;
+          }
+        }
+      }
+      if (Loads.empty()) {
+        why = "no indirect address computed the same in both phases";
+      }
+    }
+    if (!why.empty()) {
+      printStart() << "Not forwarded: " << why << "\n";
+      emitKernelRemark(*execute, "NotForwarded", 0, 0, Blocking);
+      return false;
+    }
+
+    GlobalVariable *Buf = forwardBuffer(access);
+    insertForwardStores(AL, AVI, ACond, Loads, Buf);
+    loadForwarded(EL, EDT, EVI, ECond, Loads, Buf);
+    printStart() << "Forwarded: " << Loads.size() << "/" << total
+                 << " addresses  (Gathered: " << gathered << ")\n";
+    emitKernelRemark(*execute, "Forwarded", Loads.size(), 0);
+    return true;
+  }
+
+  // Makes the execute phase stage the scattered stores of its chunk loop
+  // and write them grouped by line at its exits. Only the execute phase
+  // changes, so that it does not matter how the phases are scheduled.
+  // Returns true iff the phase changed.
+  bool combineStores(Function *execute) {
+    string why;
+    ICmpInst *ECond = getChunkCond(execute);
+    PHINode *EVI = ECond ? dyn_cast<PHINode>(ECond->getOperand(0)) : nullptr;
+    if (!EVI) {
+      printStart() << "Not combined: no chunk loop\n";
+      emitKernelRemark(*execute, "NotCombined", 0, 0);
+      return false;
+    }
+
+    // (DependenceAnalysis first: it recomputes the loops of execute)
+    DependenceAnalysis *DA = &getAnalysis<DependenceAnalysis>(*execute);
+    DominatorTree EDT(*execute);
+    LoopInfo ELI(EDT);
+    BasicAAResult BAR(createLegacyPMBasicAAResult(*this, *execute));
+    AAResults AAR(createLegacyPMAAResults(*this, *execute, BAR));
+
+    Loop *EL = ELI.getLoopFor(EVI->getParent());
+    SetVector<StoreInst *> Stores;
+    Blocking = nullptr;
+    if (!EL || EL->getHeader() != EVI->getParent() ||
+        !hasChunkLength(EL, EVI, ECond)) {
+      why = "no chunk bound";
+    } else {
+      findCombinedStores(EL, ELI, DA, AAR, Stores, why, Blocking);
+    }
+    if (!why.empty()) {
+      printStart() << "Not combined: " << why << "\n";
+      emitKernelRemark(*execute, "NotCombined", 0, 0, Blocking);
+      return false;
+    }
+
+    stageStores(EL, EVI, ECond, Stores, combineBuffer(execute), CombineShift);
+    printStart() << "Combined: " << Stores.size() << " stores\n";
+    emitKernelRemark(*execute, "Combined", Stores.size(), 0);
+    return true;
+  }
+
   // Returns true iff F is an F_kernel function.
   bool isFKernel(Function &F) {
     return F.getName().str().find(F_KERNEL_SUBSTR) != string::npos &&
-           F.getName().str().find(CLONE_SUFFIX) == string::npos;
+           F.getName().str().find(CLONE_SUFFIX) == string::npos &&
+           !F.hasFnAttribute(DAE_ATTR_DISPATCH);
+  }
+
+  // Returns true iff the access phase can run on the helper thread: it
+  // cannot throw, it is only called directly, and it reads no stack memory
+  // of its caller, which the caller may reuse before the helper is done.
+  // Neither may the execute phase throw, nor be invoked: task_DAE_sync
+  // waits for the helper on the normal return only, and an unwind would
+  // leave it running into the next task_DAE.
+  bool canRunOnHelper(Function *access, Function *execute) {
+    const char *why = nullptr;
+    if (FusePhases) {
+      why = "fused phases";
+    } else if (!access->doesNotThrow()) {
+      why = "access phase may throw";
+    } else if (mayThrow(*execute)) {
+      why = "execute phase may throw";
+    }
+    for (User *U : access->users()) {
+      if (isa<InvokeInst>(U)) {
+        why = "invoked";
+        break;
+      }
+      CallInst *Call = dyn_cast<CallInst>(U);
+      if (!Call || Call->getCalledFunction() != access) {
+        why = "not a direct call";
+        break;
+      }
+      Function::arg_iterator aI = access->arg_begin();
+      for (unsigned i = 0, e = Call->getNumArgOperands(); i != e; ++i, ++aI) {
+        if (isa<AllocaInst>(Call->getArgOperand(i)) && !aI->use_empty()) {
+          why = "reads the stack of its caller";
+        }
+      }
+    }
+    if (why) {
+      printStart() << "Helper thread: no, " << why << "\n";
+      return false;
+    }
+    printStart() << "Helper thread: " << access->getName() << "_task\n";
+    return true;
+  }
+
+  // Returns the compare of F's chunk loop against the chunk bound, if any.
+  ICmpInst *getChunkCond(Function *F) {
+    for (inst_iterator iI = inst_begin(F), iE = inst_end(F); iI != iE; ++iI) {
+      if (InstrhasMetadata(&*iI, "VirtualIt", "chunkCond")) {
+        return cast<ICmpInst>(&*iI);
+      }
+    }
+    return nullptr;
+  }
+
+  // Adds the L2 level in front of the access phase: a copy of access
+  // bounded by lo + granularity_l2 instead of the chunk bound, whose
+  // prefetches target L2, called whenever the chunk [lo, hi) contains the
+  // start of a super-chunk (lo % granularity_l2 < hi - lo).
+  void insertSuperChunkAccess(Function *access) {
+    ICmpInst *Cond = getChunkCond(access);
+    if (!Cond || access->hasFnAttribute(DAE_ATTR_FULL_CHUNK)) {
+      printStart() << "Two-level: no chunk bound\n";
+      return;
+    }
+    BasicBlock *Entry = &access->getEntryBlock();
+    PHINode *VI = dyn_cast<PHINode>(Cond->getOperand(0));
+    GlobalVariable *State = access->getParent()->getNamedGlobal(
+        getInstructionMD(Cond, DAE_CHUNK_STATE_MD));
+    if (!VI || VI->getBasicBlockIndex(Entry) < 0 || !State) {
+      printStart() << "Two-level: no chunk bound\n";
+      return;
+    }
+    Value *Lo = VI->getIncomingValueForBlock(Entry);
+    Value *Hi = Cond->getOperand(1);
+    Type *I32 = Type::getInt32Ty(access->getContext());
+    Type *I64 = Type::getInt64Ty(access->getContext());
+    Constant *Idx[] = {ConstantInt::get(I32, 0),
+                       ConstantInt::get(I32, DAE_CHUNK_GRAN_L2)};
+    Constant *GranL2 =
+        ConstantExpr::getInBoundsGetElementPtr(State->getValueType(), State,
+                                               Idx);
+
+    // The L2 copy: super-chunk bound, low locality prefetches.
+    ValueToValueMapTy VMap;
+    Function *l2 = cloneFunction(access, CLONE_SUFFIX "_l2", VMap);
+    ICmpInst *l2Cond = cast<ICmpInst>(VMap[Cond]);
+    Value *l2Lo = VMap.count(Lo) ? (Value *)VMap[Lo] : Lo;
+    Instruction *l2Term = l2->getEntryBlock().getTerminator();
+    Instruction *l2Gran = new LoadInst(GranL2, "granularity_l2", l2Term);
+    l2Cond->setOperand(1, BinaryOperator::CreateAdd(l2Lo, l2Gran,
+                                                    "super_hi", l2Term));
+    for (inst_iterator iI = inst_begin(l2), iE = inst_end(l2); iI != iE;
+         ++iI) {
+      IntrinsicInst *II = dyn_cast<IntrinsicInst>(&*iI);
+      if (II && II->getIntrinsicID() == Intrinsic::prefetch) {
+        II->setArgOperand(2, ConstantInt::get(I32, 2)); // L2
+      }
+    }
+
+    // entry: g2 = granularity_l2; g2 ? check : cont
+    // check: lo % g2 < hi - lo ? super : cont
+    // super: l2(args); cont
+    LLVMContext &C = access->getContext();
+    BasicBlock *Cont = SplitBlock(Entry, Entry->getTerminator());
+    BasicBlock *Check = BasicBlock::Create(C, "super_check", access, Cont);
+    BasicBlock *Super = BasicBlock::Create(C, "super_access", access, Cont);
+
+    Entry->getTerminator()->eraseFromParent();
+    IRBuilder<> Builder(Entry);
+    Value *G2 = Builder.CreateLoad(GranL2, "granularity_l2");
+    Builder.CreateCondBr(
+        Builder.CreateICmpNE(G2, ConstantInt::get(I64, 0)), Check, Cont);
+
+    Builder.SetInsertPoint(Check);
+    Value *Offset = Builder.CreateURem(Lo, G2);
+    Value *Span = Builder.CreateSub(Hi, Lo);
+    Builder.CreateCondBr(Builder.CreateICmpULT(Offset, Span), Super, Cont);
+
+    Builder.SetInsertPoint(Super);
+    std::vector<Value *> Args;
+    for (auto &A : access->args()) {
+      Args.push_back(&A);
+    }
+    Builder.CreateCall(l2, Args);
+    Builder.CreateBr(Cont);
+
+    printStart() << "Two-level: " << l2->getName() << "\n";
+  }
+
+  // Pipelines the access phase one chunk ahead of the execute phase:
+  //   access(lo, hi):  if (lo == 0) access_cur(lo, hi)  // prologue
+  //                    chunk loop over [hi, 2 * hi - lo + lookahead)
+  // access_cur is the unchanged access phase. The chunk loop starts with
+  // its header PHIs evaluated at iteration hi - lo, which requires them to
+  // be affine; its own exits must be computable, so that it only runs
+  // iterations that the execute phase will run. The last execute phase
+  // (the epilogue) has nothing left to prefetch.
+  void insertPipelinedAccess(Function *access) {
+    ICmpInst *Cond = getChunkCond(access);
+    PHINode *VI = Cond ? dyn_cast<PHINode>(Cond->getOperand(0)) : nullptr;
+    if (!VI || access->hasFnAttribute(DAE_ATTR_FULL_CHUNK)) {
+      printStart() << "Pipeline: no chunk bound\n";
+      return;
+    }
+    // every window of a tiled chunk calls the kernel with the same bounds:
+    // the next chunk would be prefetched once per window, for this window
+    if (InstrhasMetadataKind(Cond, DAE_CHUNK_TILED_MD)) {
+      printStart() << "Pipeline: tiled chunks, not pipelined\n";
+      return;
+    }
+
+    DominatorTree DT(*access);
+    LoopInfo LI(DT);
+    AssumptionCache AC(*access);
+    TargetLibraryInfoImpl TLII(Triple(access->getParent()->getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    ScalarEvolution SE(*access, TLI, AC, DT, LI);
+
+    Loop *L = LI.getLoopFor(VI->getParent());
+    BasicBlock *Pre = L ? L->getLoopPreheader() : nullptr;
+    if (!Pre || L->getHeader() != VI->getParent()) {
+      printStart() << "Pipeline: no chunk bound\n";
+      return;
+    }
+    Value *Lo = VI->getIncomingValueForBlock(Pre);
+    Value *Hi = Cond->getOperand(1);
+    Instruction *HiI = dyn_cast<Instruction>(Hi);
+    if (HiI && L->contains(HiI)) {
+      printStart() << "Pipeline: chunk bound varies\n";
+      return;
+    }
+
+    SmallVector<BasicBlock *, 4> Exiting;
+    L->getExitingBlocks(Exiting);
+    for (BasicBlock *BB : Exiting) {
+      if (BB != Cond->getParent() &&
+          isa<SCEVCouldNotCompute>(SE.getExitCount(L, BB))) {
+        printStart() << "Pipeline: exit " << BB->getName()
+                     << " not computable\n";
+        return;
+      }
+    }
+    std::vector<std::pair<PHINode *, const SCEVAddRecExpr *>> IVs;
+    for (BasicBlock::iterator I = L->getHeader()->begin(); isa<PHINode>(I);
+         ++I) {
+      PHINode *P = cast<PHINode>(&*I);
+      if (P == VI) {
+        continue;
+      }
+      const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(P));
+      if (!AR || AR->getLoop() != L || !AR->isAffine()) {
+        printStart() << "Pipeline: " << P->getName() << " is not affine\n";
+        return;
+      }
+      IVs.push_back(std::make_pair(P, AR));
+    }
+
+    // The prologue: the unchanged access phase, for chunk 0.
+    ValueToValueMapTy VMap;
+    Function *cur = cloneFunction(access, CLONE_SUFFIX "_cur", VMap);
+
+    // Start one chunk later, hi - lo iterations on.
+    Instruction *Term = Pre->getTerminator();
+    IRBuilder<> Builder(Term);
+    Value *Span = Builder.CreateSub(Hi, Lo, "chunk_span");
+    Value *NextHi = Builder.CreateAdd(
+        Builder.CreateAdd(Hi, Span),
+        ConstantInt::get(Hi->getType(), ChunkLookahead), "next_hi");
+    const SCEV *SpanS = SE.getSCEV(Span);
+    SCEVExpander Expander(SE, access->getParent()->getDataLayout(),
+                          "pipeline");
+    std::vector<std::pair<PHINode *, Value *>> Starts;
+    for (auto &IV : IVs) {
+      const SCEV *Step = IV.second->getStepRecurrence(SE);
+      const SCEV *Start = SE.getAddExpr(
+          IV.second->getStart(),
+          SE.getMulExpr(Step,
+                        SE.getTruncateOrSignExtend(SpanS, Step->getType())));
+      Starts.push_back(std::make_pair(
+          IV.first,
+          Expander.expandCodeFor(Start, IV.first->getType(), Term)));
+    }
+    for (auto &S : Starts) {
+      S.first->setIncomingValue(S.first->getBasicBlockIndex(Pre), S.second);
+    }
+    VI->setIncomingValue(VI->getBasicBlockIndex(Pre), Hi);
+    Cond->setOperand(1, NextHi);
+
+    // pre: lo == 0 ? prologue : steady
+    // prologue: access_cur(args); steady
+    // steady: the chunk loop, one chunk ahead
+    LLVMContext &C = access->getContext();
+    BasicBlock *Steady = SplitBlock(Pre, Term);
+    BasicBlock *Prologue =
+        BasicBlock::Create(C, "pipeline_prologue", access, Steady);
+    Pre->getTerminator()->eraseFromParent();
+    Builder.SetInsertPoint(Pre);
+    Builder.CreateCondBr(
+        Builder.CreateICmpEQ(Lo, ConstantInt::get(Lo->getType(), 0)),
+        Prologue, Steady);
+
+    Builder.SetInsertPoint(Prologue);
+    std::vector<Value *> Args;
+    for (auto &A : access->args()) {
+      Args.push_back(&A);
+    }
+    Builder.CreateCall(cur, Args);
+    Builder.CreateBr(Steady);
+
+    printStart() << "Pipeline: " << cur->getName() << " for chunk 0";
+    if (ChunkLookahead) {
+      PRINTSTREAM << ", lookahead " << ChunkLookahead;
+    }
+    PRINTSTREAM << "\n";
   }
 
   // Returns true iff F is the main function.
@@ -243,9 +1132,14 @@ protected:
   // clone is returned.
   Function *cloneFunction(Function *F) {
     ValueToValueMapTy VMap;
+    return cloneFunction(F, CLONE_SUFFIX, VMap);
+  }
+
+  Function *cloneFunction(Function *F, const char *Suffix,
+                          ValueToValueMapTy &VMap) {
     Function *cF =
         Function::Create(F->getFunctionType(), F->getLinkage(),
-                         F->getName() + CLONE_SUFFIX, F->getParent());
+                         F->getName() + Suffix, F->getParent());
     for (Function::arg_iterator aI = F->arg_begin(), aE = F->arg_end(),
                                 acI = cF->arg_begin(), acE = cF->arg_end();
          aI != aE; ++aI, ++acI) {
@@ -300,6 +1194,7 @@ protected:
                   bool followStores = true, bool followCalls = true) {
     bool res = true;
     queue<Instruction *> Q;
+    Blocking = nullptr;
     for (set<Instruction *>::iterator I = Set.begin(), E = Set.end();
          I != E && res; ++I) {
       enqueueOperands(*I, DepSet, Q);
@@ -333,6 +1228,9 @@ protected:
           res = checkCalls(Inst);
         }
       }
+      if (!res) {
+        Blocking = Inst;
+      }
     }
     return res;
   }
@@ -520,7 +1418,19 @@ protected:
     }
   }
 
-  void removeUnlisted(Function &F, set<Instruction *> &KeepSet) {
+  // Returns true iff an instruction of F may throw.
+  bool mayThrow(Function &F) {
+    for (inst_iterator iI = inst_begin(F), iE = inst_end(F); iI != iE; ++iI) {
+      if (iI->mayThrow()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns the number of removed instructions.
+  unsigned removeUnlisted(Function &F, set<Instruction *> &KeepSet) {
+    unsigned removed = 0;
     set<Instruction *>::iterator ksI = KeepSet.begin(), ksE = KeepSet.end();
     for (inst_iterator iI = inst_begin(F), iE = inst_end(F); iI != iE;) {
       Instruction *Inst = &(*iI);
@@ -528,11 +1438,29 @@ protected:
       if (find(ksI, ksE, Inst) == ksE) {
         Inst->replaceAllUsesWith(UndefValue::get(Inst->getType()));
         Inst->eraseFromParent();
+        ++removed;
       }
     }
+    return removed;
   }
 
-  enum PrefInsertResult { Inserted, BadDeps, IndirLimit, Redundant };
+  enum PrefInsertResult {
+    Inserted,
+    BadDeps,
+    IndirLimit,
+    Redundant,
+    Pruned,
+    Idiom
+  };
+
+  // What was decided for one candidate load, and why.
+  struct PrefDecision {
+    LoadInst *Load;
+    PrefInsertResult Result;
+    Instruction *Blocking; // prohibited dependency or covering load, if any
+    unsigned SliceSize;    // instructions the prefetch depends on
+    unsigned Indirs;       // loads among them
+  };
 
   // Inserts a prefetch for every LoadInst in toPref
   // that fulfils the criterion of being inserted.
@@ -541,13 +1469,20 @@ protected:
   // Returns the number of inserted prefetches.
   int insertPrefetches(list<LoadInst *> &toPref, set<Instruction *> &toKeep,
                        bool printRes = false, bool onlyPrintOnSuccess = false) {
-    int total = 0, ins = 0, bad = 0, indir = 0, red = 0;
+    int total = 0, ins = 0, bad = 0, indir = 0, red = 0, pruned = 0,
+        idiom = 0;
     map<LoadInst *, pair<CastInst *, CallInst *>> prefs;
     set<Instruction *> prefToKeep;
+    map<LoadInst *, PrefDecision> decisions;
     // Insert prefetches
     for (list<LoadInst *>::iterator I = toPref.begin(), E = toPref.end();
          I != E; I++) {
-      switch (insertPrefetch(*I, prefToKeep, prefs)) {
+      PrefDecision &D = decisions[*I];
+      D.Load = *I;
+      D.Blocking = nullptr;
+      D.SliceSize = D.Indirs = 0;
+      D.Result = insertPrefetch(*I, prefToKeep, prefs, D);
+      switch (D.Result) {
       case Inserted:
         ++ins;
         break;
@@ -560,6 +1495,12 @@ protected:
       case Redundant:
         ++red;
         break;
+      case Pruned:
+        ++pruned;
+        break;
+      case Idiom:
+        ++idiom;
+        break;
       }
     }
     // Remove unqualified prefetches from toKeep
@@ -576,16 +1517,24 @@ protected:
           prefToKeep.erase(Cast);
           prefToKeep.erase(Prefetch);
           ++red;
+          decisions[LInst].Result = Redundant;
+          decisions[LInst].Blocking = LInst;
         }
       }
     }
     toKeep.insert(prefToKeep.begin(), prefToKeep.end());
+    for (list<LoadInst *>::iterator I = toPref.begin(), E = toPref.end();
+         I != E; I++) {
+      emitLoadRemark(decisions[*I]);
+    }
     // Print results
     if (printRes && (!onlyPrintOnSuccess || ins > 0)) {
-      total = ins + bad + indir;
+      total = ins + bad + indir + pruned + idiom;
       printStart() << "Prefetches: "
                    << "Inserted: " << ins << "/" << total << "  (Bad: " << bad
-                   << "  Indir: " << indir << "  Red: " << red << ")\n";
+                   << "  Indir: " << indir << "  Red: " << red
+                   << "  Pruned: " << pruned << "  Idiom: " << idiom
+                   << ")\n";
     }
     return ins;
   }
@@ -597,17 +1546,30 @@ protected:
   // Returns the result of the insertion.
   PrefInsertResult
   insertPrefetch(LoadInst *LInst, set<Instruction *> &toKeep,
-                 map<LoadInst *, pair<CastInst *, CallInst *>> &prefs) {
+                 map<LoadInst *, pair<CastInst *, CallInst *>> &prefs,
+                 PrefDecision &D) {
+
+    if (PrunedLoads.count(getInstructionMD(LInst, DAE_LOAD_ID_MD))) {
+      return Pruned;
+    }
+
+    if (IdiomLoads.count(LInst)) {
+      return Idiom;
+    }
 
     // Follow dependencies
     set<Instruction *> Deps;
-    if (followDeps(LInst, Deps)) {
+    bool depsOk = followDeps(LInst, Deps);
+    D.SliceSize = Deps.size();
+    D.Indirs = countLoads(Deps);
+    if (depsOk) {
       if (isUnderThreshold(Deps)) {
         toKeep.insert(Deps.begin(), Deps.end());
       } else {
         return IndirLimit;
       }
     } else {
+      D.Blocking = Blocking;
       return BadDeps;
     }
 
@@ -628,6 +1590,7 @@ protected:
         if (BB == EntryBlock && LDBB == EntryBlock ||
             BB != EntryBlock && LDBB != EntryBlock) {
           prefetchExists = true;
+          D.Blocking = LD;
           break;
         }
       }
@@ -654,6 +1617,8 @@ protected:
     CallInst *Prefetch = Builder.CreateCall(
         PrefFun, {Cast, ConstantInt::get(I32, 0),                       // read
                   ConstantInt::get(I32, 3), ConstantInt::get(I32, 1)}); // data
+    // (named after its load, for -dae-forward)
+    Prefetch->setMetadata(DAE_LOAD_ID_MD, LInst->getMetadata(DAE_LOAD_ID_MD));
 
     // Inset prefetch instructions into book keeping
     toKeep.insert(Cast);
@@ -663,8 +1628,19 @@ protected:
     return Inserted;
   }
 
+  unsigned countLoads(set<Instruction *> &Deps) {
+    unsigned count = 0;
+    for (set<Instruction *>::iterator dI = Deps.begin(), dE = Deps.end();
+         dI != dE; ++dI) {
+      if (LoadInst::classof(*dI)) {
+        ++count;
+      }
+    }
+    return count;
+  }
+
   bool isUnderThreshold(set<Instruction *> Deps) {
-    unsigned thresh = IndirThresh;
+    unsigned thresh = MaxIndirs;
     unsigned count = 0;
     for (set<Instruction *>::iterator dI = Deps.begin(), dE = Deps.end();
          dI != dE && count <= thresh; ++dI) {
@@ -675,6 +1651,79 @@ protected:
     return count <= thresh;
   }
 
+  // Single-quoted YAML scalar of the textual IR of I.
+  string yamlInst(Instruction *I) {
+    string str;
+    raw_string_ostream os(str);
+    os << *I;
+    os.flush();
+    string quoted = "'";
+    for (char c : StringRef(str).trim().str()) {
+      quoted += c;
+      if (c == '\'') {
+        quoted += c;
+      }
+    }
+    return quoted + "'";
+  }
+
+  void emitDebugLoc(Instruction *I) {
+    const DebugLoc &DL = I->getDebugLoc();
+    if (DL) {
+      *Remarks << "DebugLoc:        { File: '" << DL->getFilename()
+               << "', Line: " << DL.getLine() << ", Column: " << DL.getCol()
+               << " }\n";
+    }
+  }
+
+  void emitLoadRemark(PrefDecision &D) {
+    static const char *Names[] = {"Inserted", "BadDeps", "IndirLimit",
+                                  "Redundant", "Pruned", "Idiom"};
+    if (!Remarks) {
+      return;
+    }
+    bool passed = D.Result == Inserted || D.Result == Idiom;
+    *Remarks << "--- !" << (passed ? "Passed" : "Missed")
+             << "\n"
+             << "Pass:            " << "f-kernel-prefetch" << "\n"
+             << "Name:            " << Names[D.Result] << "\n";
+    emitDebugLoc(D.Load);
+    Function *F = D.Load->getParent()->getParent();
+    *Remarks << "Function:        '" << F->getName() << "'\n"
+             << "LoadID:          '"
+             << getInstructionMD(D.Load, DAE_LOAD_ID_MD) << "'\n"
+             << "Load:            " << yamlInst(D.Load) << "\n";
+    if (D.Blocking) {
+      *Remarks << "Blocking:        " << yamlInst(D.Blocking) << "\n";
+    }
+    *Remarks << "SliceSize:       " << D.SliceSize << "\n"
+             << "Indirections:    " << D.Indirs << "\n"
+             << "MaxIndirections: " << MaxIndirs << "\n"
+             << "...\n";
+  }
+
+  void emitKernelRemark(Function &F, const char *Name, int prefs,
+                        unsigned removed, Instruction *Block = nullptr) {
+    if (!Remarks) {
+      return;
+    }
+    unsigned kept = 0;
+    for (inst_iterator iI = inst_begin(F), iE = inst_end(F); iI != iE; ++iI) {
+      ++kept;
+    }
+    *Remarks << "--- !Analysis\n"
+             << "Pass:            " << "f-kernel-prefetch" << "\n"
+             << "Name:            " << Name << "\n"
+             << "Function:        '" << F.getName() << "'\n"
+             << "Prefetches:      " << prefs << "\n"
+             << "Kept:            " << kept << "\n"
+             << "Removed:         " << removed << "\n";
+    if (Block) {
+      *Remarks << "Blocking:        " << yamlInst(Block) << "\n";
+    }
+    *Remarks << "...\n";
+  }
+
   raw_ostream &printStart() { return (PRINTSTREAM << LIBRARYNAME << ": "); }
 };
 }
@@ -22,11 +22,15 @@
 #include <iostream>
 
 #include "../SkelUtils/CFGhacking.cpp"
+#include "../SkelUtils/ChunkFootprint.cpp"
 #include "../SkelUtils/LoopUtils.cpp"
+#include "../SkelUtils/ParallelChunks.cpp"
+#include "../SkelUtils/TileChunks.cpp"
 #include "../SkelUtils/Utils.cpp"
 #include "Util/Annotation/MetadataInfo.h"
 
 using namespace llvm;
+using namespace util;
 
 #define F_KERNEL_SUBSTR "__kernel__"
 
@@ -34,6 +38,31 @@ static cl::opt<std::string> BenchName("bench-name",
                                       cl::desc("The benchmark name"),
                                       cl::value_desc("name"));
 
+// Chunks of 2-D nests also cover a window of the inner loop (tile_width
+// iterations, see TileChunks.cpp). A loop with "llvm.loop.dae.tile" is tiled
+// with its own width regardless.
+static cl::opt<bool> Tile("dae-tile",
+                          cl::desc("Chunk 2-D loop nests by tiles"));
+
+// Loops without their own granularity default to the largest one whose
+// chunk footprint fits half of this cache (see ChunkFootprint.cpp).
+static cl::opt<unsigned> GranCache(
+    "dae-gran-cache", cl::init(32768),
+    cl::desc("Cache size in bytes that sizes the default granularity"),
+    cl::value_desc("bytes"));
+
+// Loops whose iterations are independent, up to reductions, run as tasks
+// of the work-stealing pool of libDAE_parallel; each task runs its range of
+// iterations by chunks (see ParallelChunks.cpp).
+static cl::opt<bool>
+    Parallel("dae-parallel",
+             cl::desc("Run the chunks of independent loops in parallel"));
+
+static cl::opt<unsigned> ParallelGrain(
+    "dae-parallel-grain", cl::init(0),
+    cl::desc("Iterations per parallel task (0: chosen at run time)"),
+    cl::value_desc("n"));
+
 namespace {
 struct LoopChunk : public LoopPass {
 
@@ -43,6 +72,8 @@ struct LoopChunk : public LoopPass {
   virtual void getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequired<LoopInfoWrapperPass>();
     AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+    AU.addRequired<DependenceAnalysis>();
   }
 
   bool runOnLoop(Loop *L, LPPassManager &) {
@@ -51,29 +82,84 @@ struct LoopChunk : public LoopPass {
 
     if (L->getHeader()->getName().str().find(F_KERNEL_SUBSTR) != string::npos) {
       LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
-      Value *vi, *ub;
-      Instruction *lvi;
-      PHINode *phi_vi;
+      ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
 
-      insertVirtualIterator(L, vi, ub);
-      if (L->getLoopDepth() > 1) {
-        initializeVIinParentHeader(L, vi);
+      if (Parallel && !F->hasFnAttribute(DAE_ATTR_TASK)) {
+        std::string why;
+        ParallelChunks P;
+        if (analyzeParallelChunks(L, SE, &getAnalysis<DependenceAnalysis>(),
+                                  P, why)) {
+          SE->forgetLoop(L);
+          Function *task = outlineParallelChunks(L, P, ParallelGrain, LI);
+          errs() << "Running " << h->getName() << " in parallel by "
+                 << task->getName() << "\n";
+          // the loop is chunked in the task, once this pass reaches it
+          LI->markAsRemoved(L);
+          return true;
+        }
+        errs() << "Not running " << h->getName() << " in parallel: " << why
+               << "\n";
       }
 
-      Value *vi_dcb_val;
-      BasicBlock *dcb = BuildChunkingBlock(h, vi, ub, vi_dcb_val);
+      // per-loop granularity from "llvm.loop.dae.granularity", if any
+      unsigned gran = 0;
+      getDAEHint(L, DAE_HINT_GRANULARITY, gran);
+
+      // per-loop tile width from "llvm.loop.dae.tile", if any
+      unsigned tile = 0;
+      bool tiled = getDAEHint(L, DAE_HINT_TILE, tile) || Tile;
+
+      uint64_t footprint = estimateChunkFootprint(L, LI, SE);
+      // backedges left over by loop-simplify (e.g. the continues of a
+      // while loop) are merged, the chunk counts iterations on one latch
+      // (which takes over the hints read above)
+      insertArtificialLoopLatch(L, LI);
+      PHINode *phi_vi, *chunk_lo;
+      Value *chunk_hi;
+      BasicBlock *entry;
+
+      ChunkTile T;
+      if (tiled) {
+        std::string why;
+        tiled = analyzeChunkTile(L, SE, &getAnalysis<DependenceAnalysis>(),
+                                 T, why);
+        if (!tiled)
+          errs() << "Not tiling " << h->getName() << ": " << why << "\n";
+      }
+
+      // the build's granularity, unless it keeps this default; a loop
+      // with its own granularity is not refined at run time
+      unsigned autoGran = granularityForCache(footprint, GranCache);
+      errs() << "Footprint of " << h->getName() << ": " << footprint
+             << " bytes per iteration, granularity " << autoGran << "\n";
+      GlobalVariable *state = insertChunkState(
+          L, gran ? gran : (autoGran ? autoGran : GRAN), gran, tile, tile,
+          gran ? 0 : footprint);
+
+      BasicBlock *dcb =
+          BuildChunkingBlock(h, state, entry, chunk_lo, chunk_hi, gran);
       if (L->getLoopDepth() > 1) {
         Loop *Lp = L->getParentLoop();
         if (Lp) {
+          Lp->addBasicBlockToLoop(entry, *LI);
           Lp->addBasicBlockToLoop(dcb, *LI);
         }
       }
-      BasicBlock *ch = insertChunkCond(L, LI, vi, ub, dcb, vi_dcb_val, phi_vi);
+      BasicBlock *ch =
+          insertChunkCond(L, LI, chunk_lo, chunk_hi, entry, dcb, phi_vi);
+      Instruction *chunkCond =
+          cast<Instruction>(cast<BranchInst>(ch->getTerminator())->getCondition());
+      AttachMetadata(chunkCond, DAE_CHUNK_STATE_MD, state->getName().str());
       BasicBlock *latch = L->getLoopLatch();
 
-      incrementVirtualIteratorSpec(latch, vi, phi_vi);
+      incrementVirtualIteratorSpec(latch, phi_vi);
 
-      replaceEdgesDecBlocks(ch, dcb, LI);
+      replaceEdgesDecBlocks(ch, dcb, entry, LI);
+      moveHeaderPhis(L, h, entry, dcb);
+      if (tiled) {
+        insertChunkTile(L, T, h, entry, dcb, state, tile, LI);
+        AttachMetadata(chunkCond, DAE_CHUNK_TILED_MD, state->getName().str());
+      }
       return true;
     }
     return false;
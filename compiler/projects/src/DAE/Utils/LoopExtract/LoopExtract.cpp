@@ -14,9 +14,15 @@
 /// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
 /// the LICENSE file for details.
 //===----------------------------------------------------------------------===//
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
@@ -31,6 +37,9 @@
 using namespace llvm;
 
 #include "../SkelUtils/Utils.cpp"
+#include "Util/Annotation/MetadataInfo.h"
+
+using namespace util;
 
 static cl::opt<std::string> BenchName("bench-name",
                                       cl::desc("The benchmark name"),
@@ -39,6 +48,20 @@ static cl::opt<std::string> BenchName("bench-name",
 static cl::opt<bool> IsDae("is-dae",
                            cl::desc("Use depth-based DAE loop detection"));
 
+// Chunk kernels get one version per listed granularity, with a constant
+// chunk bound, picked by a dispatcher from the runtime chunk size.
+static cl::list<unsigned>
+    SpecializeGran("specialize-gran",
+                   cl::desc("Specialize DAE kernels for these granularities"),
+                   cl::CommaSeparated, cl::value_desc("g1,g2,..."));
+
+// Live-ins and live-outs are passed as separate arguments, in registers, up
+// to this count; kernels with more get one aggregate argument on the stack.
+static cl::opt<unsigned> MaxScalarArgs(
+    "max-scalar-args", cl::init(6),
+    cl::desc("Aggregate the arguments of kernels with more live values"),
+    cl::value_desc("n"));
+
 namespace {
 struct LoopExtract : public LoopPass {
   static char ID; // Pass identification, replacement for typeid
@@ -55,6 +78,7 @@ struct LoopExtract : public LoopPass {
     AU.addRequired<LoopInfoWrapperPass>();
   }
 
+  void specializeGranularity(Function *F);
   void PrintModule(Function *F);
   void PrintFunction(Function *F, std::string suf);
   BasicBlock *getCaller(Function *F);
@@ -67,15 +91,172 @@ static RegisterPass<LoopExtract>
     X("second-loop-extract", "Extract second level loops into new functions",
       true, true);
 
+// Arguments of the caller passed straight to the kernel F keep their alias
+// attributes, which still hold for the duration of the call. noalias only
+// holds if no other pointer passed to F may be derived from the argument
+// (e.g. b = a + n, computed before the loop).
+static bool isOnlyPointerTo(CallInst *Call, unsigned i) {
+  const DataLayout &DL = Call->getModule()->getDataLayout();
+  Value *A = Call->getArgOperand(i);
+  for (unsigned j = 0, e = Call->getNumArgOperands(); j != e; ++j) {
+    Value *V = Call->getArgOperand(j);
+    if (j == i || !V->getType()->isPointerTy())
+      continue;
+    Value *U = GetUnderlyingObject(V, DL, 0);
+    if (U == A || (!isa<Argument>(U) && !isIdentifiedObject(U)))
+      return false;
+  }
+  return true;
+}
+
+static void keepArgAttributes(Function *F) {
+  static const Attribute::AttrKind Kept[] = {
+      Attribute::NoAlias, Attribute::NoCapture, Attribute::NonNull,
+      Attribute::ReadOnly, Attribute::ReadNone};
+  CallInst *Call = cast<CallInst>(*F->user_begin());
+  for (unsigned i = 0, e = Call->getNumArgOperands(); i != e; ++i) {
+    Argument *A = dyn_cast<Argument>(Call->getArgOperand(i));
+    if (!A)
+      continue;
+    AttributeSet Attrs = A->getParent()->getAttributes();
+    for (Attribute::AttrKind K : Kept)
+      if (Attrs.hasAttribute(A->getArgNo() + 1, K) &&
+          (K != Attribute::NoAlias || isOnlyPointerTo(Call, i)))
+        F->addAttribute(i + 1, K);
+  }
+}
+
+typedef SmallVector<std::pair<PHINode *, Value *>, 4> PadValues;
+
+// A landing pad stays with the function it unwinds. The invokes of L are
+// turned into calls, so that their exceptions leave the kernel, when they all
+// unwind to a single pad outside L whose PHIs take the same value, defined
+// outside L, from each of them; the call to the kernel then invokes that pad
+// (see invokeKernel). Pad is left null when L has no invoke.
+static bool lowerLoopInvokes(Loop *L, BasicBlock *&Pad, PadValues &PadIn,
+                             SmallVectorImpl<CallInst *> &Lowered) {
+  SmallVector<InvokeInst *, 8> Invokes;
+  Pad = nullptr;
+  for (BasicBlock *BB : L->blocks()) {
+    if (BB->isEHPad())
+      return false;
+    InvokeInst *II = dyn_cast<InvokeInst>(BB->getTerminator());
+    if (!II)
+      continue;
+    BasicBlock *Unwind = II->getUnwindDest();
+    if (L->contains(Unwind) || (Pad && Unwind != Pad))
+      return false;
+    Pad = Unwind;
+    Invokes.push_back(II);
+  }
+  if (!Pad)
+    return true;
+
+  // nothing else may keep the loop in place once its invokes are gone
+  for (BasicBlock *BB : L->blocks())
+    for (Instruction &I : *BB) {
+      if (isa<AllocaInst>(I))
+        return false;
+      if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(&I))
+        if (II->getIntrinsicID() == Intrinsic::vastart)
+          return false;
+    }
+
+  for (BasicBlock::iterator I = Pad->begin(); isa<PHINode>(I); ++I) {
+    PHINode *PN = cast<PHINode>(I);
+    Value *V = PN->getIncomingValueForBlock(Invokes[0]->getParent());
+    if (Instruction *VI = dyn_cast<Instruction>(V))
+      if (L->contains(VI))
+        return false;
+    for (InvokeInst *II : Invokes)
+      if (PN->getIncomingValueForBlock(II->getParent()) != V)
+        return false;
+    PadIn.push_back(std::make_pair(PN, V));
+  }
+
+  for (InvokeInst *II : Invokes) {
+    std::vector<Value *> Args;
+    for (unsigned i = 0, e = II->getNumArgOperands(); i != e; ++i)
+      Args.push_back(II->getArgOperand(i));
+    CallInst *Call = CallInst::Create(II->getCalledValue(), Args, "", II);
+    Call->takeName(II);
+    Call->setCallingConv(II->getCallingConv());
+    Call->setAttributes(II->getAttributes());
+    Call->setDebugLoc(II->getDebugLoc());
+    II->replaceAllUsesWith(Call);
+    for (auto &P : PadIn)
+      P.first->removeIncomingValue(II->getParent(), false);
+    BranchInst::Create(II->getNormalDest(), II);
+    II->eraseFromParent();
+    Lowered.push_back(Call);
+  }
+  return true;
+}
+
+// Turns the calls that lowerLoopInvokes made back into invokes of Pad, when
+// the loop is not extracted after all.
+static void restoreLoopInvokes(ArrayRef<CallInst *> Lowered, BasicBlock *Pad,
+                               const PadValues &PadIn) {
+  for (CallInst *Call : Lowered) {
+    BasicBlock *BB = Call->getParent();
+    TerminatorInst *Br = BB->getTerminator();
+    std::vector<Value *> Args;
+    for (unsigned i = 0, e = Call->getNumArgOperands(); i != e; ++i)
+      Args.push_back(Call->getArgOperand(i));
+    InvokeInst *II = InvokeInst::Create(
+        Call->getCalledValue(), Br->getSuccessor(0), Pad, Args, "", Br);
+    II->takeName(Call);
+    II->setCallingConv(Call->getCallingConv());
+    II->setAttributes(Call->getAttributes());
+    II->setDebugLoc(Call->getDebugLoc());
+    Call->replaceAllUsesWith(II);
+    Call->eraseFromParent();
+    Br->eraseFromParent();
+    for (auto &P : PadIn)
+      P.first->addIncoming(P.second, BB);
+  }
+}
+
+// Turns the call to the kernel F into an invoke of the landing pad its loop
+// unwound to, continuing in a new block that joins Parent.
+static void invokeKernel(Function *F, BasicBlock *Pad, const PadValues &PadIn,
+                         Loop *Parent, LoopInfo *LI) {
+  CallInst *Call = cast<CallInst>(*F->user_begin());
+  BasicBlock *BB = Call->getParent();
+  BasicBlock::iterator Next(Call);
+  BasicBlock *Cont = BB->splitBasicBlock(++Next, BB->getName() + ".cont");
+  BB->getTerminator()->eraseFromParent();
+
+  std::vector<Value *> Args;
+  for (unsigned i = 0, e = Call->getNumArgOperands(); i != e; ++i)
+    Args.push_back(Call->getArgOperand(i));
+  InvokeInst *II = InvokeInst::Create(F, Cont, Pad, Args, "", BB);
+  II->takeName(Call);
+  II->setCallingConv(Call->getCallingConv());
+  II->setAttributes(Call->getAttributes());
+  II->setDebugLoc(Call->getDebugLoc());
+  Call->replaceAllUsesWith(II);
+  Call->eraseFromParent();
+
+  for (auto &P : PadIn)
+    P.first->addIncoming(P.second, BB);
+  if (Parent)
+    Parent->addBasicBlockToLoop(Cont, *LI);
+}
+
 bool LoopExtract::runOnLoop(Loop *L, LPPassManager &LPM) {
   // if already extracted
   Function *F = L->getHeader()->getParent();
 
   // find the chunked loops
   if (IsDae) {
-    // parent loop has to be marked
-    bool isMarked = L->getParentLoop() &&
-      L->getParentLoop()->getHeader()->getName().str().find(F_KERNEL_SUBSTR) != string::npos;
+    // only the chunk loop itself, headed by the chunk condition; its
+    // subloops and the chunking (or tile) loops around it stay in place
+    BranchInst *Br = dyn_cast<BranchInst>(L->getHeader()->getTerminator());
+    bool isMarked = Br && Br->isConditional() &&
+                    isa<Instruction>(Br->getCondition()) &&
+                    InstrhasMetadata(cast<Instruction>(Br->getCondition()),
+                                     "VirtualIt", "chunkCond");
     if (!isMarked) {
       return false;
     }
@@ -85,8 +266,10 @@ bool LoopExtract::runOnLoop(Loop *L, LPPassManager &LPM) {
     }
   }
 
-  // If LoopSimplify form is not available, stay out of trouble.
-  if (!L->isLoopSimplifyForm()) {
+  // If LoopSimplify form is not available, stay out of trouble. A chunk loop
+  // has a single entry (the chunking block) and a single latch by
+  // construction, and its exits need not be dedicated to be extracted.
+  if (!IsDae && !L->isLoopSimplifyForm()) {
     return false;
   }
 
@@ -124,27 +307,61 @@ bool LoopExtract::runOnLoop(Loop *L, LPPassManager &LPM) {
     ShouldExtractLoop = true;
   }
 
+  BasicBlock *Pad = nullptr;
+  PadValues PadIn;
+  SmallVector<CallInst *, 8> Lowered;
   if (ShouldExtractLoop) {
-    // We must omit landing pads. Landing pads must accompany the invoke
-    // instruction. But this would result in a loop in the extracted
-    // function. An infinite cycle occurs when it tries to extract that loop as
-    // well.
-    SmallVector<BasicBlock *, 8> ExitBlocks;
-    L->getExitBlocks(ExitBlocks);
-    for (unsigned i = 0, e = ExitBlocks.size(); i != e; ++i)
-      if (ExitBlocks[i]->isLandingPad()) {
-        ShouldExtractLoop = false;
-        break;
-      }
+    // The blocks of the loop may not unwind anywhere but to its landing pad,
+    // which cannot be extracted with them.
+    ShouldExtractLoop = lowerLoopInvokes(L, Pad, PadIn, Lowered);
+    if (Pad)
+      DT.recalculate(*F);
   }
 
   if (ShouldExtractLoop) {
+    // Per-loop DAE parameters do not survive as loop metadata once the loop
+    // has been outlined; keep them as attributes of the new function.
+    unsigned Gran, Indir, Dist, Gather;
+    bool HasGran = getDAEHint(L, DAE_HINT_GRANULARITY, Gran);
+    bool HasIndir = getDAEHint(L, DAE_HINT_INDIRECTION, Indir);
+    bool HasDist = getDAEHint(L, DAE_HINT_DISTANCE, Dist);
+    bool HasGather = getDAEHint(L, DAE_HINT_GATHER, Gather);
 
-    CodeExtractor Extractor(DT, *L);
+    CodeExtractor Probe(DT, *L);
+    SetVector<Value *> Inputs, Outputs;
+    Probe.findInputsOutputs(Inputs, Outputs);
+    bool Aggregate = Inputs.size() + Outputs.size() > MaxScalarArgs;
+
+    CodeExtractor Extractor(DT, *L, Aggregate);
     Function *nF = Extractor.extractCodeRegion();
+    if (!nF && Pad) {
+      // the loop stays in place, and unwinds to its landing pad again
+      restoreLoopInvokes(Lowered, Pad, PadIn);
+      DT.recalculate(*F);
+      Changed = true;
+    }
     if (nF != 0) {
       BasicBlock *codeRepl = getCaller(nF);
+      if (!Aggregate)
+        keepArgAttributes(nF);
+      if (Pad) {
+        if (F->hasUWTable())
+          nF->setHasUWTable();
+        invokeKernel(nF, Pad, PadIn, L->getParentLoop(),
+                     &getAnalysis<LoopInfoWrapperPass>().getLoopInfo());
+        DT.recalculate(*F);
+      }
       nF->addFnAttr(Attribute::AlwaysInline);
+      if (HasGran)
+        nF->addFnAttr(DAE_ATTR_GRANULARITY, std::to_string(Gran));
+      if (HasIndir)
+        nF->addFnAttr(DAE_ATTR_INDIRECTION, std::to_string(Indir));
+      if (HasDist)
+        nF->addFnAttr(DAE_ATTR_DISTANCE, std::to_string(Dist));
+      if (HasGather)
+        nF->addFnAttr(DAE_ATTR_GATHER, std::to_string(Gather));
+      if (IsDae && (!SpecializeGran.empty() || HasGran))
+        specializeGranularity(nF);
 
       Changed = true;
 
@@ -162,6 +379,152 @@ bool LoopExtract::runOnLoop(Loop *L, LPPassManager &LPM) {
   return Changed;
 }
 
+// Clones F into the module under F's name followed by Suffix.
+static Function *cloneKernel(Function *F, const Twine &Suffix,
+                             ValueToValueMapTy &VMap) {
+  Function *cF = Function::Create(F->getFunctionType(), F->getLinkage(),
+                                  F->getName() + Suffix, F->getParent());
+  for (Function::arg_iterator aI = F->arg_begin(), aE = F->arg_end(),
+                              acI = cF->arg_begin();
+       aI != aE; ++aI, ++acI) {
+    acI->setName(aI->getName());
+    VMap[&*aI] = &*acI;
+  }
+  SmallVector<ReturnInst *, 8> Returns; // Ignored
+  CloneFunctionInto(cF, F, VMap, false, Returns);
+  return cF;
+}
+
+// Ends BB with a call to F forwarding the arguments of BB's function.
+static void callAndReturn(BasicBlock *BB, Function *F) {
+  std::vector<Value *> Args;
+  for (auto &A : BB->getParent()->args())
+    Args.push_back(&A);
+  CallInst *Call = CallInst::Create(F, Args, "", BB);
+  if (F->getReturnType()->isVoidTy())
+    ReturnInst::Create(BB->getContext(), BB);
+  else
+    ReturnInst::Create(BB->getContext(), Call, BB);
+}
+
+/*
+  F is an extracted chunk loop: vi runs from lo to the chunk bound hi
+  (the compare tagged VirtualIt/chunkCond). F becomes a dispatcher on
+  hi - lo that calls
+    F_gran<G>  for a full chunk of G iterations: the bound is lo + G and,
+               when the loop's own exit is computable and known not to be
+               taken within the chunk, that exit is removed
+    F_generic  otherwise (other granularities, the remainder of the loop)
+*/
+void LoopExtract::specializeGranularity(Function *F) {
+  ICmpInst *Cond = nullptr;
+  for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E && !Cond; ++I)
+    if (InstrhasMetadata(&*I, "VirtualIt", "chunkCond"))
+      Cond = cast<ICmpInst>(&*I);
+  if (!Cond)
+    return;
+
+  BasicBlock *Entry = &F->getEntryBlock();
+  PHINode *VI = dyn_cast<PHINode>(Cond->getOperand(0));
+  if (!VI || VI->getBasicBlockIndex(Entry) < 0)
+    return;
+  Value *Lo = VI->getIncomingValueForBlock(Entry);
+  Value *Hi = Cond->getOperand(1);
+
+  std::vector<unsigned> Grans(SpecializeGran.begin(), SpecializeGran.end());
+  unsigned Fixed;
+  if (getDAEFnHint(F, DAE_ATTR_GRANULARITY, Fixed))
+    Grans.assign(1, Fixed);
+  std::sort(Grans.begin(), Grans.end());
+  Grans.erase(std::unique(Grans.begin(), Grans.end()), Grans.end());
+
+  // Iterations left before the loop's own exit, if it has a single one.
+  BasicBlock *OwnExit = nullptr;
+  Value *Left = nullptr;
+  bool StayOnTrue = false;
+  {
+    DominatorTree DT(*F);
+    LoopInfo LI(DT);
+    AssumptionCache AC(*F);
+    TargetLibraryInfoImpl TLII(Triple(F->getParent()->getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    ScalarEvolution SE(*F, TLI, AC, DT, LI);
+
+    Loop *L = LI.getLoopFor(Cond->getParent());
+    SmallVector<BasicBlock *, 4> Exiting;
+    L->getExitingBlocks(Exiting);
+    if (Exiting.size() == 2) {
+      OwnExit = Exiting[0] == Cond->getParent() ? Exiting[1] : Exiting[0];
+      const SCEV *EC = SE.getExitCount(L, OwnExit);
+      BranchInst *Br = dyn_cast<BranchInst>(OwnExit->getTerminator());
+      if (!isa<SCEVCouldNotCompute>(EC) && SE.isLoopInvariant(EC, L) && Br &&
+          Br->isConditional()) {
+        SCEVExpander Expander(SE, F->getParent()->getDataLayout(), "chunk");
+        Left = Expander.expandCodeFor(EC, EC->getType(),
+                                      Entry->getTerminator());
+        StayOnTrue = L->contains(Br->getSuccessor(0));
+      }
+    }
+  }
+
+  ValueToValueMapTy GenericMap;
+  Function *Generic = cloneKernel(F, "_generic", GenericMap);
+
+  std::vector<Function *> Specialized;
+  for (unsigned G : Grans) {
+    ValueToValueMapTy VMap;
+    Function *S = cloneKernel(F, "_gran" + Twine(G), VMap);
+    Specialized.push_back(S);
+
+    ICmpInst *SCond = cast<ICmpInst>(VMap[Cond]);
+    Value *SLo = VMap.count(Lo) ? (Value *)VMap[Lo] : Lo;
+    Instruction *Bound = BinaryOperator::CreateAdd(
+        SLo, ConstantInt::get(Hi->getType(), G), "chunk_hi",
+        S->getEntryBlock().getTerminator());
+    SCond->setOperand(1, Bound);
+
+    if (Left) {
+      BranchInst *Br = cast<BranchInst>(
+          cast<BasicBlock>(VMap[OwnExit])->getTerminator());
+      Br->setCondition(ConstantInt::get(Type::getInt1Ty(F->getContext()),
+                                        StayOnTrue));
+      S->addFnAttr(DAE_ATTR_FULL_CHUNK);
+    }
+  }
+
+  // F keeps its entry block (the arguments and the bounds) and dispatches.
+  Entry->getTerminator()->eraseFromParent();
+  std::vector<BasicBlock *> Body;
+  for (Function::iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB)
+    if (&*BB != Entry)
+      Body.push_back(&*BB);
+  for (auto BB : Body)
+    BB->dropAllReferences();
+  for (auto BB : Body)
+    BB->eraseFromParent();
+
+  LLVMContext &C = F->getContext();
+  IRBuilder<> Builder(Entry);
+  Value *Span = Builder.CreateSub(Hi, Lo, "chunk_span");
+  for (unsigned i = 0, e = Grans.size(); i != e; ++i) {
+    Value *Full = Builder.CreateICmpEQ(
+        Span, ConstantInt::get(Span->getType(), Grans[i]));
+    if (Left)
+      Full = Builder.CreateAnd(
+          Full, Builder.CreateICmpUGE(
+                    Left, ConstantInt::get(Left->getType(), Grans[i])));
+    BasicBlock *Call =
+        BasicBlock::Create(C, "gran" + Twine(Grans[i]), F);
+    BasicBlock *Next = BasicBlock::Create(C, "", F);
+    Builder.CreateCondBr(Full, Call, Next);
+    callAndReturn(Call, Specialized[i]);
+    Builder.SetInsertPoint(Next);
+  }
+  callAndReturn(Builder.GetInsertBlock(), Generic);
+
+  F->addFnAttr(DAE_ATTR_DISPATCH);
+}
+
 bool LoopExtract::toBeExtracted(Loop *L) {
   bool isMarked =
       L->getHeader()->getName().str().find(F_KERNEL_SUBSTR) != string::npos;
@@ -18,9 +18,16 @@
 // Description of pass ...
 //
 //===----------------------------------------------------------------------===//
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+#include <map>
 
 #include "../../../DAE/Utils/SkelUtils/Utils.cpp"
+#include "Util/Annotation/MetadataInfo.h"
 
 #define KERNEL_MARKING "__kernel__"
 
@@ -35,12 +42,50 @@ static cl::opt<bool> RequireDelinquent(
     cl::desc("Loop has to contain delinquent loads to be marked"),
     cl::init(true));
 
+// Selects loops without touching the sources. Each non-empty line that does
+// not start with '#' names a function (or '*' for any function) followed by
+// either a source location "file:line" or a loop ID "loop=N", where N is the
+// position of the loop in a depth-first walk of the function's loop nest
+// (see -print-loop-ids). Source locations require debug line information.
+// Optional "granularity=N", "indirection=N", "tile=N", "distance=N" and
+// "gather=0|1" fields set the loop's own DAE parameters, as "llvm.loop.dae.*"
+// loop metadata would.
+// The loops of an OpenMP parallel region, which clang outlines into
+// ".omp_outlined." functions, are selected through the function the region
+// is written in; their loop IDs are counted in the outlined function.
+static cl::opt<std::string>
+    SelectionFile("dae-selection-file",
+                  cl::desc("File listing the loops to mark for DAE"),
+                  cl::value_desc("filename"));
+
+static cl::opt<bool>
+    PrintLoopIDs("print-loop-ids",
+                 cl::desc("Print the loop ID and location of every loop"));
+
 namespace {
+// One entry of the selection file.
+struct LoopSelection {
+  std::string Function; // "*" matches any function
+  std::string File;     // empty if the entry names a loop ID
+  unsigned Line;
+  int LoopID;           // -1 if the entry names a source location
+  unsigned LineNo;      // line in the selection file, for diagnostics
+  bool Matched;
+  unsigned Granularity; // 0 if not given
+  int Indirection;      // -1 if not given (0 disables indirections)
+  unsigned Tile;        // 0 if not given
+  unsigned Distance;    // 0 if not given
+  int Gather;           // -1 if not given
+};
+
 struct MarkLoopsToTransform : public FunctionPass {
 public:
   static char ID;
   MarkLoopsToTransform() : FunctionPass(ID) {}
 
+  bool doInitialization(Module &M);
+  bool doFinalization(Module &M);
+
   virtual void getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequired<LoopInfoWrapperPass>();
     AU.addRequired<DominatorTreeWrapperPass>();
@@ -50,29 +95,260 @@ public:
 
 private:
   unsigned loopCounter = 0;
+  std::map<Loop *, unsigned> LoopIDs; // depth-first position in the function
+  std::vector<LoopSelection> Selections;
+
+  void numberLoops(std::vector<Loop *> Loops, unsigned &Next);
+
   bool markLoops(std::vector<Loop *> Loops, DominatorTree &DT);
+  void markLoop(Loop *L);
+  bool loadSelectionFile(Module &M);
+  bool isSelected(Loop *L, unsigned ID);
+  bool locationMatches(const LoopSelection &S, DebugLoc DL);
 };
 }
 
+// Reads the selection file. Malformed lines are reported and ignored.
+bool MarkLoopsToTransform::loadSelectionFile(Module &M) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf =
+      MemoryBuffer::getFile(SelectionFile);
+  if (!Buf) {
+    errs() << "MarkLoopsToTransform: cannot read selection file '"
+           << SelectionFile << "': " << Buf.getError().message() << "\n";
+    return false;
+  }
+
+  SmallVector<StringRef, 64> Lines;
+  (*Buf)->getBuffer().split(Lines, '\n');
+  for (unsigned i = 0, e = Lines.size(); i != e; ++i) {
+    StringRef Line = Lines[i].trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+
+    SmallVector<StringRef, 4> Fields;
+    SplitString(Line, Fields);
+    StringRef Where = Fields.size() > 1 ? Fields[1] : StringRef();
+    LoopSelection S;
+    S.Function = Fields[0].str();
+    S.Line = 0;
+    S.LoopID = -1;
+    S.LineNo = i + 1;
+    S.Matched = false;
+    S.Granularity = 0;
+    S.Indirection = -1;
+    S.Tile = 0;
+    S.Distance = 0;
+    S.Gather = -1;
+
+    bool Valid = !Where.empty();
+    if (Valid && Where.startswith("loop=")) {
+      unsigned ID;
+      Valid = !Where.substr(5).getAsInteger(10, ID);
+      S.LoopID = ID;
+    } else if (Valid) {
+      size_t Colon = Where.rfind(':');
+      Valid = Colon != StringRef::npos && Colon > 0 &&
+              !Where.substr(Colon + 1).getAsInteger(10, S.Line);
+      S.File = Where.substr(0, Colon).str();
+    }
+
+    for (unsigned f = 2, fe = Fields.size(); Valid && f != fe; ++f) {
+      std::pair<StringRef, StringRef> Param = Fields[f].split('=');
+      if (Param.first == "granularity")
+        Valid = !Param.second.getAsInteger(10, S.Granularity) &&
+                S.Granularity > 0;
+      else if (Param.first == "indirection")
+        Valid = !Param.second.getAsInteger(10, S.Indirection) &&
+                S.Indirection >= 0;
+      else if (Param.first == "tile")
+        Valid = !Param.second.getAsInteger(10, S.Tile) && S.Tile > 0;
+      else if (Param.first == "distance")
+        Valid = !Param.second.getAsInteger(10, S.Distance) && S.Distance > 0;
+      else if (Param.first == "gather")
+        Valid = !Param.second.getAsInteger(10, S.Gather) && S.Gather >= 0 &&
+                S.Gather <= 1;
+      else
+        Valid = false;
+    }
+
+    if (!Valid) {
+      errs() << SelectionFile << ":" << S.LineNo
+             << ": warning: malformed selection entry '" << Line << "'\n";
+      continue;
+    }
+    Selections.push_back(S);
+  }
+  return true;
+}
+
+bool MarkLoopsToTransform::doInitialization(Module &M) {
+  if (!SelectionFile.empty())
+    loadSelectionFile(M);
+  return false;
+}
+
+// Source file names match on a path suffix, so entries may be written
+// relative to any directory of the source tree.
+static bool pathMatches(const std::string &File, StringRef Name,
+                        StringRef Dir) {
+  std::string Path = Name.str();
+  if (!Dir.empty() && !sys::path::is_absolute(Path))
+    Path = Dir.str() + "/" + Path;
+
+  StringRef P(Path);
+  return P == File ||
+         (P.endswith(File) && P.drop_back(File.size()).endswith("/"));
+}
+
+// Entries are only diagnosed in the module that defines the function they
+// refer to, since every source file is marked by its own opt invocation;
+// entries for any function, in the module compiled from their source file
+// (per its debug information). Loop IDs of any function name no file, and
+// are not diagnosed.
+bool MarkLoopsToTransform::doFinalization(Module &M) {
+  NamedMDNode *CUs = M.getNamedMetadata("llvm.dbg.cu");
+  for (auto &S : Selections) {
+    if (S.Matched)
+      continue;
+
+    bool InModule = false;
+    if (S.Function != "*") {
+      Function *F = M.getFunction(S.Function);
+      InModule = F && !F->isDeclaration();
+    } else if (S.LoopID < 0 && CUs) {
+      for (unsigned i = 0, e = CUs->getNumOperands(); i != e && !InModule;
+           ++i)
+        if (DICompileUnit *CU = dyn_cast<DICompileUnit>(CUs->getOperand(i)))
+          InModule =
+              pathMatches(S.File, CU->getFilename(), CU->getDirectory());
+    }
+
+    if (InModule)
+      errs() << SelectionFile << ":" << S.LineNo
+             << ": warning: selection entry for '" << S.Function
+             << "' matched no loop in " << M.getModuleIdentifier() << "\n";
+  }
+  return false;
+}
+
+bool MarkLoopsToTransform::locationMatches(const LoopSelection &S,
+                                           DebugLoc DL) {
+  if (!DL || DL.getLine() != S.Line)
+    return false;
+
+  DILocation *Loc = DL.get();
+  return pathMatches(S.File, Loc->getFilename(), Loc->getDirectory());
+}
+
+// The function an OpenMP outlined function was written in: the caller of
+// __kmpc_fork_call (or, for a serialized region, of the outlined function
+// itself), through nested regions.
+static Function *getSourceFunction(Function *F) {
+  while (F->getName().startswith(".omp_outlined.")) {
+    Function *Parent = nullptr;
+    for (User *U : F->users()) {
+      if (isa<ConstantExpr>(U) && U->hasOneUse())
+        U = *U->user_begin();
+      if (CallInst *CI = dyn_cast<CallInst>(U)) {
+        Parent = CI->getParent()->getParent();
+        break;
+      }
+    }
+    if (!Parent || Parent == F)
+      break;
+    F = Parent;
+  }
+  return F;
+}
+
+bool MarkLoopsToTransform::isSelected(Loop *L, unsigned ID) {
+  Function *F = L->getHeader()->getParent();
+  std::string FName = F->getName().str();
+  std::string SourceName = getSourceFunction(F)->getName().str();
+  bool Selected = false;
+
+  for (auto &S : Selections) {
+    if (S.Function != "*" && S.Function != FName && S.Function != SourceName)
+      continue;
+
+    bool Match = S.LoopID >= 0 ? (unsigned)S.LoopID == ID
+                               : locationMatches(S, L->getStartLoc());
+    if (Match) {
+      S.Matched = true;
+      Selected = true;
+      if (S.Granularity)
+        setDAEHint(L, DAE_HINT_GRANULARITY, S.Granularity);
+      if (S.Indirection >= 0)
+        setDAEHint(L, DAE_HINT_INDIRECTION, S.Indirection);
+      if (S.Tile)
+        setDAEHint(L, DAE_HINT_TILE, S.Tile);
+      if (S.Distance)
+        setDAEHint(L, DAE_HINT_DISTANCE, S.Distance);
+      if (S.Gather >= 0)
+        setDAEHint(L, DAE_HINT_GATHER, S.Gather);
+    }
+  }
+  return Selected;
+}
+
+void MarkLoopsToTransform::markLoop(Loop *L) {
+  BasicBlock *H = L->getHeader();
+  H->setName(Twine(KERNEL_MARKING + H->getParent()->getName().str() +
+                   std::to_string(loopCounter)));
+  loopCounter++;
+
+  // Name every load of the kernel so that later stages (memory traces,
+  // prefetch pruning) can refer to it across cloning and extraction.
+  unsigned loadCounter = 0;
+  for (auto BI = L->block_begin(), BE = L->block_end(); BI != BE; ++BI)
+    for (BasicBlock::iterator I = (*BI)->begin(), E = (*BI)->end(); I != E;
+         ++I)
+      if (isa<LoadInst>(I))
+        util::AttachMetadata(&*I, DAE_LOAD_ID_MD,
+                             H->getName().str() + "." +
+                                 std::to_string(loadCounter++));
+}
+
 bool MarkLoopsToTransform::runOnFunction(Function &F) {
   DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
   LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
   std::vector<Loop *> Loops(LI.begin(), LI.end());
 
+  unsigned Next = 0;
+  LoopIDs.clear();
+  numberLoops(Loops, Next);
+
   return markLoops(Loops, DT);
 }
 
+void MarkLoopsToTransform::numberLoops(std::vector<Loop *> Loops,
+                                       unsigned &Next) {
+  for (auto I = Loops.begin(), IE = Loops.end(); I != IE; ++I) {
+    Loop *L = *I;
+    LoopIDs[L] = Next++;
+
+    if (PrintLoopIDs) {
+      errs() << "MarkLoopsToTransform: "
+             << L->getHeader()->getParent()->getName() << " loop="
+             << LoopIDs[L];
+      if (DebugLoc DL = L->getStartLoc())
+        errs() << " " << DL->getFilename() << ":" << DL.getLine();
+      errs() << "\n";
+    }
+
+    numberLoops(L->getSubLoops(), Next);
+  }
+}
+
 bool MarkLoopsToTransform::markLoops(std::vector<Loop *> Loops,
                                     DominatorTree &DT) {
   bool markedLoop = false;
 
   for (auto I = Loops.begin(), IE = Loops.end(); I != IE; ++I) {
     Loop *L = *I;
-    if (loopToBeDAE(L, BenchName)) {
-      BasicBlock *H = L->getHeader();
-      H->setName(Twine(KERNEL_MARKING + H->getParent()->getName().str() +
-                       std::to_string(loopCounter)));
-      loopCounter++;
+    bool selected = isSelected(L, LoopIDs[L]);
+    if (selected || loopToBeDAE(L, BenchName)) {
+      markLoop(L);
       markedLoop = true;
       continue; // if marked loop, don't check subloops
     }
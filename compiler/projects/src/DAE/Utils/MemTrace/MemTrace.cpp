@@ -0,0 +1,174 @@
+//===- MemTrace.cpp - Records the address stream of DAE kernels -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file MemTrace.cpp
+///
+/// \brief Records the address stream of DAE kernels
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// This file implements a pass that instruments every loop marked for DAE
+// (header name containing "__kernel__") with calls into the DAE trace runtime
+// (tools/DAETrace). Each iteration reports the loop and its static size, and
+// each load carrying a DAELoadID reports its ID, its indirection level, the
+// lowest level of the traced loads whose address depends on it, and the
+// address it reads. The trace is replayed offline by dae-sim.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/Analysis/LoopPass.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include <map>
+
+#include "../SkelUtils/Utils.cpp"
+#include "Util/Annotation/MetadataInfo.h"
+
+#define F_KERNEL_SUBSTR "__kernel__"
+
+using namespace llvm;
+using namespace util;
+
+namespace {
+struct MemTrace : public FunctionPass {
+  static char ID;
+  MemTrace() : FunctionPass(ID) {}
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<LoopInfoWrapperPass>();
+  }
+
+  bool runOnFunction(Function &F);
+
+private:
+  bool instrumentLoops(std::vector<Loop *> Loops);
+  void instrumentLoop(Loop *L);
+  void getAddressSlice(LoadInst *LInst, std::set<Instruction *> &Deps);
+  unsigned countIndirections(LoadInst *LInst);
+};
+}
+
+bool MemTrace::runOnFunction(Function &F) {
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  std::vector<Loop *> Loops(LI.begin(), LI.end());
+  return instrumentLoops(Loops);
+}
+
+bool MemTrace::instrumentLoops(std::vector<Loop *> Loops) {
+  bool changed = false;
+
+  for (auto I = Loops.begin(), IE = Loops.end(); I != IE; ++I) {
+    Loop *L = *I;
+    if (L->getHeader()->getName().str().find(F_KERNEL_SUBSTR) !=
+        string::npos) {
+      instrumentLoop(L);
+      changed = true;
+      continue; // subloops are traced as part of the marked loop
+    }
+    changed = instrumentLoops(L->getSubLoops()) || changed;
+  }
+
+  return changed;
+}
+
+// The instructions the address of a load depends on.
+void MemTrace::getAddressSlice(LoadInst *LInst, std::set<Instruction *> &Deps) {
+  std::queue<Instruction *> Q;
+  Q.push(LInst);
+
+  while (!Q.empty()) {
+    Instruction *Inst = Q.front();
+    Q.pop();
+    for (User::value_op_iterator I = Inst->value_op_begin(),
+                                 E = Inst->value_op_end();
+         I != E; ++I) {
+      Instruction *Op = dyn_cast<Instruction>(*I);
+      if (Op && Deps.insert(Op).second)
+        Q.push(Op);
+    }
+  }
+}
+
+// The indirection level of a load is the number of loads its address
+// depends on, counted the same way FKernelPrefetch counts them against
+// -indir-thresh.
+unsigned MemTrace::countIndirections(LoadInst *LInst) {
+  std::set<Instruction *> Deps;
+  getAddressSlice(LInst, Deps);
+  return std::count_if(Deps.begin(), Deps.end(),
+                       [](Instruction *I) { return isa<LoadInst>(I); });
+}
+
+void MemTrace::instrumentLoop(Loop *L) {
+  BasicBlock *H = L->getHeader();
+  Module *M = H->getParent()->getParent();
+  LLVMContext &C = M->getContext();
+  Type *I8Ptr = Type::getInt8PtrTy(C);
+  Type *I32 = Type::getInt32Ty(C);
+  Type *Void = Type::getVoidTy(C);
+
+  Type *IterArgs[] = {I8Ptr, I32};
+  Function *traceIter = cast<Function>(M->getOrInsertFunction(
+      "dae_trace_iter", FunctionType::get(Void, IterArgs, false)));
+  Type *LoadArgs[] = {I8Ptr, I32, I32, I8Ptr};
+  Function *traceLoad = cast<Function>(M->getOrInsertFunction(
+      "dae_trace_load", FunctionType::get(Void, LoadArgs, false)));
+
+  // The static size of one iteration approximates its compute cost.
+  unsigned insts = 0;
+  std::vector<LoadInst *> loads;
+  for (auto BI = L->block_begin(), BE = L->block_end(); BI != BE; ++BI) {
+    for (BasicBlock::iterator I = (*BI)->begin(), E = (*BI)->end(); I != E;
+         ++I) {
+      if (isa<PHINode>(I) || isa<DbgInfoIntrinsic>(I))
+        continue;
+      ++insts;
+      if (LoadInst *LInst = dyn_cast<LoadInst>(I))
+        if (InstrhasMetadataKind(LInst, DAE_LOAD_ID_MD))
+          loads.push_back(LInst);
+    }
+  }
+
+  // The access phase waits for a load only if a load it prefetches depends
+  // on it: record the lowest level of the traced loads that do (0: none).
+  std::map<LoadInst *, unsigned> indir, feeds;
+  for (auto LInst : loads)
+    indir[LInst] = countIndirections(LInst);
+  for (auto LInst : loads) {
+    std::set<Instruction *> Deps;
+    getAddressSlice(LInst, Deps);
+    for (Instruction *Dep : Deps) {
+      LoadInst *Fed = dyn_cast<LoadInst>(Dep);
+      if (!Fed || !indir.count(Fed))
+        continue;
+      unsigned &level = feeds[Fed];
+      if (!level || indir[LInst] < level)
+        level = indir[LInst];
+    }
+  }
+
+  IRBuilder<> Builder(&*H->getFirstInsertionPt());
+  Value *loopName =
+      Builder.CreateGlobalStringPtr(H->getName(), "dae_trace_loop");
+  Builder.CreateCall(traceIter, {loopName, ConstantInt::get(I32, insts)});
+
+  for (auto LInst : loads) {
+    Builder.SetInsertPoint(LInst);
+    Value *loadName = Builder.CreateGlobalStringPtr(
+        getInstructionMD(LInst, DAE_LOAD_ID_MD), "dae_trace_load");
+    Value *addr = Builder.CreatePointerCast(LInst->getPointerOperand(),
+                                            I8Ptr);
+    Builder.CreateCall(traceLoad,
+                       {loadName, ConstantInt::get(I32, indir[LInst]),
+                        ConstantInt::get(I32, feeds[LInst]), addr});
+  }
+}
+
+char MemTrace::ID = 1;
+static RegisterPass<MemTrace> X("dae-mem-trace",
+                                "Memory trace of DAE kernels pass", false,
+                                false);
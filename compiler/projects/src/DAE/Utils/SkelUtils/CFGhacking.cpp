@@ -24,41 +24,75 @@ using namespace std;
 #define CFGhacking_
 #define GRAN 32
 
-BasicBlock *BuildChunkingBlock(BasicBlock *blk);
-void replaceEdgesDecBlocks(BasicBlock *nb, BasicBlock *dcb, LoopInfo *LI);
+BasicBlock *BuildChunkingBlock(BasicBlock *blk, GlobalVariable *state,
+                               BasicBlock *&entry, PHINode *&chunk_lo,
+                               Value *&chunk_hi, unsigned fixedGran = 0);
+void replaceEdgesDecBlocks(BasicBlock *nb, BasicBlock *dcb, BasicBlock *entry,
+                           LoopInfo *LI);
 
-BasicBlock *BuildChunkingBlock(BasicBlock *blk, Value *vi, Value *lsup,
-                               Value *&vi_dcb_val) {
-  Function *F = blk->getParent();
-  Module *M = F->getParent();
+/* address of one field of a chunk state block */
+Constant *chunkStateField(GlobalVariable *state, unsigned field) {
+  Type *I32 = Type::getInt32Ty(state->getContext());
+  Constant *Idx[] = {ConstantInt::get(I32, 0), ConstantInt::get(I32, field)};
+  return ConstantExpr::getInBoundsGetElementPtr(state->getValueType(), state,
+                                               Idx);
+}
+
+/* the block of the calling thread mirroring the bounds of the chunks of
+   the loop of state */
+GlobalVariable *chunkBounds(GlobalVariable *state) {
+  Module *M = state->getParent();
+  std::string name = state->getName().str() + "_bounds";
+  if (GlobalVariable *bounds = M->getNamedGlobal(name))
+    return bounds;
+
+  Type *I64 = Type::getInt64Ty(M->getContext());
+  StructType *Ty = StructType::get(M->getContext(), {I64, I64});
+  GlobalVariable *bounds = new GlobalVariable(
+      *M, Ty, false, GlobalValue::ExternalLinkage, Constant::getNullValue(Ty),
+      name, nullptr, GlobalVariable::GeneralDynamicTLSModel);
+  bounds->setAlignment(16);
+  return bounds;
+}
+
+/*
+  entry (once per execution of the loop): read the granularity
+  dcb (once per chunk): chunk_lo = old chunk_hi, chunk_hi += granularity
+  fixedGran is the loop's own granularity (0 if it follows the build's)
+*/
+BasicBlock *BuildChunkingBlock(BasicBlock *blk, GlobalVariable *state,
+                               BasicBlock *&entry, PHINode *&chunk_lo,
+                               Value *&chunk_hi, unsigned fixedGran) {
+  LLVMContext &C = blk->getContext();
+  Type *I64 = Type::getInt64Ty(C);
+  entry = BasicBlock::Create(C, Twine(blk->getName() + "_chunk_init"),
+                             blk->getParent(), blk);
   BasicBlock *dcb = BasicBlock::Create(
-      blk->getContext(), Twine(blk->getName() + "_outer_chunking"),
-      blk->getParent(), blk);
-  Instruction *load_lsup = new LoadInst(lsup, "lsup_value", dcb);
-
-  // store the old lsup in vi and increment lsup
-  new StoreInst(load_lsup, vi, dcb);
-
-  Value *granularity =
-      new GlobalVariable(*M, llvm::Type::getInt64Ty(M->getContext()), false,
-                         GlobalValue::ExternalLinkage,
-                         0, // cstInit
-                         M->getModuleIdentifier() + "_" + F->getName().str() +
-                             "_" + blk->getName().str() + "_granularity");
-  declareExternalGlobal(granularity, GRAN);
-
-  Instruction *load_granularity =
-      new LoadInst(granularity, "granularity_value", dcb);
-  BinaryOperator *add =
-      BinaryOperator::CreateAdd(load_lsup, load_granularity, "new_lsup", dcb);
-  new StoreInst(add, lsup, dcb);
-
-  LoadInst *load_vi_tmp = new LoadInst(vi, "outer_vi", dcb);
-  vi_dcb_val = load_vi_tmp;
+      C, Twine(blk->getName() + "_outer_chunking"), blk->getParent(), blk);
+
+  Value *granularity;
+  if (fixedGran)
+    granularity = ConstantInt::get(I64, fixedGran);
+  else
+    granularity = new LoadInst(chunkStateField(state, DAE_CHUNK_GRAN),
+                               "granularity_value", entry);
+  BranchInst::Create(dcb, entry);
+
+  // the chunk starts where the previous one ended
+  chunk_lo = PHINode::Create(I64, 2, "outer_vi", dcb);
+  chunk_lo->addIncoming(ConstantInt::get(I64, 0), entry);
+  chunk_hi = BinaryOperator::CreateAdd(chunk_lo, granularity, "new_lsup", dcb);
+
+  // mirror the bounds for observation, in the thread's own block
+  GlobalVariable *bounds = chunkBounds(state);
+  new StoreInst(chunk_lo, chunkStateField(bounds, DAE_BOUNDS_VI), dcb);
+  new StoreInst(chunk_hi, chunkStateField(bounds, DAE_BOUNDS_LSUP), dcb);
   return dcb;
 }
 
-void replaceEdgesDecBlocks(BasicBlock *H, BasicBlock *dcb, LoopInfo *LI) {
+/* outside edges into H now enter through entry, and dcb falls into H */
+void replaceEdgesDecBlocks(BasicBlock *H, BasicBlock *dcb, BasicBlock *entry,
+                           LoopInfo *LI) {
 
   Loop *L = LI->getLoopFor(H);
   Loop *Lparent = 0;
@@ -71,10 +105,10 @@ void replaceEdgesDecBlocks(BasicBlock *H, BasicBlock *dcb, LoopInfo *LI) {
       parent = Inst->getParent();
       Lparent = LI->getLoopFor(parent);
       if ((Lparent == 0) || (Lparent != L)) {
-        Inst->replaceUsesOfWith(H, dcb);
+        Inst->replaceUsesOfWith(H, entry);
         if (isa<IndirectBrInst>(Inst)) {
           IndirectBrInst *IndBr = dyn_cast<IndirectBrInst>(Inst);
-          BlockAddress *badd = llvm::BlockAddress::get(dcb);
+          BlockAddress *badd = llvm::BlockAddress::get(entry);
           IndBr->setAddress(badd);
         }
       }
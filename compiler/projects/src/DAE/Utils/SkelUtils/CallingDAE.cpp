@@ -18,6 +18,7 @@
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 #include <algorithm>
@@ -37,103 +38,83 @@ using namespace std;
 #define CallingDAE_
 
 void insertCallToAccessFunction(Function *F, Function *cF);
-void insertCallToAccessFunctionSequential(Function *F, Function *cF);
-void insertCallToPAPI(CallInst *access, CallInst *execute);
-void insertCallOrigToPAPI(CallInst *execute);
+void insertCallToAccessFunctionSequential(Function *F, Function *cF,
+                                          bool fused = false);
+void insertPhaseBarrier(Instruction *I);
+void insertCallToPAPI(Instruction *access, Instruction *execute);
+void insertCallOrigToPAPI(Instruction *execute);
+Instruction *afterCall(Instruction *I);
 void insertCallInitPAPI(CallInst *mainF);
 void mapArgumentsToParams(Function *F, ValueToValueMapTy *VMap);
 
+/* every call to F becomes the execute phase cF, and F runs on the helper
+   thread of the calling thread (task_DAE in libDAE_helper) meanwhile. The
+   arguments are copied into the task, packed in a structure that the thunk
+   <F>_task unpacks for F; task_DAE_sync, after the execute phase, waits for
+   the task, so that no access phase outlives its call. The wait is on the
+   normal return only: F must not be invoked, nor cF throw (see
+   canRunOnHelper) */
 void insertCallToAccessFunction(Function *F, Function *cF) {
-  CallInst *I;
-  Instruction *bI;
-  std::vector<Value *> Args;
-  std::vector<Type *> ArgsTy;
   Module *M = F->getParent();
-  std::string name;
-  Function *nF, *tF;
-  FunctionType *FTy;
-  std::stringstream out;
-
-  Value::user_iterator i = F->user_begin(), e = F->user_end();
-  while (i != e) {
-    Args.clear();
-    ArgsTy.clear();
-    /*************  C codes  ***********/
-
-    if (isa<CallInst>(*i)) {
-
-      I = dyn_cast<CallInst>(*i);
-      // call to the access function F
-      Args.push_back(I->getArgOperand(0));
-      ArgsTy.push_back(I->getArgOperand(0)->getType());
-
-      // call to the execute function cF
-      Args.push_back(cF);
-      ArgsTy.push_back(PointerType::get(cF->getFunctionType(), 0));
-
-      unsigned int t;
-      for (t = 1; t < I->getNumArgOperands(); t++) {
-        Args.push_back(I->getArgOperand(t));
-        ArgsTy.push_back(I->getArgOperand(t)->getType());
-        // errs() << *(I->getArgOperand(t)) << " is or not " <<
-        // isa<GlobalVariable>(I->getArgOperand(t)) << "\n";
-      }
-      tF = dyn_cast<Function>(I->getCalledFunction());
-      FTy = FunctionType::get(tF->getReturnType(), ArgsTy, 0);
-
-      out.str(std::string());
-      out << "task_DAE_" << I->getNumArgOperands() - 1;
-      nF = (Function *)M->getOrInsertFunction(out.str(), FTy);
-      CallInst *ci = CallInst::Create(nF, Args, I->getName(), I);
-
-      i++;
-      I->replaceAllUsesWith(ci);
-      I->eraseFromParent();
-    }
-    /*************  C++ codes  ***********/
-    else {
-
-      Value::user_iterator bit = (*i)->user_begin(), bite = (*i)->user_end();
-
-      Type *iTy = (*i)->getType();
-      i++;
-      while (bit != bite) {
-        Args.clear();
-        ArgsTy.clear();
-        I = dyn_cast<CallInst>(*bit);
-
-        bit++;
-
-        // call to the access function F
-        Args.push_back(I->getArgOperand(0));
-        ArgsTy.push_back(I->getArgOperand(0)->getType());
-
-        // call to the execute function cF
-        bI = new BitCastInst(cF, (iTy), "_TPR", I);
-        Args.push_back(bI);
-        ArgsTy.push_back(bI->getType());
-
-        unsigned int t;
-        for (t = 1; t < I->getNumArgOperands(); t++) {
-          Args.push_back(I->getArgOperand(t));
-          ArgsTy.push_back(I->getArgOperand(t)->getType());
-        }
-        tF = dyn_cast<Function>(I->getCalledFunction());
-        FTy = FunctionType::get(tF->getReturnType(), ArgsTy, 0);
-
-        out.str(std::string());
-        out << "task_DAE_" << I->getNumArgOperands() - 1;
-        nF = (Function *)M->getOrInsertFunction(out.str(), FTy);
-        CallInst *ci = CallInst::Create(nF, Args, I->getName(), I);
-
-        I->replaceAllUsesWith(ci);
-        I->eraseFromParent();
-      }
-    }
+  LLVMContext &C = M->getContext();
+  std::vector<CallInst *> calls;
+  for (User *U : F->users())
+    if (CallInst *I = dyn_cast<CallInst>(U))
+      if (I->getCalledFunction() == F)
+        calls.push_back(I);
+
+  std::vector<Type *> fields(F->getFunctionType()->param_begin(),
+                             F->getFunctionType()->param_end());
+  StructType *argsTy = StructType::get(C, fields);
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i64 = Type::getInt64Ty(C);
+  FunctionType *thunkTy =
+      FunctionType::get(Type::getVoidTy(C), {i8ptr}, false);
+
+  Function *thunk = Function::Create(thunkTy, GlobalValue::InternalLinkage,
+                                     F->getName() + "_task", M);
+  thunk->addFnAttr(Attribute::NoUnwind);
+  IRBuilder<> Builder(BasicBlock::Create(C, "entry", thunk));
+  Value *packed = Builder.CreateBitCast(&*thunk->arg_begin(),
+                                        PointerType::getUnqual(argsTy));
+  std::vector<Value *> args;
+  for (unsigned a = 0; a != fields.size(); ++a)
+    args.push_back(
+        Builder.CreateLoad(Builder.CreateStructGEP(argsTy, packed, a)));
+  Builder.CreateCall(F, args);
+  Builder.CreateRetVoid();
+
+  FunctionType *taskTy = FunctionType::get(
+      Type::getVoidTy(C), {PointerType::getUnqual(thunkTy), i8ptr, i64},
+      false);
+  Constant *task = M->getOrInsertFunction("task_DAE", taskTy);
+  Constant *sync = M->getOrInsertFunction(
+      "task_DAE_sync", FunctionType::get(Type::getVoidTy(C), false));
+  uint64_t size = M->getDataLayout().getTypeAllocSize(argsTy);
+
+  for (CallInst *I : calls) {
+    Function *caller = I->getParent()->getParent();
+    IRBuilder<> Entry(&*caller->getEntryBlock().getFirstInsertionPt());
+    Value *buf = Entry.CreateAlloca(argsTy, nullptr, F->getName() + ".args");
+
+    Builder.SetInsertPoint(I);
+    for (unsigned a = 0; a != fields.size(); ++a)
+      Builder.CreateStore(I->getArgOperand(a),
+                          Builder.CreateStructGEP(argsTy, buf, a));
+    Builder.CreateCall(task, {thunk, Builder.CreateBitCast(buf, i8ptr),
+                              ConstantInt::get(i64, size)});
+
+    I->setCalledFunction(cF);
+    Builder.SetInsertPoint(afterCall(I));
+    Builder.CreateCall(sync);
+    insertCallOrigToPAPI(I);
   }
 }
 
-void insertCallToAccessFunctionSequential(Function *F, Function *cF) {
+/* with fused set, both phases are inlined at the call site and only a
+   barrier separates them */
+void insertCallToAccessFunctionSequential(Function *F, Function *cF,
+                                          bool fused) {
   CallInst *I;
   BasicBlock *b;
 
@@ -147,15 +128,62 @@ void insertCallToAccessFunctionSequential(Function *F, Function *cF) {
       CallInst *ci = dyn_cast<CallInst>(I->clone());
       ci->setCalledFunction(cF);
       b->getInstList().insertAfter(helper, ci);
+      if (fused)
+        insertPhaseBarrier(ci);
 
       i++;
       I->replaceAllUsesWith(ci);
 
       insertCallToPAPI(I, ci);
+    } else if (isa<InvokeInst>(*i)) {
+      // the invoke becomes the execute phase; the access phase runs before
+      // it and unwinds to the same landing pad, unless it cannot throw
+      InvokeInst *II = dyn_cast<InvokeInst>(*i);
+      i++;
+      b = II->getParent();
+      std::vector<Value *> args;
+      for (unsigned a = 0, n = II->getNumArgOperands(); a != n; ++a)
+        args.push_back(II->getArgOperand(a));
+      Instruction *acc;
+      if (F->doesNotThrow()) {
+        acc = CallInst::Create(F, args, "", II);
+      } else {
+        BasicBlock *lpad = II->getUnwindDest();
+        BasicBlock *exe = b->splitBasicBlock(II, b->getName() + ".execute");
+        b->getTerminator()->eraseFromParent();
+        acc = InvokeInst::Create(F, exe, lpad, args, "", b);
+        for (BasicBlock::iterator pI = lpad->begin(); isa<PHINode>(pI); ++pI) {
+          PHINode *phi = cast<PHINode>(pI);
+          phi->addIncoming(phi->getIncomingValueForBlock(exe), b);
+        }
+      }
+      II->setCalledFunction(cF);
+      if (fused)
+        insertPhaseBarrier(II);
+
+      insertCallToPAPI(acc, II);
     }
   }
 }
 
+/* the first instruction executed once the call I has returned normally */
+Instruction *afterCall(Instruction *I) {
+  if (InvokeInst *II = dyn_cast<InvokeInst>(I))
+    return &*II->getNormalDest()->getFirstInsertionPt();
+  BasicBlock::iterator next(I);
+  return &*++next;
+}
+
+/* a compiler-only barrier before I: memory operations are not moved across
+   it, so the prefetches of the access phase stay ahead of the execute phase,
+   while address arithmetic can still be shared by both */
+void insertPhaseBarrier(Instruction *I) {
+  FunctionType *FTy =
+      FunctionType::get(Type::getVoidTy(I->getContext()), false);
+  InlineAsm *barrier = InlineAsm::get(FTy, "", "~{memory}", true);
+  CallInst::Create(barrier, "", I);
+}
+
 void mapArgumentsToParams(Function *F, ValueToValueMapTy *VMap) {
   CallInst *I;
   Instruction *aux = 0;
@@ -238,7 +266,7 @@ void insertCallInitPAPI(Function *mainF) {
   }
 }
 
-void insertCallToPAPI(CallInst *access, CallInst *execute) {
+void insertCallToPAPI(Instruction *access, Instruction *execute) {
   Function *caller = access->getParent()->getParent();
   Module *M = caller->getParent();
   IRBuilder<> Builder(access);
@@ -298,13 +326,11 @@ void insertCallToPAPI(CallInst *access, CallInst *execute) {
   Builder.CreateCall(profiler_start_execute, p_counters);
 
   /* insert PAPI calls after the execute phase*/
-  BasicBlock::iterator I(execute);
-  I++;
-  Builder.SetInsertPoint(&(*I));
+  Builder.SetInsertPoint(afterCall(execute));
   Builder.CreateCall(profiler_end_execute, p_counters);
 }
 
-void insertCallOrigToPAPI(CallInst *execute) {
+void insertCallOrigToPAPI(Instruction *execute) {
 
   Function *caller = execute->getParent()->getParent();
   Module *M = caller->getParent();
@@ -353,9 +379,7 @@ void insertCallOrigToPAPI(CallInst *execute) {
   Builder.CreateCall(profiler_start_execute, p_counters);
 
   /* insert PAPI calls after the execute phase*/
-  BasicBlock::iterator I(execute);
-  I++;
-  Builder.SetInsertPoint(&(*I));
+  Builder.SetInsertPoint(afterCall(execute));
   Builder.CreateCall(profiler_end_execute, p_counters);
 }
 #endif
@@ -0,0 +1,121 @@
+//===- ChunkFootprint.cpp - Cache footprint of a chunk --------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file ChunkFootprint.cpp
+///
+/// \brief Cache footprint of a chunk
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// The access phase of a chunk should prefetch no more than the target cache
+// can hold until the execute phase uses it. The footprint of one iteration of
+// a marked loop L is the number of bytes of distinct cache lines its loads
+// touch, estimated from their addresses:
+//  - invariant in L: 0 (the line is shared by all iterations);
+//  - affine in L with a constant step: |step|, at most one line, for each
+//    stream; loads less than a line apart on the same stream count once;
+//  - anything else (e.g. an indirection): one line.
+// A load of an inner loop counts once per iteration of that loop, when its
+// trip count is a known constant, and once otherwise.
+//
+// The granularity is the largest power of two whose chunk footprint fits
+// half of the target cache, the other half being left to the data of the
+// execute phase. The runtime (libDAE_prof, granularity.cpp) redoes this
+// computation at program start with the cache sizes of the machine.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ChunkFootprint_
+#define ChunkFootprint_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+
+using namespace llvm;
+using namespace std;
+
+#define DAE_LINE_SIZE 64
+#define DAE_MAX_AUTO_GRAN 4096
+
+uint64_t estimateChunkFootprint(Loop *L, LoopInfo *LI, ScalarEvolution *SE);
+unsigned granularityForCache(uint64_t footprint, uint64_t cacheBytes);
+
+/* iterations of Sub per iteration of L, 1 if unknown */
+static uint64_t innerTrips(Loop *Sub, Loop *L, ScalarEvolution *SE) {
+  uint64_t trips = 1;
+  for (Loop *In = Sub; In != L; In = In->getParentLoop()) {
+    unsigned tc = SE->getSmallConstantTripCount(In);
+    if (tc)
+      trips *= tc;
+  }
+  return trips;
+}
+
+uint64_t estimateChunkFootprint(Loop *L, LoopInfo *LI, ScalarEvolution *SE) {
+  struct Stream {
+    const Loop *L;
+    const SCEV *Start;
+    const SCEV *Step;
+  };
+  std::vector<Stream> streams;
+  uint64_t footprint = 0;
+
+  for (Loop::block_iterator BB = L->block_begin(), BE = L->block_end();
+       BB != BE; ++BB) {
+    Loop *Sub = LI->getLoopFor(*BB);
+    for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E;
+         ++I) {
+      LoadInst *LD = dyn_cast<LoadInst>(I);
+      if (!LD)
+        continue;
+
+      const SCEV *Ptr = SE->getSCEV(LD->getPointerOperand());
+      if (SE->isLoopInvariant(Ptr, L))
+        continue;
+      uint64_t bytes = DAE_LINE_SIZE;
+
+      const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(Ptr);
+      const SCEVConstant *Step =
+          AR && AR->isAffine()
+              ? dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE))
+              : 0;
+      if (Step) {
+        bool seen = false;
+        for (Stream &S : streams) {
+          if (S.L != AR->getLoop() || S.Step != Step)
+            continue;
+          const SCEVConstant *D =
+              dyn_cast<SCEVConstant>(SE->getMinusSCEV(AR->getStart(), S.Start));
+          if (D && D->getAPInt().abs().ult(DAE_LINE_SIZE)) {
+            seen = true;
+            break;
+          }
+        }
+        if (seen)
+          continue;
+        streams.push_back({AR->getLoop(), AR->getStart(), Step});
+        bytes = std::min<uint64_t>(Step->getAPInt().abs().getZExtValue(),
+                                   DAE_LINE_SIZE);
+      }
+      footprint += bytes * innerTrips(Sub, L, SE);
+    }
+  }
+  return footprint;
+}
+
+/* 0 if the footprint is unknown */
+unsigned granularityForCache(uint64_t footprint, uint64_t cacheBytes) {
+  if (!footprint)
+    return 0;
+  unsigned gran = 1;
+  while (gran < DAE_MAX_AUTO_GRAN && 2 * gran * footprint <= cacheBytes / 2)
+    gran *= 2;
+  return gran;
+}
+
+#endif
@@ -0,0 +1,246 @@
+//===- CombineStores.cpp - Scattered stores of a chunk, grouped -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file CombineStores.cpp
+///
+/// \brief Scattered stores of a chunk, grouped
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// Software write-combining for the execute phase. A store whose address
+// depends on a load of the chunk loop (out[perm[i]] = v) lands on a random
+// line, and pays for reading it before writing it. Such stores are staged
+// instead, in the thread-local buffer of the kernel, <kernel>_combine (see
+// combine.h in libDAE_combine), and written once the chunk is done, grouped
+// by line (or page):
+//
+//   pre:   stores = dae_combine_reserve(max(granularity, hi - lo) * S); n = 0
+//   loop:  stores[n++] = { address, value, size }      (for each staged store)
+//   exits: dae_combine_flush(stores, n, shift)
+//
+// where S is the number of staged stores of the loop. The flush keeps the
+// order of the stores to one address.
+//
+// A store of the chunk loop, outside its inner loops, is staged when:
+//  - its address depends on a load of the loop;
+//  - dependence analysis finds no dependence between it and the loads and
+//    stores of the loop that are not staged, in the same iteration or
+//    between two, and the calls of the loop do not access its memory;
+//  - its value fits in 8 bytes;
+// and the loop cannot be left other than by its exits (no call may throw).
+//
+//===----------------------------------------------------------------------===//
+#ifndef CombineStores_
+#define CombineStores_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "ForwardAddresses.cpp"
+
+using namespace llvm;
+using namespace std;
+
+/// Fields of the buffer <kernel>_combine, { %staged* stores, i64 capacity },
+/// and of a staged store, %staged = { i8* address, i64 value, i64 size }.
+#define DAE_COMBINE_STORES 0
+#define DAE_COMBINE_CAPACITY 1
+#define DAE_STAGED_ADDRESS 0
+#define DAE_STAGED_VALUE 1
+#define DAE_STAGED_SIZE 2
+
+bool findCombinedStores(Loop *C, LoopInfo &LI, DependenceAnalysis *DA,
+                        AliasAnalysis &AA, SetVector<StoreInst *> &Stores,
+                        std::string &Why, Instruction *&Blocking);
+GlobalVariable *combineBuffer(Function *Kernel);
+void stageStores(Loop *C, PHINode *VI, ICmpInst *Cond,
+                 SetVector<StoreInst *> &Stores, GlobalVariable *Buf,
+                 unsigned Shift);
+
+/* true iff V depends on a load of C in the same iteration */
+static bool isScattered(Value *V, Loop *C, set<Instruction *> &Seen) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || !C->contains(I) || isa<PHINode>(I) || !Seen.insert(I).second)
+    return false;
+  if (isa<LoadInst>(I))
+    return true;
+  for (Value *Op : I->operands())
+    if (isScattered(Op, C, Seen))
+      return true;
+  return false;
+}
+
+/* true iff the store S and the instruction I of C may access the same
+   memory, in an iteration or between two */
+static bool mayConflict(StoreInst *S, Instruction *I, DependenceAnalysis *DA,
+                        AliasAnalysis &AA) {
+  if (isa<LoadInst>(I) || isa<StoreInst>(I))
+    return DA->depends(S, I, true) || DA->depends(I, S, true);
+  return AA.getModRefInfo(I, MemoryLocation::get(S)) != MRI_NoModRef;
+}
+
+/*
+  collects the stores of the chunk loop C that may be staged; false with the
+  reason in Why (and the offending instruction in Blocking) if there is none
+*/
+bool findCombinedStores(Loop *C, LoopInfo &LI, DependenceAnalysis *DA,
+                        AliasAnalysis &AA, SetVector<StoreInst *> &Stores,
+                        std::string &Why, Instruction *&Blocking) {
+  const DataLayout &DL = C->getHeader()->getModule()->getDataLayout();
+  SmallVector<Instruction *, 16> MemInst;
+  Blocking = nullptr;
+  if (!C->getLoopPreheader() || !C->hasDedicatedExits()) {
+    Why = "unsupported loop shape";
+    return false;
+  }
+  for (BasicBlock *BB : C->blocks()) {
+    for (Instruction &I : *BB) {
+      if (I.mayThrow() || isa<InvokeInst>(I) || isa<ReturnInst>(I)) {
+        Why = "the loop may be left before its exits";
+        Blocking = &I;
+        return false;
+      }
+      if (isa<DbgInfoIntrinsic>(I) || !I.mayReadOrWriteMemory())
+        continue;
+      MemInst.push_back(&I);
+
+      StoreInst *S = dyn_cast<StoreInst>(&I);
+      Type *Ty = S ? S->getValueOperand()->getType() : nullptr;
+      set<Instruction *> Seen;
+      if (S && S->isSimple() && LI.getLoopFor(BB) == C &&
+          !Ty->isAggregateType() && DL.getTypeStoreSize(Ty) <= 8 &&
+          isScattered(S->getPointerOperand(), C, Seen))
+        Stores.insert(S);
+    }
+  }
+  if (Stores.empty()) {
+    Why = "no scattered store";
+    return false;
+  }
+
+  // what stays in place must not see a staged store late, until none is left
+  bool Changed = true;
+  while (Changed && !Stores.empty()) {
+    Changed = false;
+    for (StoreInst *S : Stores) {
+      for (Instruction *I : MemInst) {
+        if (I == S || Stores.count(dyn_cast<StoreInst>(I)))
+          continue;
+        if (mayConflict(S, I, DA, AA)) {
+          Blocking = I;
+          Stores.remove(S);
+          Changed = true;
+          break;
+        }
+      }
+      if (Changed)
+        break;
+    }
+  }
+  if (Stores.empty()) {
+    Why = "the scattered stores depend on the loop";
+    return false;
+  }
+  return true;
+}
+
+/* the thread-local buffer of the execute phase Kernel */
+GlobalVariable *combineBuffer(Function *Kernel) {
+  Module *M = Kernel->getParent();
+  std::string name = Kernel->getName().str() + "_combine";
+  if (GlobalVariable *Buf = M->getNamedGlobal(name))
+    return Buf;
+
+  LLVMContext &C = M->getContext();
+  Type *I64 = Type::getInt64Ty(C);
+  StructType *Staged = StructType::get(C, {Type::getInt8PtrTy(C), I64, I64});
+  StructType *Ty = StructType::get(C, {Staged->getPointerTo(), I64});
+  return new GlobalVariable(*M, Ty, false, GlobalValue::InternalLinkage,
+                            Constant::getNullValue(Ty), name, nullptr,
+                            GlobalVariable::GeneralDynamicTLSModel);
+}
+
+/*
+  makes the chunk loop C, counted by VI up to the bound of Cond (see
+  hasChunkLength), stage Stores in Buf and flush them at its exits, grouped
+  by blocks of 2^Shift bytes
+*/
+void stageStores(Loop *C, PHINode *VI, ICmpInst *Cond,
+                 SetVector<StoreInst *> &Stores, GlobalVariable *Buf,
+                 unsigned Shift) {
+  Function *F = C->getHeader()->getParent();
+  Module *M = F->getParent();
+  const DataLayout &DL = M->getDataLayout();
+  LLVMContext &Ctx = F->getContext();
+  Type *I32 = Type::getInt32Ty(Ctx);
+  Type *I64 = Type::getInt64Ty(Ctx);
+  Type *Staged = cast<PointerType>(cast<StructType>(Buf->getValueType())
+                                       ->getElementType(DAE_COMBINE_STORES))
+                     ->getElementType();
+
+  // the number of staged stores lives in a register, once promoted
+  IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
+  AllocaInst *N = Builder.CreateAlloca(I64, nullptr, "combine_n");
+
+  // room for the stores of the longer of a chunk of the granularity and
+  // this one
+  Builder.SetInsertPoint(C->getLoopPreheader()->getTerminator());
+  Value *Len = chunkLength(Builder, C, VI, Cond);
+  Value *Slots = Len;
+  GlobalVariable *State =
+      M->getNamedGlobal(getInstructionMD(Cond, DAE_CHUNK_STATE_MD));
+  if (State) {
+    Value *Gran = Builder.CreateLoad(Builder.CreateConstInBoundsGEP2_32(
+        State->getValueType(), State, 0, DAE_CHUNK_GRAN));
+    Slots = Builder.CreateSelect(Builder.CreateICmpUGT(Gran, Len), Gran, Len);
+  }
+  Slots = Builder.CreateMul(Slots, ConstantInt::get(I64, Stores.size()));
+  Constant *Reserve = M->getOrInsertFunction(
+      "dae_combine_reserve", Staged->getPointerTo(), Buf->getType(), I64,
+      nullptr);
+  Value *Base = Builder.CreateCall(Reserve, {Buf, Slots}, "combine_stores");
+  Builder.CreateStore(ConstantInt::get(I64, 0), N);
+
+  for (StoreInst *S : Stores) {
+    Builder.SetInsertPoint(S);
+    Value *Idx = Builder.CreateLoad(N);
+    Value *Rec = Builder.CreateGEP(Base, Idx);
+    Type *Ty = S->getValueOperand()->getType();
+    Builder.CreateStore(
+        Builder.CreatePointerCast(S->getPointerOperand(),
+                                  Type::getInt8PtrTy(Ctx)),
+        Builder.CreateConstInBoundsGEP2_32(Staged, Rec, 0,
+                                           DAE_STAGED_ADDRESS));
+    Builder.CreateStore(
+        S->getValueOperand(),
+        Builder.CreatePointerCast(
+            Builder.CreateConstInBoundsGEP2_32(Staged, Rec, 0,
+                                               DAE_STAGED_VALUE),
+            Ty->getPointerTo()));
+    Builder.CreateStore(
+        ConstantInt::get(I64, DL.getTypeStoreSize(Ty)),
+        Builder.CreateConstInBoundsGEP2_32(Staged, Rec, 0, DAE_STAGED_SIZE));
+    Builder.CreateStore(Builder.CreateAdd(Idx, ConstantInt::get(I64, 1)), N);
+    S->eraseFromParent();
+  }
+
+  Constant *Flush = M->getOrInsertFunction(
+      "dae_combine_flush", Type::getVoidTy(Ctx), Staged->getPointerTo(), I64,
+      I32, nullptr);
+  SmallVector<BasicBlock *, 4> Exits;
+  C->getUniqueExitBlocks(Exits);
+  for (BasicBlock *E : Exits) {
+    Builder.SetInsertPoint(&*E->getFirstInsertionPt());
+    Builder.CreateCall(Flush, {Base, Builder.CreateLoad(N),
+                               ConstantInt::get(I32, Shift)});
+  }
+}
+
+#endif
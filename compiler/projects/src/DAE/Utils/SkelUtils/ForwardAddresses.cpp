@@ -0,0 +1,357 @@
+//===- ForwardAddresses.cpp - Addresses from the access to the execute ----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file ForwardAddresses.cpp
+///
+/// \brief Addresses (or values) from the access to the execute phase
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// The access phase computes the address of each load it prefetches; the
+// execute phase computes it again, loading the same intermediate levels of
+// an indirection (b[i] for a[b[i]]). With address forwarding, the access
+// phase stores the addresses it prefetches in the thread-local buffer of
+// the kernel, <kernel>_forward (see forward.h in libDAE_forward), and the
+// execute phase reads them back:
+//
+//   access:  base = dae_forward_reserve(max(granularity, n) * P)
+//            base[p * n + k] = address of load p
+//   execute: address of load p = base[p * n + k]
+//
+// for iteration k = vi - lo of a chunk of n = hi - lo iterations, where P is
+// the number of forwarded loads. The slice that computed the address in the
+// execute phase is then dead, unless something else uses it.
+//
+// A load of the chunk loop is forwarded when:
+//  - the access phase prefetches it in every iteration;
+//  - its address depends on a load of the chunk loop (a direct address is
+//    cheaper to compute than to load);
+//  - the slice of its address, and of the exits of the chunk loop, reads
+//    no memory that the execute phase writes, in any of its iterations
+//    (dependence analysis, as the access phase walks the whole chunk first),
+//    and allocates none, so that both phases compute the same addresses and
+//    run the same iterations.
+//
+// A forwarded load may instead be gathered: the access phase loads the
+// value in place of its prefetch and stores it in the column of the load,
+// from which the execute phase reads it with unit stride. Such a load must
+// also run in every iteration of the execute phase, read memory that it
+// does not write in any iteration (a[b[i] + 1] = ... blocks y = a[b[i]]),
+// and fit in a slot.
+//
+// Both phases of a chunk must run one after the other on the same thread.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ForwardAddresses_
+#define ForwardAddresses_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "Util/Annotation/MetadataInfo.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "Utils.cpp"
+
+using namespace llvm;
+using namespace std;
+using namespace util;
+
+/// Fields of the buffer <kernel>_forward, { i8** base, i64 slots }.
+#define DAE_FORWARD_BASE 0
+#define DAE_FORWARD_SLOTS 1
+
+struct ForwardedLoad {
+  IntrinsicInst *Pref; // of the access phase
+  LoadInst *Load;      // of the execute phase
+  bool Value;          // gathered: its value, not its address
+};
+
+bool isForwardableLoop(Loop *C, DependenceAnalysis *DA, AliasAnalysis &AA,
+                       Instruction *&Blocking);
+bool isForwardable(Loop *C, LoopInfo &LI, DependenceAnalysis *DA,
+                   AliasAnalysis &AA, LoadInst *LD, Instruction *&Blocking);
+bool isGatherable(Loop *C, DominatorTree &DT, DependenceAnalysis *DA,
+                  AliasAnalysis &AA, LoadInst *LD);
+GlobalVariable *forwardBuffer(Function *Kernel);
+bool hasChunkLength(Loop *C, PHINode *VI, ICmpInst *Cond);
+void insertForwardStores(Loop *C, PHINode *VI, ICmpInst *Cond,
+                         std::vector<ForwardedLoad> &Loads,
+                         GlobalVariable *Buf);
+void loadForwarded(Loop *C, DominatorTree &DT, PHINode *VI,
+                   ICmpInst *Cond, std::vector<ForwardedLoad> &Loads,
+                   GlobalVariable *Buf);
+
+/* the instructions of F that may write memory */
+static void collectWriters(Function *F, SmallVectorImpl<Instruction *> &W) {
+  for (BasicBlock &BB : *F)
+    for (Instruction &I : BB)
+      if (I.mayWriteToMemory())
+        W.push_back(&I);
+}
+
+/*
+  checks that V is computed the same in both phases: its slice reads no
+  memory written by Writers, in any iteration, and allocates none; Loads
+  counts the loads of C in the slice
+*/
+static bool collectForwardSlice(Value *V, Loop *C, DependenceAnalysis *DA,
+                                AliasAnalysis &AA,
+                                SmallVectorImpl<Instruction *> &Writers,
+                                set<Instruction *> &Seen, unsigned &Loads,
+                                Instruction *&Blocking) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || !Seen.insert(I).second)
+    return true;
+
+  if (LoadInst *LD = dyn_cast<LoadInst>(I)) {
+    if (!LD->isSimple()) {
+      Blocking = I;
+      return false;
+    }
+    for (Instruction *W : Writers) {
+      if (mayClobberLoad(W, LD, DA, AA)) {
+        Blocking = W;
+        return false;
+      }
+    }
+    if (C->contains(I))
+      ++Loads;
+  } else if (isa<AllocaInst>(I) || I->mayReadOrWriteMemory()) {
+    Blocking = I;
+    return false;
+  }
+
+  for (Value *Op : I->operands()) {
+    if (!collectForwardSlice(Op, C, DA, AA, Writers, Seen, Loads, Blocking))
+      return false;
+  }
+  return true;
+}
+
+/* checks that the execute phase runs the iterations of its chunk loop C that
+   the access phase ran: the exits of C read no memory that it writes */
+bool isForwardableLoop(Loop *C, DependenceAnalysis *DA, AliasAnalysis &AA,
+                       Instruction *&Blocking) {
+  SmallVector<Instruction *, 8> Writers;
+  collectWriters(C->getHeader()->getParent(), Writers);
+
+  SmallVector<BasicBlock *, 4> Exiting;
+  C->getExitingBlocks(Exiting);
+  set<Instruction *> Seen;
+  unsigned Loads = 0;
+  Blocking = nullptr;
+  for (BasicBlock *BB : Exiting) {
+    if (!collectForwardSlice(BB->getTerminator(), C, DA, AA, Writers, Seen,
+                             Loads, Blocking))
+      return false;
+  }
+  return true;
+}
+
+/* checks that the address of LD, a load of the execute phase outside the
+   inner loops of its chunk loop C, may be forwarded */
+bool isForwardable(Loop *C, LoopInfo &LI, DependenceAnalysis *DA,
+                   AliasAnalysis &AA, LoadInst *LD, Instruction *&Blocking) {
+  SmallVector<Instruction *, 8> Writers;
+  collectWriters(C->getHeader()->getParent(), Writers);
+
+  Instruction *Ptr = dyn_cast<Instruction>(LD->getPointerOperand());
+  Blocking = LD;
+  if (!LD->isSimple() || LI.getLoopFor(LD->getParent()) != C || !Ptr ||
+      !C->contains(Ptr))
+    return false;
+
+  set<Instruction *> Seen;
+  unsigned Loads = 0;
+  Blocking = nullptr;
+  if (!collectForwardSlice(Ptr, C, DA, AA, Writers, Seen, Loads, Blocking))
+    return false;
+  Blocking = LD;
+  return Loads > 0;
+}
+
+/* checks that LD, a forwardable load of the execute phase, may be gathered:
+   it runs in every iteration, reads memory that the execute phase does not
+   write in any iteration, and its value fits a slot */
+bool isGatherable(Loop *C, DominatorTree &DT, DependenceAnalysis *DA,
+                  AliasAnalysis &AA, LoadInst *LD) {
+  const DataLayout &DL = LD->getModule()->getDataLayout();
+  Type *Ty = LD->getType();
+  if (!DT.dominates(LD->getParent(), C->getLoopLatch()) ||
+      Ty->isAggregateType() ||
+      DL.getTypeAllocSize(Ty) > DL.getPointerSize())
+    return false;
+
+  SmallVector<Instruction *, 8> Writers;
+  collectWriters(C->getHeader()->getParent(), Writers);
+  for (Instruction *W : Writers) {
+    if (mayClobberLoad(W, LD, DA, AA))
+      return false;
+  }
+  return true;
+}
+
+/* the thread-local buffer shared by the phases of Kernel */
+GlobalVariable *forwardBuffer(Function *Kernel) {
+  Module *M = Kernel->getParent();
+  std::string name = Kernel->getName().str() + "_forward";
+  if (GlobalVariable *Buf = M->getNamedGlobal(name))
+    return Buf;
+
+  LLVMContext &C = M->getContext();
+  StructType *Ty = StructType::get(
+      C, {Type::getInt8PtrTy(C)->getPointerTo(), Type::getInt64Ty(C)});
+  return new GlobalVariable(*M, Ty, false, GlobalValue::InternalLinkage,
+                            Constant::getNullValue(Ty), name, nullptr,
+                            GlobalVariable::GeneralDynamicTLSModel);
+}
+
+/* true iff the length of the chunk of C, counted by VI up to the bound of
+   Cond, is known before C */
+bool hasChunkLength(Loop *C, PHINode *VI, ICmpInst *Cond) {
+  Value *Hi = Cond->getOperand(1);
+  return C->getLoopPreheader() && getChunkStart(C, VI) &&
+         Hi->getType() == VI->getType() && C->isLoopInvariant(Hi);
+}
+
+/* hi - lo, as an i64, before C */
+static Value *chunkLength(IRBuilder<> &Builder, Loop *C, PHINode *VI,
+                          ICmpInst *Cond) {
+  return Builder.CreateZExtOrTrunc(
+      Builder.CreateSub(Cond->getOperand(1), getChunkStart(C, VI)),
+      Builder.getInt64Ty(), "forward_len");
+}
+
+/* the column of load p, of Len slots from Base, as an array of its type */
+static Value *forwardColumn(IRBuilder<> &Builder, Value *Base, Value *Len,
+                            unsigned p, ForwardedLoad &FL) {
+  Value *Col = Builder.CreateGEP(
+      Base, Builder.CreateMul(Len, ConstantInt::get(Len->getType(), p)));
+  Type *Ty = FL.Value ? FL.Load->getType()
+                      : FL.Pref->getArgOperand(0)->getType();
+  return Builder.CreatePointerCast(Col, Ty->getPointerTo());
+}
+
+/* vi - lo, at the top of the iterations of C */
+static Value *forwardIndex(Loop *C, PHINode *VI) {
+  IRBuilder<> Builder(&*C->getHeader()->getFirstInsertionPt());
+  return Builder.CreateSub(VI, getChunkStart(C, VI), "forward_k");
+}
+
+/*
+  makes the access phase, whose chunk loop C is counted by VI up to the
+  bound of Cond (see hasChunkLength), store the addresses, or values, of
+  Loads in Buf
+*/
+void insertForwardStores(Loop *C, PHINode *VI, ICmpInst *Cond,
+                         std::vector<ForwardedLoad> &Loads,
+                         GlobalVariable *Buf) {
+  Module *M = C->getHeader()->getModule();
+
+  // slots for the longer of a chunk of the granularity and this one
+  IRBuilder<> Builder(C->getLoopPreheader()->getTerminator());
+  Type *I64 = Builder.getInt64Ty();
+  Value *Len = chunkLength(Builder, C, VI, Cond);
+  Value *Slots = Len;
+  GlobalVariable *State =
+      M->getNamedGlobal(getInstructionMD(Cond, DAE_CHUNK_STATE_MD));
+  if (State) {
+    Value *Gran = Builder.CreateLoad(Builder.CreateConstInBoundsGEP2_32(
+        State->getValueType(), State, 0, DAE_CHUNK_GRAN));
+    Slots = Builder.CreateSelect(Builder.CreateICmpUGT(Gran, Len), Gran, Len);
+  }
+  Slots = Builder.CreateMul(Slots, ConstantInt::get(I64, Loads.size()));
+  Constant *Reserve = M->getOrInsertFunction(
+      "dae_forward_reserve", Type::getInt8PtrTy(M->getContext())->getPointerTo(),
+      Buf->getType(), I64, nullptr);
+  Value *Base = Builder.CreateCall(Reserve, {Buf, Slots}, "forward_base");
+  std::vector<Value *> Cols;
+  for (unsigned p = 0, e = Loads.size(); p != e; ++p)
+    Cols.push_back(forwardColumn(Builder, Base, Len, p, Loads[p]));
+
+  Value *K = forwardIndex(C, VI);
+  for (unsigned p = 0, e = Loads.size(); p != e; ++p) {
+    IntrinsicInst *Pref = Loads[p].Pref;
+    Builder.SetInsertPoint(Pref);
+    Value *Slot = Builder.CreateGEP(Cols[p], K);
+    if (!Loads[p].Value) {
+      Builder.CreateStore(Pref->getArgOperand(0), Slot);
+      continue;
+    }
+    // the load itself, in place of its prefetch
+    LoadInst *LD = Loads[p].Load;
+    LoadInst *Copy = Builder.CreateLoad(
+        Builder.CreatePointerCast(Pref->getArgOperand(0),
+                                  LD->getPointerOperandType()),
+        LD->getName() + ".gather");
+    Copy->setAlignment(LD->getAlignment());
+    Builder.CreateStore(Copy, Slot);
+    Pref->eraseFromParent();
+  }
+}
+
+/* makes the execute phase, whose chunk loop C, with dominator tree DT, is
+   counted by VI up to the bound of Cond (see hasChunkLength), read Loads
+   from Buf */
+void loadForwarded(Loop *C, DominatorTree &DT, PHINode *VI,
+                   ICmpInst *Cond, std::vector<ForwardedLoad> &Loads,
+                   GlobalVariable *Buf) {
+  IRBuilder<> Builder(C->getLoopPreheader()->getTerminator());
+  Value *Base = Builder.CreateLoad(Builder.CreateConstInBoundsGEP2_32(
+      Buf->getValueType(), Buf, 0, DAE_FORWARD_BASE), "forward_base");
+  Value *Len = chunkLength(Builder, C, VI, Cond);
+  std::vector<Value *> Cols;
+  for (unsigned p = 0, e = Loads.size(); p != e; ++p)
+    Cols.push_back(forwardColumn(Builder, Base, Len, p, Loads[p]));
+
+  Value *K = forwardIndex(C, VI);
+  for (unsigned p = 0, e = Loads.size(); p != e; ++p) {
+    LoadInst *LD = Loads[p].Load;
+    if (Loads[p].Value) {
+      // unit stride, where the gather was
+      Builder.SetInsertPoint(LD);
+      LoadInst *Dense = Builder.CreateLoad(Builder.CreateGEP(Cols[p], K));
+      Dense->takeName(LD);
+      LD->replaceAllUsesWith(Dense);
+      LD->eraseFromParent();
+      continue;
+    }
+    // every use in the loop, e.g. a store to the same address
+    Value *Ptr = LD->getPointerOperand();
+    SmallVector<Use *, 8> Uses;
+    BasicBlock *Dom = nullptr;
+    for (Use &U : Ptr->uses()) {
+      Instruction *UI = cast<Instruction>(U.getUser());
+      if (C->contains(UI) && !isa<PHINode>(UI)) {
+        Uses.push_back(&U);
+        Dom = Dom ? DT.findNearestCommonDominator(Dom, UI->getParent())
+                  : UI->getParent();
+      }
+    }
+    // read where the iteration runs, not in the header, which also runs
+    // the exit test past the last slot of the column
+    Instruction *At = Dom->getTerminator();
+    for (Instruction &I : *Dom) {
+      if (std::find_if(Uses.begin(), Uses.end(), [&I](Use *U) {
+            return U->getUser() == &I;
+          }) != Uses.end()) {
+        At = &I;
+        break;
+      }
+    }
+    Builder.SetInsertPoint(At);
+    Value *Fwd = Builder.CreatePointerCast(
+        Builder.CreateLoad(Builder.CreateGEP(Cols[p], K)), Ptr->getType(),
+        Ptr->getName() + ".fwd");
+    for (Use *U : Uses)
+      U->set(Fwd);
+  }
+}
+
+#endif
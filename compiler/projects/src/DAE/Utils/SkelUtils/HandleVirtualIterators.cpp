@@ -30,11 +30,15 @@ using namespace util;
 
 #define MAX_SUP 32
 
-void insertVirtualIterator(Loop *&L, Value *&vi, Value *&lsup);
-void incrementVirtualIteratorSpec(BasicBlock *BB, Value *vi, Instruction *lvi);
-void initializeVIinParentHeader(Loop *L, Value *vi);
-BasicBlock *insertChunkCond(Loop *&L, LoopInfo *LI, Value *vi, Value *lsup,
-                            Instruction *&load_vi, BasicBlock *dcb);
+GlobalVariable *insertChunkState(Loop *L, unsigned gran, bool fixed,
+                                 unsigned tile = 0, bool tileFixed = false,
+                                 uint64_t footprint = 0);
+void incrementVirtualIteratorSpec(BasicBlock *BB, PHINode *phi_vi);
+void moveHeaderPhis(Loop *L, BasicBlock *H, BasicBlock *entry,
+                    BasicBlock *dcb);
+BasicBlock *insertChunkCond(Loop *&L, LoopInfo *LI, PHINode *chunk_lo,
+                            Value *chunk_hi, BasicBlock *entry,
+                            BasicBlock *dcb, PHINode *&phi_vi);
 std::string replaceAllOccurences(std::string &str, std::string oldstr,
                                  std::string newstr);
 bool belongs(std::vector<BasicBlock *> cloned_code, BasicBlock *bb);
@@ -48,38 +52,27 @@ Value *FindFunctionArgumentOfInstr(Instruction *I, Function *F);
 
 /*
   to execute the loop by chuncks we insert a virtual iterator that
-  takes values between a lower and an upper limit set by the VM
+  takes values between a lower and an upper limit set by the VM. Both
+  are SSA values; the loop's state block only mirrors them
 */
-void insertVirtualIterator(Loop *&L, Value *&vi, Value *&lsup) {
+GlobalVariable *insertChunkState(Loop *L, unsigned gran, bool fixed,
+                                 unsigned tile, bool tileFixed,
+                                 uint64_t footprint) {
 
   BasicBlock *H = L->getHeader();
   Function *F = H->getParent();
   Module *M = F->getParent();
 
-  /* declare V.I. and the bounds of the chunk*/
-  vi = new GlobalVariable(*(F->getParent()),
-                          llvm::Type::getInt64Ty(F->getContext()), false,
-                          GlobalValue::ExternalLinkage,
-                          0, // cstInit
-                          M->getModuleIdentifier() + "_" + F->getName().str() +
-                              "_" + H->getName().str() + "_vi");
-  declareExternalGlobal(vi, 0);
-  lsup = new GlobalVariable(
-      *(F->getParent()), llvm::Type::getInt64Ty(F->getContext()), false,
+  /* declare the block holding the bounds of the chunk and the granularity */
+  GlobalVariable *state = new GlobalVariable(
+      *M, getChunkStateType(F->getContext()), false,
       GlobalValue::ExternalLinkage,
       0, // cstInit
       M->getModuleIdentifier() + "_" + F->getName().str() + "_" +
-          H->getName().str() + "_lsup");
-  declareExternalGlobal(lsup, 0);
-}
-
-/* vi of subloops must be re-initialized in the header of the parent loop*/
-void initializeVIinParentHeader(Loop *L, Value *vi) {
-  if (!L->getParentLoop())
-    errs() << "ERROR: Subloop expected! \n\n";
-  ConstantInt *zero =
-      llvm::ConstantInt::get(llvm::Type::getInt64Ty(vi->getContext()), 0);
-  new StoreInst(zero, vi, L->getParentLoop()->getHeader()->getTerminator());
+          H->getName().str() + "_chunk");
+  state->setAlignment(DAE_CHUNK_STATE_ALIGN);
+  declareExternalChunkState(state, gran, fixed, tile, tileFixed, footprint);
+  return state;
 }
 
 /*find and return the virtual iterator of the loop*/
@@ -114,12 +107,13 @@ Instruction *getLoopVirtualUpperBound(Loop *L) {
 
 /*
   in addition to the original condition of the loop, insert one cond
-  on the virtual iterator, given the linf and lsup bounds for the chunk
-  this cond exits and returns to the decision block to start a new chunk
+  on the virtual iterator, given the chunk_lo and chunk_hi bounds for the chunk
+  this cond exits and returns to the decision block to start a new chunk.
+  The original entry is redirected to the entry of the chunking blocks
 */
-BasicBlock *insertChunkCond(Loop *&L, LoopInfo *LI, Value *vi, Value *lsup,
-                            BasicBlock *dcb, Value *vi_dcb_val,
-                            PHINode *&phi_vi) {
+BasicBlock *insertChunkCond(Loop *&L, LoopInfo *LI, PHINode *chunk_lo,
+                            Value *chunk_hi, BasicBlock *entry,
+                            BasicBlock *dcb, PHINode *&phi_vi) {
 
   BasicBlock *H = L->getHeader();
 
@@ -133,42 +127,31 @@ BasicBlock *insertChunkCond(Loop *&L, LoopInfo *LI, Value *vi, Value *lsup,
       H->getContext(), Twine(H->getName().str() + "_exitChunk"), H->getParent(),
       H);
   BranchInst::Create(dcb, exitBlock);
+  chunk_lo->addIncoming(chunk_hi, exitBlock);
 
   phi_vi = PHINode::Create(Type::getInt64Ty(H->getContext()), 2, "vi_value",
                            newCond);
-  phi_vi->addIncoming(vi_dcb_val, dcb);
+  phi_vi->addIncoming(chunk_lo, dcb);
 
-  LoadInst *load_lsup = new LoadInst(lsup, "lsup_value", newCond);
+  ICmpInst *cmp = new ICmpInst(*newCond, ICmpInst::ICMP_SLT, phi_vi, chunk_hi,
+                               "vi_cmp");
+  AttachMetadata(cmp, "VirtualIt", "chunkCond");
 
-  ICmpInst *cmp = new ICmpInst(*newCond, ICmpInst::ICMP_SLT, phi_vi, load_lsup,
-                               vi->getName() + "_cmp");
-
-  // Make sure all predecessors now go to our new condition
+  // Make sure all predecessors now go to our new condition; the entries
+  // into the loop (there may be several) go to the chunking blocks
   std::vector<TerminatorInst *> termInstrs;
-  BasicBlock *lp = L->getLoopPredecessor();
-
-  for (auto it = pred_begin(H), end = pred_end(H); it != end; ++it) {
-    if ((*it) == lp) {
-      // Original entry should be redirected to dcb
-      TerminatorInst *tinstr = (*it)->getTerminator();
-      for (auto it = tinstr->op_begin(), end = tinstr->op_end(); it != end;
-           ++it) {
-        Use *use = &*it;
-        if (use->get() == H) {
-          use->set(dcb);
-        }
-      }
-    } else {
+  for (auto it = pred_begin(H), end = pred_end(H); it != end; ++it)
+    if (std::find(termInstrs.begin(), termInstrs.end(),
+                  (*it)->getTerminator()) == termInstrs.end())
       termInstrs.push_back((*it)->getTerminator());
-    }
-  }
 
   for (auto &tinstr : termInstrs) {
+    BasicBlock *target = L->contains(tinstr->getParent()) ? newCond : entry;
     for (auto it = tinstr->op_begin(), end = tinstr->op_end(); it != end;
          ++it) {
       Use *use = &*it;
       if (use->get() == H) {
-        use->set(newCond);
+        use->set(target);
       }
     }
   }
@@ -188,23 +171,66 @@ BasicBlock *insertChunkCond(Loop *&L, LoopInfo *LI, Value *vi, Value *lsup,
   return newCond;
 }
 
-void incrementVirtualIteratorSpec(BasicBlock *BB, Value *vi, PHINode *phi_vi) {
+void incrementVirtualIteratorSpec(BasicBlock *BB, PHINode *phi_vi) {
   assert((BB != 0) &&
          "WARNING: Loop has no unique latch! Try simplify-loop pass first.\n");
 
   ConstantInt *one =
-      llvm::ConstantInt::get(llvm::Type::getInt64Ty(vi->getContext()), 1);
-
-  BinaryOperator *add = BinaryOperator::CreateAdd(
-      phi_vi, // new LoadInst(vi,"vi_load_add",  BB->getTerminator()),
-      one, vi->getName() + "_inc", BB->getTerminator());
+      llvm::ConstantInt::get(llvm::Type::getInt64Ty(phi_vi->getContext()), 1);
 
-  StoreInst *store_vi_inc = new StoreInst(add, vi, BB->getTerminator());
-  phi_vi->addIncoming(store_vi_inc->getOperand(0), BB);
+  BinaryOperator *add =
+      BinaryOperator::CreateAdd(phi_vi, one, "vi_inc", BB->getTerminator());
+  phi_vi->addIncoming(add, BB);
 
   return;
 }
 
+/*
+  the original header H is now only entered from the chunk condition. Its
+  PHI nodes move there, and their values survive the trip through the
+  chunking blocks from one chunk to the next:
+    entry: x.entry = phi [x0, outside preds]  (only if several)
+    dcb:   x.chunk = phi [x0, entry], [x, exitChunk]
+    cond:  x       = phi [x.chunk, dcb], [x.next, latch]
+*/
+void moveHeaderPhis(Loop *L, BasicBlock *H, BasicBlock *entry,
+                    BasicBlock *dcb) {
+  BasicBlock *cond = L->getHeader();
+  BasicBlock *exitChunk = cond->getTerminator()->getSuccessor(1);
+
+  while (PHINode *phi = dyn_cast<PHINode>(&H->front())) {
+    Value *init;
+    if (BasicBlock *pred = entry->getSinglePredecessor()) {
+      init = phi->getIncomingValueForBlock(pred);
+    } else {
+      PHINode *phi_entry = PHINode::Create(
+          phi->getType(), 2, phi->getName() + ".entry", &entry->front());
+      for (auto it = pred_begin(entry), end = pred_end(entry); it != end;
+           ++it)
+        phi_entry->addIncoming(phi->getIncomingValueForBlock(*it), *it);
+      init = phi_entry;
+    }
+
+    PHINode *phi_dcb = PHINode::Create(phi->getType(), 2,
+                                       phi->getName() + ".chunk",
+                                       dcb->getFirstNonPHI());
+    PHINode *phi_cond =
+        PHINode::Create(phi->getType(), phi->getNumIncomingValues(), "",
+                        cond->getFirstNonPHI());
+    phi_dcb->addIncoming(init, entry);
+    phi_dcb->addIncoming(phi_cond, exitChunk);
+    phi_cond->addIncoming(phi_dcb, dcb);
+    for (unsigned i = 0, e = phi->getNumIncomingValues(); i != e; ++i)
+      if (L->contains(phi->getIncomingBlock(i)))
+        phi_cond->addIncoming(phi->getIncomingValue(i),
+                              phi->getIncomingBlock(i));
+
+    phi_cond->takeName(phi);
+    phi->replaceAllUsesWith(phi_cond);
+    phi->eraseFromParent();
+  }
+}
+
 /* create the function for the decision block*/
 Function *createDBfunction(LLVMContext &C, Module *M, std::string ID) {
   std::vector<Type *> Params;
@@ -0,0 +1,334 @@
+//===- InlinePrefetch.cpp - Prefetches a distance ahead within a loop -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file InlinePrefetch.cpp
+///
+/// \brief Prefetches a distance ahead within a loop
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// Classic software prefetching, as an alternative to an access phase: the
+// loop stays coupled, and at the top of each iteration i it evaluates the
+// address slice of its loads for iteration i + d and prefetches them.
+//
+//   header:  PHIs; left = iterations before the first exit
+//            left > d ? ahead_d : body
+//   ahead_d: the slices of the loads prefetched d ahead, for i + d
+//            left > d' ? ahead_d' : body       (d < d' < ...)
+//   body:    the original iteration
+//
+// The header PHIs of a slice are evaluated ahead from their recurrence
+// (P + d * step), which requires them to be affine; the rest of the slice is
+// cloned. A slice is only run ahead when iteration i + d would run it too:
+// its instructions may be speculated, its loads run in every iteration (they
+// dominate the latch) and read memory that the loop does not write in any
+// iteration (dependence analysis: a store to b[i + 1] would make b[i + d]
+// stale, although alias analysis tells it apart from b[i]), and the
+// exits of the loop are computable, so that no slice runs past the first
+// one. A loop that only leaves by its chunk bound prefetches within the
+// chunk.
+//
+// Loads whose address depends on other prefetched loads are staggered: a
+// load is prefetched h * d iterations ahead, where h is the length of the
+// longest chain of prefetched loads that starts with it (1 for a load that
+// no other prefetched load depends on). For a[b[i]], b[i + 2d] is then
+// prefetched d iterations before the slice of a[b[i + d]] loads it.
+//
+//===----------------------------------------------------------------------===//
+#ifndef InlinePrefetch_
+#define InlinePrefetch_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include <map>
+#include "Utils.cpp"
+
+using namespace llvm;
+using namespace std;
+
+// Upper bound of a computed distance, in iterations
+#define DAE_MAX_DISTANCE 64
+
+// The instructions of a loop that the address of one of its loads depends
+// on in the same iteration, operands first. Its header PHIs are evaluated
+// ahead, the rest cloned.
+typedef SetVector<Instruction *> AheadSlice;
+
+unsigned aheadDistance(Loop *L, unsigned Latency);
+bool getAheadLimit(Loop *L, BasicBlock *ChunkExiting, ScalarEvolution &SE,
+                   const SCEV *&Limit, BasicBlock *&Blocking);
+bool getAheadSlice(Loop *L, LoopInfo &LI, DominatorTree &DT,
+                   ScalarEvolution &SE, DependenceAnalysis *DA,
+                   AliasAnalysis &AA, LoadInst *LD, AheadSlice &Slice,
+                   Instruction *&Blocking);
+void staggerAhead(map<LoadInst *, AheadSlice> &Slices, unsigned Distance,
+                  map<LoadInst *, unsigned> &Ahead);
+unsigned insertAheadPrefetches(Loop *L, ScalarEvolution &SE,
+                               const SCEV *Limit,
+                               map<LoadInst *, AheadSlice> &Slices,
+                               map<LoadInst *, unsigned> &Ahead);
+
+/* The distance covering Latency at one instruction per cycle, the blocks of
+   inner loops being counted once */
+unsigned aheadDistance(Loop *L, unsigned Latency) {
+  unsigned Cost = 0;
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      if (!isa<PHINode>(I) && !isa<DbgInfoIntrinsic>(I) && !isa<BranchInst>(I))
+        ++Cost;
+    }
+  }
+  unsigned D = Cost ? (Latency + Cost - 1) / Cost : DAE_MAX_DISTANCE;
+  return std::max(1u, std::min(D, (unsigned)DAE_MAX_DISTANCE));
+}
+
+/* The number of times the backedge of L is taken before its first exit,
+   other than ChunkExiting; Blocking is an exit that is not computable */
+bool getAheadLimit(Loop *L, BasicBlock *ChunkExiting, ScalarEvolution &SE,
+                   const SCEV *&Limit, BasicBlock *&Blocking) {
+  SmallVector<BasicBlock *, 4> Exiting;
+  L->getExitingBlocks(Exiting);
+  SmallVector<const SCEV *, 4> Counts;
+  for (BasicBlock *BB : Exiting) {
+    if (BB == ChunkExiting)
+      continue;
+    const SCEV *EC = SE.getExitCount(L, BB);
+    if (isa<SCEVCouldNotCompute>(EC)) {
+      Blocking = BB;
+      return false;
+    }
+    Counts.push_back(EC);
+  }
+  if (Counts.empty()) {
+    const SCEV *EC = SE.getExitCount(L, ChunkExiting);
+    if (isa<SCEVCouldNotCompute>(EC)) {
+      Blocking = ChunkExiting;
+      return false;
+    }
+    Counts.push_back(EC);
+  }
+
+  Type *Ty = Counts[0]->getType();
+  for (const SCEV *EC : Counts) {
+    if (SE.getTypeSizeInBits(EC->getType()) > SE.getTypeSizeInBits(Ty))
+      Ty = EC->getType();
+  }
+  Limit = SE.getNoopOrZeroExtend(Counts[0], Ty);
+  for (unsigned i = 1; i < Counts.size(); ++i)
+    Limit = SE.getUMinExpr(Limit, SE.getNoopOrZeroExtend(Counts[i], Ty));
+  return true;
+}
+
+/* Adds the slice of V to Slice; Writers are the instructions of L that may
+   write memory */
+static bool collectAheadSlice(Value *V, Loop *L, LoopInfo &LI,
+                              DominatorTree &DT, ScalarEvolution &SE,
+                              DependenceAnalysis *DA, AliasAnalysis &AA,
+                              SmallVectorImpl<Instruction *> &Writers,
+                              AheadSlice &Slice, Instruction *&Blocking) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || !L->contains(I) || Slice.count(I))
+    return true;
+
+  if (PHINode *P = dyn_cast<PHINode>(I)) {
+    const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(P));
+    if (P->getParent() != L->getHeader() || !AR || AR->getLoop() != L ||
+        !AR->isAffine()) {
+      Blocking = I;
+      return false;
+    }
+    Slice.insert(I);
+    return true;
+  }
+
+  if (LI.getLoopFor(I->getParent()) != L) {
+    Blocking = I;
+    return false;
+  }
+  if (LoadInst *Ld = dyn_cast<LoadInst>(I)) {
+    // run by every iteration, from memory the loop leaves alone
+    if (!Ld->isSimple() || !DT.dominates(I->getParent(), L->getLoopLatch())) {
+      Blocking = I;
+      return false;
+    }
+    for (Instruction *W : Writers) {
+      if (mayClobberLoad(W, Ld, DA, AA)) {
+        Blocking = W;
+        return false;
+      }
+    }
+  } else if (!isSafeToSpeculativelyExecute(I)) {
+    Blocking = I;
+    return false;
+  }
+
+  for (Value *Op : I->operands()) {
+    if (!collectAheadSlice(Op, L, LI, DT, SE, DA, AA, Writers, Slice,
+                           Blocking))
+      return false;
+  }
+  Slice.insert(I);
+  return true;
+}
+
+/* The slice of the address of LD, a load of L outside its inner loops;
+   false with the offending instruction in Blocking if it cannot run ahead */
+bool getAheadSlice(Loop *L, LoopInfo &LI, DominatorTree &DT,
+                   ScalarEvolution &SE, DependenceAnalysis *DA,
+                   AliasAnalysis &AA, LoadInst *LD, AheadSlice &Slice,
+                   Instruction *&Blocking) {
+  SmallVector<Instruction *, 8> Writers;
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      if (I.mayWriteToMemory())
+        Writers.push_back(&I);
+    }
+  }
+
+  Blocking = nullptr;
+  if (!collectAheadSlice(LD->getPointerOperand(), L, LI, DT, SE, DA, AA,
+                         Writers, Slice, Blocking))
+    return false;
+
+  // an address that does not move with the loop needs no look-ahead
+  for (Instruction *I : Slice) {
+    if (isa<PHINode>(I))
+      return true;
+  }
+  Blocking = LD;
+  return false;
+}
+
+/* The length of the longest chain of prefetched loads from LD */
+static unsigned aheadHeight(LoadInst *LD, map<LoadInst *, AheadSlice> &Slices,
+                            map<LoadInst *, unsigned> &Heights) {
+  map<LoadInst *, unsigned>::iterator It = Heights.find(LD);
+  if (It != Heights.end())
+    return It->second;
+  unsigned H = 1;
+  for (auto &S : Slices) {
+    if (S.second.count(LD))
+      H = std::max(H, aheadHeight(S.first, Slices, Heights) + 1);
+  }
+  return Heights[LD] = H;
+}
+
+/* The distance of each load of Slices, staggered from Distance */
+void staggerAhead(map<LoadInst *, AheadSlice> &Slices, unsigned Distance,
+                  map<LoadInst *, unsigned> &Ahead) {
+  map<LoadInst *, unsigned> Heights;
+  for (auto &S : Slices)
+    Ahead[S.first] = aheadHeight(S.first, Slices, Heights) * Distance;
+}
+
+/* Inserts the prefetches of the loads of Slices at the top of L, each
+   Ahead[load] iterations ahead; Limit is given by getAheadLimit. Returns
+   the number of prefetches */
+unsigned insertAheadPrefetches(Loop *L, ScalarEvolution &SE,
+                               const SCEV *Limit,
+                               map<LoadInst *, AheadSlice> &Slices,
+                               map<LoadInst *, unsigned> &Ahead) {
+  BasicBlock *H = L->getHeader();
+  BasicBlock *Pre = L->getLoopPreheader();
+  Function *F = H->getParent();
+  Module *M = F->getParent();
+  LLVMContext &C = F->getContext();
+  SCEVExpander Expander(SE, M->getDataLayout(), "ahead");
+
+  // left = Limit - i, the backedges left before the first exit
+  Instruction *IP = &*H->getFirstInsertionPt();
+  Type *Ty = Limit->getType();
+  const SCEV *Iter = SE.getAddRecExpr(SE.getConstant(Ty, 0),
+                                      SE.getConstant(Ty, 1), L,
+                                      SCEV::FlagNUW);
+  Value *Left = Expander.expandCodeFor(SE.getMinusSCEV(Limit, Iter), Ty, IP);
+
+  // the steps of the PHIs to evaluate ahead, before the CFG changes
+  map<PHINode *, Value *> Steps;
+  map<unsigned, vector<LoadInst *>> ByAhead;
+  for (auto &S : Slices) {
+    for (Instruction *I : S.second) {
+      PHINode *P = dyn_cast<PHINode>(I);
+      if (P && !Steps.count(P)) {
+        const SCEVAddRecExpr *AR = cast<SCEVAddRecExpr>(SE.getSCEV(P));
+        const SCEV *Step = AR->getStepRecurrence(SE);
+        Steps[P] = Expander.expandCodeFor(Step, Step->getType(),
+                                          Pre->getTerminator());
+      }
+    }
+    ByAhead[Ahead[S.first]].push_back(S.first);
+  }
+
+  BasicBlock *Body = SplitBlock(H, IP);
+  BasicBlock *Guard = H;
+  Type *I32 = Type::getInt32Ty(C);
+  Value *PrefFun = Intrinsic::getDeclaration(M, Intrinsic::prefetch);
+  unsigned Prefs = 0;
+  for (auto &G : ByAhead) {
+    unsigned D = G.first;
+    BasicBlock *Pf = BasicBlock::Create(C, "ahead" + Twine(D), F, Body);
+    Guard->getTerminator()->eraseFromParent();
+    IRBuilder<> Builder(Guard);
+    Builder.CreateCondBr(
+        Builder.CreateICmpUGT(Left, ConstantInt::get(Ty, D)), Pf, Body);
+    Builder.SetInsertPoint(Pf);
+    Builder.SetInsertPoint(Builder.CreateBr(Body));
+
+    ValueToValueMapTy VMap;
+    for (LoadInst *LD : G.second) {
+      for (Instruction *I : Slices[LD]) {
+        if (VMap.count(I))
+          continue;
+        if (PHINode *P = dyn_cast<PHINode>(I)) {
+          Value *Step = Steps[P];
+          Value *Off =
+              Builder.CreateMul(Step, ConstantInt::get(Step->getType(), D));
+          if (P->getType()->isPointerTy()) {
+            Type *I8Ptr =
+                Type::getInt8PtrTy(C, P->getType()->getPointerAddressSpace());
+            Value *Raw = Builder.CreatePointerCast(P, I8Ptr);
+            VMap[I] = Builder.CreatePointerCast(Builder.CreateGEP(Raw, Off),
+                                                P->getType(),
+                                                P->getName() + ".ahead");
+          } else {
+            VMap[I] = Builder.CreateAdd(P, Off, P->getName() + ".ahead");
+          }
+          continue;
+        }
+        Instruction *Clone = I->clone();
+        if (I->hasName())
+          Clone->setName(I->getName() + ".ahead");
+        Clone->setMetadata(DAE_LOAD_ID_MD, nullptr);
+        Builder.Insert(Clone);
+        RemapInstruction(Clone, VMap, RF_IgnoreMissingEntries);
+        VMap[I] = Clone;
+      }
+
+      Value *Ptr = LD->getPointerOperand();
+      Value *Addr = VMap.count(Ptr) ? (Value *)VMap[Ptr] : Ptr;
+      Type *I8Ptr = Type::getInt8PtrTy(C, LD->getPointerAddressSpace());
+      Builder.CreateCall(PrefFun,
+                         {Builder.CreatePointerCast(Addr, I8Ptr),
+                          ConstantInt::get(I32, 0),   // read
+                          ConstantInt::get(I32, 3),   // locality
+                          ConstantInt::get(I32, 1)}); // data
+      ++Prefs;
+    }
+    Guard = Pf;
+  }
+  return Prefs;
+}
+
+#endif
@@ -0,0 +1,493 @@
+//===- Interleave.cpp - Interleaved pointer chains of a chunk loop --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file Interleave.cpp
+///
+/// \brief Interleaved pointer chains of a chunk loop
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// A chunk loop C whose iterations each walk a chain of pointers, in a chase
+// loop L (see PrefetchIdioms.cpp), is rewritten as a state machine that
+// walks up to G chains at once, in the style of asynchronous memory access
+// chaining (AMAC). Each iteration of C is parked in one of G slots once the
+// head of its chain is known; the walks then advance by one node per visit,
+// round-robin, and each prefetches its next node before yielding to the
+// next slot:
+//
+//   header, prologue: unchanged, in the original order
+//   fill:    the iteration takes the free slot cur: the values the rest of
+//            it uses are saved there, the head of its chain is prefetched
+//   advance: cur moves to the next slot
+//   sched:   a free slot takes the next iteration; a busy one is resumed
+//   resume:  one iteration of L for the walk of the slot
+//   yield:   the state of L is saved, the next node prefetched
+//   finish:  the rest of the iteration (the epilogue) has run; the slot is
+//            free again, for the next iteration
+//   drain:   at an exit of C, the walks left are run to their end
+//
+// Each node is thus read about G steps after its prefetch. The iterations
+// that skip L (the guard of a rotated loop) run in place. C is interleaved
+// when:
+//  - L is the only subloop of C, with a preheader and a single latch, and
+//    C has a single latch; neither L nor the epilogue leaves C;
+//  - the header PHIs of C are updated from values known before L, or
+//    recomputed from them, since the next iteration starts before the walk
+//    ends;
+//  - no loop-carried dependence links the loads and stores of C, and it has
+//    no call or atomic operation that writes memory or may throw.
+//
+//===----------------------------------------------------------------------===//
+#ifndef Interleave_
+#define Interleave_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "ParallelChunks.cpp"
+#include "PrefetchIdioms.cpp"
+
+using namespace llvm;
+using namespace std;
+using namespace util;
+
+struct InterleavedLoop {
+  Loop *C, *L;
+  PHINode *Chase;                  // the node visited by L
+  LoadInst *Next;                  // the next node, loaded by L
+  SetVector<BasicBlock *> Walk;    // L and the epilogue, up to the latch of C
+  SetVector<Instruction *> LiveIn; // values of the prologue they use
+};
+
+bool analyzeInterleave(Loop *C, DominatorTree &DT, DependenceAnalysis *DA,
+                       InterleavedLoop &I, std::string &Why);
+void interleaveLoop(InterleavedLoop &I, DominatorTree &DT, unsigned G);
+
+/* true if V is known at At, or can be recomputed there from known values */
+static bool isKnownAt(Value *V, Instruction *At, DominatorTree &DT,
+                      unsigned Depth = 4) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || DT.dominates(I, At))
+    return true;
+  if (!Depth || isa<PHINode>(I) || isa<TerminatorInst>(I) ||
+      isa<AllocaInst>(I) || I->mayReadOrWriteMemory() ||
+      I->mayHaveSideEffects())
+    return false;
+  for (Value *Op : I->operands())
+    if (!isKnownAt(Op, At, DT, Depth - 1))
+      return false;
+  return true;
+}
+
+/* V at At, recomputed before At if it is not known there */
+static Value *valueAt(Value *V, Instruction *At, DominatorTree &DT) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || DT.dominates(I, At))
+    return V;
+  Instruction *Clone = I->clone();
+  for (unsigned i = 0, e = I->getNumOperands(); i != e; ++i)
+    Clone->setOperand(i, valueAt(I->getOperand(i), At, DT));
+  Clone->setName(I->getName() + ".amac");
+  Clone->insertBefore(At);
+  return Clone;
+}
+
+/* true if the use U of a value of the prologue reads it during the walk,
+   rather than on an edge from the prologue into the epilogue */
+static bool isWalkUse(Use &U, InterleavedLoop &I) {
+  Instruction *User = cast<Instruction>(U.getUser());
+  if (PHINode *Phi = dyn_cast<PHINode>(User))
+    return I.Walk.count(Phi->getIncomingBlock(U));
+  return I.Walk.count(User->getParent());
+}
+
+/*
+  checks that the chains walked by the iterations of C can be interleaved
+  and collects what interleaveLoop needs
+*/
+bool analyzeInterleave(Loop *C, DominatorTree &DT, DependenceAnalysis *DA,
+                       InterleavedLoop &I, std::string &Why) {
+  BasicBlock *H = C->getHeader();
+  BasicBlock *Latch = C->getLoopLatch();
+  if (C->getSubLoops().size() != 1 || !C->getLoopPreheader() || !Latch) {
+    Why = "unsupported loop shape";
+    return false;
+  }
+  SmallVector<BasicBlock *, 4> Exits;
+  C->getUniqueExitBlocks(Exits);
+  if (Exits.empty()) {
+    Why = "unsupported loop shape";
+    return false;
+  }
+  Loop *L = C->getSubLoops()[0];
+  BasicBlock *Pre = L->getLoopPreheader();
+  BasicBlock *LLatch = L->getLoopLatch();
+  I.C = C;
+  I.L = L;
+
+  PrefetchIdiom Idiom;
+  I.Chase = nullptr;
+  if (L->getSubLoops().empty() && Pre && LLatch && findChaseIdiom(L, Idiom))
+    for (BasicBlock::iterator II = L->getHeader()->begin(); isa<PHINode>(II);
+         ++II) {
+      PHINode *Phi = cast<PHINode>(&*II);
+      if (Phi->getNumIncomingValues() == 2 &&
+          Phi->getIncomingValueForBlock(Pre) == Idiom.Head &&
+          isa<LoadInst>(Phi->getIncomingValueForBlock(LLatch))) {
+        I.Chase = Phi;
+        break;
+      }
+    }
+  if (!I.Chase) {
+    Why = "no pointer chase";
+    return false;
+  }
+  I.Next = cast<LoadInst>(I.Chase->getIncomingValueForBlock(LLatch));
+
+  // the walk: what runs from the header of L on, up to the latch of C
+  I.Walk.clear();
+  I.Walk.insert(L->getHeader());
+  for (unsigned w = 0; w != I.Walk.size(); ++w) {
+    TerminatorInst *T = I.Walk[w]->getTerminator();
+    for (unsigned s = 0, e = T->getNumSuccessors(); s != e; ++s) {
+      BasicBlock *Succ = T->getSuccessor(s);
+      if (!C->contains(Succ)) {
+        Why = "the walk leaves the loop";
+        return false;
+      }
+      if (Succ != H)
+        I.Walk.insert(Succ);
+    }
+  }
+  if (!I.Walk.count(Latch) || I.Walk.count(Pre)) {
+    Why = "unsupported loop shape";
+    return false;
+  }
+
+  // the next iteration starts once the walk is parked
+  Instruction *At = Pre->getTerminator();
+  for (BasicBlock::iterator II = H->begin(); isa<PHINode>(II); ++II) {
+    PHINode *Phi = cast<PHINode>(&*II);
+    if (!isKnownAt(Phi->getIncomingValueForBlock(Latch), At, DT)) {
+      Why = "the loop carries " + Phi->getName().str() + " through the walk";
+      return false;
+    }
+  }
+
+  I.LiveIn.clear();
+  for (Loop::block_iterator BB = C->block_begin(), BE = C->block_end();
+       BB != BE; ++BB) {
+    bool InWalk = I.Walk.count(*BB);
+    for (BasicBlock::iterator II = (*BB)->begin(), E = (*BB)->end(); II != E;
+         ++II) {
+      if (isa<DbgInfoIntrinsic>(II))
+        continue;
+      LoadInst *LD = dyn_cast<LoadInst>(II);
+      StoreInst *ST = dyn_cast<StoreInst>(II);
+      if ((LD && !LD->isSimple()) || (ST && !ST->isSimple()) ||
+          (!ST && II->mayWriteToMemory()) || II->mayThrow()) {
+        Why = std::string("side effects of ") + II->getOpcodeName();
+        return false;
+      }
+
+      for (Use &U : II->uses()) {
+        Instruction *User = cast<Instruction>(U.getUser());
+        if (InWalk && !C->contains(User)) {
+          Why = II->getName().str() + " is used after the loop";
+          return false;
+        }
+        if (!InWalk && C->contains(User) && isWalkUse(U, I)) {
+          if (!DT.dominates(&*II, At)) {
+            Why = "unsupported loop shape";
+            return false;
+          }
+          I.LiveIn.insert(&*II);
+        }
+      }
+    }
+  }
+
+  LCDResult R = parallelLCD(C, DA);
+  if (R != NoLCD) {
+    Why = getStringRep(R) + " between iterations";
+    return false;
+  }
+  return true;
+}
+
+/* the uses of X after C read it from the stack, as the exits of C are
+   taken once the walks left are done */
+static void demoteUsesAfter(Instruction *X, Loop *C) {
+  Function *F = X->getParent()->getParent();
+  AllocaInst *Slot = new AllocaInst(X->getType(), X->getName() + ".after",
+                                    &*F->getEntryBlock().begin());
+  BasicBlock::iterator Def(X);
+  if (isa<PHINode>(X))
+    Def = X->getParent()->getFirstInsertionPt();
+  else
+    ++Def;
+  new StoreInst(X, Slot, &*Def);
+
+  std::vector<Use *> Uses;
+  for (Use &U : X->uses())
+    if (!C->contains(cast<Instruction>(U.getUser())))
+      Uses.push_back(&U);
+  for (Use *U : Uses) {
+    Instruction *Before = cast<Instruction>(U->getUser());
+    if (PHINode *Phi = dyn_cast<PHINode>(Before))
+      Before = Phi->getIncomingBlock(*U)->getTerminator();
+    U->set(new LoadInst(Slot, X->getName() + ".reload", Before));
+  }
+}
+
+static AllocaInst *createSlots(IRBuilder<> &Builder, Type *Ty, unsigned G,
+                               const Twine &Name) {
+  return Builder.CreateAlloca(ArrayType::get(Ty, G), nullptr, Name);
+}
+
+static Value *slotOf(IRBuilder<> &Builder, Value *Slots, Value *Slot) {
+  return Builder.CreateInBoundsGEP(Slots, {Builder.getInt32(0), Slot});
+}
+
+static void prefetchNode(IRBuilder<> &Builder, Value *Node) {
+  unsigned AS = cast<PointerType>(Node->getType())->getAddressSpace();
+  createPrefetch(Builder,
+                 Builder.CreatePointerCast(Node, Builder.getInt8PtrTy(AS)));
+}
+
+/*
+  rewrites C as the state machine described above; the slots are arrays of
+  G elements on the stack, one per value saved, indexed by cur
+*/
+void interleaveLoop(InterleavedLoop &I, DominatorTree &DT, unsigned G) {
+  Loop *C = I.C, *L = I.L;
+  BasicBlock *H = C->getHeader();
+  BasicBlock *CPre = C->getLoopPreheader();
+  BasicBlock *Latch = C->getLoopLatch();
+  BasicBlock *LH = L->getHeader();
+  BasicBlock *Pre = L->getLoopPreheader();
+  BasicBlock *LLatch = L->getLoopLatch();
+  Function *F = H->getParent();
+  LLVMContext &Ctx = F->getContext();
+  Instruction *At = Pre->getTerminator();
+
+  // the values of the next iteration, before the CFG changes
+  std::vector<std::pair<PHINode *, Value *>> Carried;
+  for (BasicBlock::iterator II = H->begin(); isa<PHINode>(II); ++II) {
+    PHINode *Phi = cast<PHINode>(&*II);
+    Carried.push_back(std::make_pair(
+        Phi, valueAt(Phi->getIncomingValueForBlock(Latch), At, DT)));
+  }
+
+  SmallVector<BasicBlock *, 4> Exits;
+  C->getUniqueExitBlocks(Exits);
+  for (BasicBlock *E : Exits)
+    while (PHINode *Phi = dyn_cast<PHINode>(E->begin()))
+      DemotePHIToStack(Phi);
+  std::vector<Instruction *> UsedAfter;
+  for (Loop::block_iterator BB = C->block_begin(), BE = C->block_end();
+       BB != BE; ++BB)
+    for (BasicBlock::iterator II = (*BB)->begin(), E = (*BB)->end(); II != E;
+         ++II)
+      for (User *U : II->users())
+        if (!C->contains(cast<Instruction>(U))) {
+          UsedAfter.push_back(&*II);
+          break;
+        }
+  for (Instruction *X : UsedAfter)
+    demoteUsesAfter(X, C);
+
+  // the slots, and the state of the machine
+  IRBuilder<> Builder(&*F->getEntryBlock().begin());
+  DenseMap<Value *, AllocaInst *> Slots;
+  for (Instruction *X : I.LiveIn)
+    Slots[X] = createSlots(Builder, X->getType(), G, X->getName() + ".slots");
+  std::vector<PHINode *> State;
+  for (BasicBlock::iterator II = LH->begin(); isa<PHINode>(II); ++II) {
+    PHINode *Phi = cast<PHINode>(&*II);
+    State.push_back(Phi);
+    Slots[Phi] =
+        createSlots(Builder, Phi->getType(), G, Phi->getName() + ".slots");
+  }
+  AllocaInst *Live =
+      createSlots(Builder, Builder.getInt8Ty(), G, "amac.live");
+  AllocaInst *Cur = Builder.CreateAlloca(Builder.getInt32Ty(), nullptr,
+                                         "amac.cur");
+  AllocaInst *Active = Builder.CreateAlloca(Builder.getInt32Ty(), nullptr,
+                                            "amac.active");
+  AllocaInst *Exit = Builder.CreateAlloca(Builder.getInt32Ty(), nullptr,
+                                          "amac.exit");
+  std::vector<AllocaInst *> NextValues;
+  for (auto &P : Carried)
+    NextValues.push_back(Builder.CreateAlloca(
+        P.first->getType(), nullptr, P.first->getName() + ".amac.next"));
+
+  Builder.SetInsertPoint(CPre->getTerminator());
+  Builder.CreateStore(Constant::getNullValue(Live->getAllocatedType()), Live);
+  Builder.CreateStore(Builder.getInt32(0), Cur);
+  Builder.CreateStore(Builder.getInt32(0), Active);
+  Builder.CreateStore(Builder.getInt32(0), Exit);
+
+  std::string Name = LH->getName().str();
+  BasicBlock *Fill = BasicBlock::Create(Ctx, Name + "_amac_fill", F);
+  BasicBlock *Advance = BasicBlock::Create(Ctx, Name + "_amac_advance", F);
+  BasicBlock *Sched = BasicBlock::Create(Ctx, Name + "_amac_sched", F);
+  BasicBlock *Idle = BasicBlock::Create(Ctx, Name + "_amac_idle", F);
+  BasicBlock *Drained = BasicBlock::Create(Ctx, Name + "_amac_drained", F);
+  BasicBlock *Resume = BasicBlock::Create(Ctx, Name + "_amac_resume", F);
+  BasicBlock *Yield = BasicBlock::Create(Ctx, Name + "_amac_yield", F);
+  BasicBlock *Finish = BasicBlock::Create(Ctx, Name + "_amac_finish", F);
+  BasicBlock *NextIt = BasicBlock::Create(Ctx, Name + "_amac_next", F);
+  BasicBlock *Done = BasicBlock::Create(Ctx, Name + "_amac_done", F);
+
+  // fill: park the iteration in slot cur
+  Builder.SetInsertPoint(Fill);
+  Value *FillSlot = Builder.CreateLoad(Cur, "amac_cur");
+  for (Instruction *X : I.LiveIn)
+    Builder.CreateStore(X, slotOf(Builder, Slots[X], FillSlot));
+  for (PHINode *Phi : State)
+    Builder.CreateStore(Phi->getIncomingValueForBlock(Pre),
+                        slotOf(Builder, Slots[Phi], FillSlot));
+  Builder.CreateStore(Builder.getInt8(1), slotOf(Builder, Live, FillSlot));
+  Builder.CreateStore(
+      Builder.CreateAdd(Builder.CreateLoad(Active), Builder.getInt32(1)),
+      Active);
+  for (unsigned c = 0, e = Carried.size(); c != e; ++c)
+    Builder.CreateStore(Carried[c].second, NextValues[c]);
+  prefetchNode(Builder, I.Chase->getIncomingValueForBlock(Pre));
+  Builder.CreateBr(Advance);
+
+  // advance: cur = (cur + 1) % G
+  Builder.SetInsertPoint(Advance);
+  Value *Inc = Builder.CreateAdd(Builder.CreateLoad(Cur), Builder.getInt32(1));
+  Builder.CreateStore(
+      Builder.CreateSelect(Builder.CreateICmpEQ(Inc, Builder.getInt32(G)),
+                           Builder.getInt32(0), Inc),
+      Cur);
+  Builder.CreateBr(Sched);
+
+  // sched: resume the walk of slot cur, if any
+  Builder.SetInsertPoint(Sched);
+  Value *Slot = Builder.CreateLoad(Cur, "amac_slot");
+  Value *IsLive = Builder.CreateICmpNE(
+      Builder.CreateLoad(slotOf(Builder, Live, Slot)), Builder.getInt8(0));
+  Builder.CreateCondBr(IsLive, Resume, Idle);
+
+  // idle, finish: a free slot takes the next iteration, unless draining
+  Builder.SetInsertPoint(Idle);
+  Builder.CreateCondBr(
+      Builder.CreateICmpEQ(Builder.CreateLoad(Exit), Builder.getInt32(0)),
+      NextIt, Drained);
+
+  Builder.SetInsertPoint(Finish);
+  Builder.CreateStore(Builder.getInt8(0), slotOf(Builder, Live, Slot));
+  Builder.CreateStore(
+      Builder.CreateSub(Builder.CreateLoad(Active), Builder.getInt32(1)),
+      Active);
+  Builder.CreateCondBr(
+      Builder.CreateICmpEQ(Builder.CreateLoad(Exit), Builder.getInt32(0)),
+      NextIt, Drained);
+
+  Builder.SetInsertPoint(Drained);
+  Builder.CreateCondBr(
+      Builder.CreateICmpEQ(Builder.CreateLoad(Active), Builder.getInt32(0)),
+      Done, Advance);
+
+  Builder.SetInsertPoint(NextIt);
+  for (unsigned c = 0, e = Carried.size(); c != e; ++c)
+    Carried[c].first->addIncoming(Builder.CreateLoad(NextValues[c]), NextIt);
+  Builder.CreateBr(H);
+
+  // resume: the walk, cloned, on the values of the slot
+  ValueToValueMapTy VMap;
+  std::vector<BasicBlock *> Clones;
+  for (BasicBlock *BB : I.Walk) {
+    BasicBlock *Clone = CloneBasicBlock(BB, VMap, ".amac", F);
+    VMap[BB] = Clone;
+    Clones.push_back(Clone);
+  }
+  Builder.SetInsertPoint(Resume);
+  for (Instruction *X : I.LiveIn)
+    VMap[X] = Builder.CreateLoad(slotOf(Builder, Slots[X], Slot),
+                                 X->getName());
+  for (PHINode *Phi : State)
+    VMap[Phi] = Builder.CreateLoad(slotOf(Builder, Slots[Phi], Slot),
+                                   Phi->getName());
+  BasicBlock *LHClone = cast<BasicBlock>(VMap[LH]);
+  Builder.CreateBr(LHClone);
+
+  std::set<BasicBlock *> CloneSet(Clones.begin(), Clones.end());
+  for (BasicBlock *Clone : Clones)
+    for (BasicBlock::iterator II = Clone->begin(), E = Clone->end();
+         II != E;) {
+      Instruction *X = &*II++;
+      if (isa<DbgInfoIntrinsic>(X)) {
+        X->eraseFromParent();
+        continue;
+      }
+      RemapInstruction(X, VMap, RF_IgnoreMissingEntries);
+      // only the walk enters its clone
+      if (PHINode *Phi = dyn_cast<PHINode>(X))
+        for (int i = Phi->getNumIncomingValues() - 1; i >= 0; --i)
+          if (!CloneSet.count(Phi->getIncomingBlock(i)))
+            Phi->removeIncomingValue(i, false);
+    }
+  while (PHINode *Phi = dyn_cast<PHINode>(LHClone->begin()))
+    Phi->eraseFromParent();
+
+  TerminatorInst *T = cast<BasicBlock>(VMap[LLatch])->getTerminator();
+  for (unsigned s = 0, e = T->getNumSuccessors(); s != e; ++s)
+    if (T->getSuccessor(s) == LHClone)
+      T->setSuccessor(s, Yield);
+  T = cast<BasicBlock>(VMap[Latch])->getTerminator();
+  for (unsigned s = 0, e = T->getNumSuccessors(); s != e; ++s)
+    if (T->getSuccessor(s) == H)
+      T->setSuccessor(s, Finish);
+
+  // yield: save the state of L, prefetch the next node
+  Builder.SetInsertPoint(Yield);
+  for (PHINode *Phi : State) {
+    Value *V = Phi->getIncomingValueForBlock(LLatch);
+    if (Value *Mapped = VMap.lookup(V))
+      V = Mapped;
+    Builder.CreateStore(V, slotOf(Builder, Slots[Phi], Slot));
+  }
+  prefetchNode(Builder, VMap[I.Next]);
+  Builder.CreateBr(Advance);
+
+  // the prologue parks its iteration instead of walking
+  LH->removePredecessor(Pre, true);
+  Pre->getTerminator()->replaceUsesOfWith(LH, Fill);
+
+  // drain: each exit of C runs the walks left, then done takes it
+  Builder.SetInsertPoint(Done);
+  SwitchInst *Switch =
+      Builder.CreateSwitch(Builder.CreateLoad(Exit), Exits[0], Exits.size());
+  for (unsigned k = 0, ke = Exits.size(); k != ke; ++k) {
+    BasicBlock *Drain =
+        BasicBlock::Create(Ctx, Exits[k]->getName() + "_amac_drain", F);
+    Builder.SetInsertPoint(Drain);
+    Builder.CreateStore(Builder.getInt32(k + 1), Exit);
+    Builder.CreateBr(Sched);
+    Switch->addCase(Builder.getInt32(k + 1), Exits[k]);
+
+    for (Loop::block_iterator BB = C->block_begin(), BE = C->block_end();
+         BB != BE; ++BB) {
+      TerminatorInst *Term = (*BB)->getTerminator();
+      for (unsigned s = 0, e = Term->getNumSuccessors(); s != e; ++s)
+        if (Term->getSuccessor(s) == Exits[k])
+          Term->setSuccessor(s, Drain);
+    }
+  }
+
+  // the walk of L in place is only left to the iterations that skip it
+  removeUnreachableBlocks(*F);
+}
+
+#endif
@@ -30,48 +30,35 @@ void updatePHInodes(BasicBlock *b, BasicBlock *oldP, BasicBlock *newP);
 void replaceBrupdatePhi(BasicBlock *&BB, BasicBlock *&o, BasicBlock *&n);
 
 /* to treat while and for loops unitary, create an artificial loop latch IF
- * NECESSARY*/
+ * NECESSARY: all the backedges of a multi-latch loop are merged into
+ * <header>_latch, the header PHIs receiving their values through it*/
 BasicBlock *insertArtificialLoopLatch(Loop *L, LoopInfo *LI) {
   BasicBlock *oldB = L->getLoopLatch();
   if (oldB)
     return oldB;
 
-  // avoid duplicates: do not insert an artificial latch if there is already one
-  size_t found;
-  std::string text = "_latch";
-  if (oldB != 0) {
-    found = oldB->getName().find(text);
-    if (found != std::string::npos)
-      return oldB;
-  }
-
+  // the hints of the loop move to the new latch
+  MDNode *LoopID = L->getLoopID();
+  BasicBlock *header = L->getHeader();
   BasicBlock *latchBB =
-      BasicBlock::Create(L->getHeader()->getContext(),
-                         Twine(L->getHeader()->getName().str() + "_latch"),
-                         L->getHeader()->getParent(), L->getHeader());
-  std::vector<BasicBlock *> oldLat;
-
-  // if there is more than one BB latches, getLoopLatch() returns O
-  if (oldB == 0) {
-
-    BranchInst::Create(L->getHeader(), latchBB);
-    std::vector<BasicBlock *> v = L->getBlocks();
-    BasicBlock *header = L->getHeader();
-
-    pred_iterator PI = pred_begin(L->getHeader()), E = pred_end(L->getHeader());
-    while (PI != E) {
-      if (belongs(v, *PI)) {
-        BasicBlock *bpi = dyn_cast<BasicBlock>(*PI);
-        replaceBrupdatePhi(bpi, header, latchBB);
-        oldLat.push_back(*PI);
-        updatePHInodes(L->getHeader(), *PI, latchBB);
-        PI = pred_begin(L->getHeader());
-      } else
-        ++PI;
-    }
+      BasicBlock::Create(header->getContext(),
+                         Twine(header->getName().str() + "_latch"),
+                         header->getParent(), header);
+  BranchInst *br = BranchInst::Create(header, latchBB);
+
+  std::vector<BasicBlock *> latches;
+  for (auto it = pred_begin(header), end = pred_end(header); it != end; ++it)
+    if (L->contains(*it) &&
+        std::find(latches.begin(), latches.end(), *it) == latches.end())
+      latches.push_back(*it);
+  for (auto bpi : latches) {
+    replaceBrupdatePhi(bpi, header, latchBB);
+    bpi->getTerminator()->setMetadata(LLVMContext::MD_loop, nullptr);
   }
-  // update loop info
+  if (LoopID)
+    br->setMetadata(LLVMContext::MD_loop, LoopID);
 
+  // update loop info
   L->addBasicBlockToLoop(latchBB, *LI);
 
   return latchBB;
@@ -94,17 +81,33 @@ void updatePHInodes(BasicBlock *b, BasicBlock *oldP, BasicBlock *newP) {
            x---
            |   |
           o     n
+  n must branch to o: the values o received from BB now reach o through
+  a PHI node in n, which is created the first time it is needed
  */
 void replaceBrupdatePhi(BasicBlock *&BB, BasicBlock *&o, BasicBlock *&n) {
-  // o->removePredecessor(BB, false);
   BB->getTerminator()->replaceUsesOfWith(o, n);
-  // updateDT(BB, n);
-  BasicBlock::iterator i = n->begin();
 
-  while (isa<PHINode>(i)) {
-    errs() << "TODO update PHI !! \n\n\n";
-    // how to add a new pred, if there is no entry for it in the PHI node
+  BasicBlock::iterator i = o->begin();
+  while (PHINode *phi = dyn_cast<PHINode>(i)) {
     i++;
+    int idx = phi->getBasicBlockIndex(BB);
+    if (idx < 0)
+      continue;
+
+    PHINode *phi_n = 0;
+    int nidx = phi->getBasicBlockIndex(n);
+    if (nidx >= 0)
+      phi_n = dyn_cast<PHINode>(phi->getIncomingValue(nidx));
+    if (!phi_n || phi_n->getParent() != n) {
+      phi_n = PHINode::Create(phi->getType(), 2, phi->getName() + ".latch",
+                              n->getFirstNonPHI());
+      phi->addIncoming(phi_n, n);
+    }
+    // one entry per edge from BB, which now all reach n
+    for (; idx >= 0; idx = phi->getBasicBlockIndex(BB)) {
+      phi_n->addIncoming(phi->getIncomingValue(idx), BB);
+      phi->removeIncomingValue(idx, false);
+    }
   }
 }
 
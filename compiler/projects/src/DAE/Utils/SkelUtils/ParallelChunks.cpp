@@ -0,0 +1,540 @@
+//===- ParallelChunks.cpp - Chunks of independent iterations in parallel --===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file ParallelChunks.cpp
+///
+/// \brief Chunks of independent iterations in parallel
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// A marked loop L whose iterations are independent is run by the
+// work-stealing pool of libDAE_parallel rather than in place:
+//
+//   dae_parallel_for(n, grain, <F>.dae_task, &args);
+//
+// where n is the trip count of L, and the task
+//
+//   void <F>.dae_task(i8 *args, i64 lo, i64 hi, i32 worker)
+//
+// runs the iterations [lo, hi) of L. The blocks of L move to the task,
+// whose loop is then chunked like any marked loop: each chunk of a task
+// still runs as an access and an execute phase, on the worker's thread.
+//
+// The iterations of L are independent when:
+//  - its trip count is computable before L, it only exits from its header,
+//    and its header writes no memory (the header runs once more per task);
+//  - its header PHIs are affine induction variables, which the task starts
+//    at iteration lo, or reductions;
+//  - nothing but its reductions is used after L;
+//  - no loop-carried dependence links its loads and stores, and it has no
+//    call or atomic operation that writes memory or may throw.
+//
+// A reduction p = phi [start, preheader], [p op x, latch], with op an
+// integer add, mul, and, or, xor, or a floating-point fadd or fmul that may
+// be reassociated, is only used by its update in L. Each task starts it at
+// the identity of op and folds its value into the slot of its worker (one
+// cache line each); the slots are folded into start once all the tasks
+// have run.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ParallelChunks_
+#define ParallelChunks_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "Util/Analysis/LoopCarriedDependencyAnalysis.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "ChunkFootprint.cpp"
+#include "Utils.cpp"
+
+using namespace llvm;
+using namespace std;
+using namespace util;
+
+/* the largest pool of libDAE_parallel, see parallel.h */
+#define DAE_MAX_WORKERS 64
+
+struct ParallelReduction {
+  PHINode *Phi;
+  Instruction::BinaryOps Op;
+};
+
+struct ParallelChunks {
+  BasicBlock *Exit;  // the exit of L
+  Value *Iterations; // the trip count of L, computed before L
+  std::vector<std::pair<PHINode *, Value *>> IVs; // IVs and steps, ditto
+  std::vector<ParallelReduction> Reductions;
+};
+
+bool analyzeParallelChunks(Loop *L, ScalarEvolution *SE,
+                           DependenceAnalysis *DA, ParallelChunks &P,
+                           std::string &Why);
+LCDResult parallelLCD(Loop *L, DependenceAnalysis *DA);
+Function *outlineParallelChunks(Loop *L, ParallelChunks &P, unsigned grain,
+                               LoopInfo *LI);
+
+static bool isParallelReduction(PHINode *Phi, Loop *L, ParallelReduction &R) {
+  BasicBlock *Latch = L->getLoopLatch();
+  if (Phi->getNumIncomingValues() != 2 || Phi->getBasicBlockIndex(Latch) < 0)
+    return false;
+  BinaryOperator *Upd =
+      dyn_cast<BinaryOperator>(Phi->getIncomingValueForBlock(Latch));
+  if (!Upd || !L->contains(Upd) || !Upd->hasOneUse() ||
+      Upd->getOperand(0) == Upd->getOperand(1) ||
+      (Upd->getOperand(0) != Phi && Upd->getOperand(1) != Phi))
+    return false;
+  for (User *U : Phi->users())
+    if (U != Upd && L->contains(cast<Instruction>(U)))
+      return false;
+
+  switch (Upd->getOpcode()) {
+  case Instruction::Add:
+  case Instruction::Mul:
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+    break;
+  case Instruction::FAdd:
+  case Instruction::FMul:
+    if (!Upd->hasUnsafeAlgebra())
+      return false;
+    break;
+  default:
+    return false;
+  }
+  R.Phi = Phi;
+  R.Op = Upd->getOpcode();
+  return true;
+}
+
+static Constant *reductionIdentity(Instruction::BinaryOps Op, Type *Ty) {
+  switch (Op) {
+  case Instruction::Mul:
+    return ConstantInt::get(Ty, 1);
+  case Instruction::And:
+    return Constant::getAllOnesValue(Ty);
+  case Instruction::FAdd:
+    return ConstantFP::getNegativeZero(Ty);
+  case Instruction::FMul:
+    return ConstantFP::get(Ty, 1.0);
+  default:
+    return Constant::getNullValue(Ty);
+  }
+}
+
+/* elements between the slots of two workers, so that each has its line */
+static unsigned slotStride(Type *Ty, const DataLayout &DL) {
+  uint64_t size = DL.getTypeAllocSize(Ty);
+  return size >= DAE_LINE_SIZE ? 1 : DAE_LINE_SIZE / size;
+}
+
+/* affine induction variable of L, or null */
+static const SCEVAddRecExpr *getParallelIV(PHINode *P, Loop *L,
+                                           ScalarEvolution *SE) {
+  if (!SE->isSCEVable(P->getType()))
+    return 0;
+  const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(P));
+  if (!AR || AR->getLoop() != L || !AR->isAffine())
+    return 0;
+  return AR;
+}
+
+/*
+  checks that the iterations of L are independent and collects what
+  outlineParallelChunks needs; the trip count and the steps of the IVs are
+  expanded in the preheader of L
+*/
+bool analyzeParallelChunks(Loop *L, ScalarEvolution *SE,
+                           DependenceAnalysis *DA, ParallelChunks &P,
+                           std::string &Why) {
+  BasicBlock *H = L->getHeader();
+  BasicBlock *Pre = L->getLoopPreheader();
+  BasicBlock *Latch = L->getLoopLatch();
+  BranchInst *Br = dyn_cast<BranchInst>(H->getTerminator());
+  P.Exit = L->getExitBlock();
+  if (!Pre || !P.Exit || !Latch || Latch == H || L->getExitingBlock() != H ||
+      !Br || !Br->isConditional()) {
+    Why = "unsupported loop shape";
+    return false;
+  }
+
+  const SCEV *BTC = SE->getBackedgeTakenCount(L);
+  if (isa<SCEVCouldNotCompute>(BTC)) {
+    Why = "unknown trip count";
+    return false;
+  }
+
+  std::vector<std::pair<PHINode *, const SCEV *>> Steps;
+  P.Reductions.clear();
+  for (BasicBlock::iterator I = H->begin(); isa<PHINode>(I); ++I) {
+    PHINode *Phi = cast<PHINode>(&*I);
+    if (const SCEVAddRecExpr *AR = getParallelIV(Phi, L, SE)) {
+      Steps.push_back(std::make_pair(Phi, AR->getStepRecurrence(*SE)));
+      continue;
+    }
+    ParallelReduction R;
+    if (!isParallelReduction(Phi, L, R)) {
+      Why = "loop carries " + Phi->getName().str();
+      return false;
+    }
+    P.Reductions.push_back(R);
+  }
+
+  for (Loop::block_iterator BB = L->block_begin(), BE = L->block_end();
+       BB != BE; ++BB)
+    for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E;
+         ++I) {
+      if (isa<DbgInfoIntrinsic>(I))
+        continue;
+      if (*BB == H && I->mayWriteToMemory()) {
+        Why = "the header writes memory";
+        return false;
+      }
+      LoadInst *LD = dyn_cast<LoadInst>(I);
+      StoreInst *ST = dyn_cast<StoreInst>(I);
+      if ((LD && !LD->isSimple()) || (ST && !ST->isSimple()) ||
+          (!ST && I->mayWriteToMemory()) || I->mayThrow()) {
+        Why = std::string("side effects of ") + I->getOpcodeName();
+        return false;
+      }
+
+      bool isReduction = false;
+      for (ParallelReduction &R : P.Reductions)
+        isReduction |= R.Phi == &*I;
+      for (User *U : I->users())
+        if (!isReduction && !L->contains(cast<Instruction>(U))) {
+          Why = I->getName().str() + " is used after the loop";
+          return false;
+        }
+    }
+
+  LCDResult R = parallelLCD(L, DA);
+  if (R != NoLCD) {
+    Why = getStringRep(R) + " between iterations";
+    return false;
+  }
+
+  // everything checked, expand the invariants
+  SCEVExpander Expander(*SE, H->getModule()->getDataLayout(), "parallel");
+  Instruction *PT = Pre->getTerminator();
+  IRBuilder<> Builder(PT);
+  P.Iterations = Builder.CreateZExtOrTrunc(
+      Expander.expandCodeFor(BTC, BTC->getType(), PT),
+      Type::getInt64Ty(H->getContext()), "dae_iterations");
+  P.IVs.clear();
+  for (auto &S : Steps)
+    P.IVs.push_back(std::make_pair(
+        S.first, Expander.expandCodeFor(S.second, S.second->getType(), PT)));
+  return true;
+}
+
+/* any dependence between two iterations of L, in either direction */
+LCDResult parallelLCD(Loop *L, DependenceAnalysis *DA) {
+  SmallVector<Instruction *, 16> MemInst;
+  for (Loop::block_iterator BB = L->block_begin(), BE = L->block_end();
+       BB != BE; ++BB)
+    for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E;
+         ++I)
+      if (isa<LoadInst>(I) || isa<StoreInst>(I))
+        MemInst.push_back(&*I);
+
+  unsigned Level = L->getLoopDepth();
+  LCDResult R = NoLCD;
+  for (unsigned i = 0, e = MemInst.size(); i != e; ++i)
+    for (unsigned j = i; j != e; ++j) {
+      Instruction *Src = MemInst[i], *Dst = MemInst[j];
+      if (!Src->mayWriteToMemory() && !Dst->mayWriteToMemory())
+        continue;
+      std::unique_ptr<Dependence> D = DA->depends(Src, Dst, true);
+      if (!D)
+        continue;
+      if (D->isConfused() || D->getLevels() < Level) {
+        R = LoopCarriedDependencyAnalysis::combineLCD(R, MayLCD);
+        continue;
+      }
+      unsigned Dir = D->getDirection(Level);
+      if (Dir != Dependence::DVEntry::EQ)
+        R = LoopCarriedDependencyAnalysis::combineLCD(
+            R, (Dir & Dependence::DVEntry::EQ) ? MayLCD : MustLCD);
+    }
+  return R;
+}
+
+/*
+  moves the blocks of L to a new task and replaces L by a call to the pool:
+    pre:      args = {live-ins of L, reduction slots}
+    init:     slot[w] = identity, for each worker w      (with reductions)
+    parallel: dae_parallel_for(n, grain, task, &args)
+    fold:     r = start op slot[0] op slot[1] ...       (with reductions)
+  and in the task:
+    entry:    the live-ins, the IVs at iteration lo, the reductions at the
+              identity
+    H:        i = phi [lo, entry], [i + 1, latch], also exits at hi
+    done:     slot[worker] = slot[worker] op r
+*/
+Function *outlineParallelChunks(Loop *L, ParallelChunks &P, unsigned grain,
+                               LoopInfo *LI) {
+  BasicBlock *H = L->getHeader();
+  BasicBlock *Pre = L->getLoopPreheader();
+  BasicBlock *Latch = L->getLoopLatch();
+  Function *F = H->getParent();
+  Module *M = F->getParent();
+  LLVMContext &C = M->getContext();
+  const DataLayout &DL = M->getDataLayout();
+  Type *I8Ptr = Type::getInt8PtrTy(C);
+  Type *I32 = Type::getInt32Ty(C);
+  Type *I64 = Type::getInt64Ty(C);
+
+  // the live-ins of L, with the steps of its IVs
+  SetVector<Value *> Inputs;
+  for (Loop::block_iterator BB = L->block_begin(), BE = L->block_end();
+       BB != BE; ++BB)
+    for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E;
+         ++I)
+      for (Use &U : I->operands())
+        if (isa<Argument>(U) ||
+            (isa<Instruction>(U) && !L->contains(cast<Instruction>(U))))
+          Inputs.insert(U);
+  for (auto &IV : P.IVs)
+    if (isa<Argument>(IV.second) || isa<Instruction>(IV.second))
+      Inputs.insert(IV.second);
+
+  std::vector<Type *> Fields;
+  for (Value *V : Inputs)
+    Fields.push_back(V->getType());
+  std::vector<Value *> Starts;
+  for (ParallelReduction &R : P.Reductions) {
+    Fields.push_back(PointerType::getUnqual(R.Phi->getType()));
+    Starts.push_back(R.Phi->getIncomingValueForBlock(Pre));
+  }
+  StructType *ArgsTy = StructType::get(C, Fields);
+
+  FunctionType *TaskTy = FunctionType::get(Type::getVoidTy(C),
+                                           {I8Ptr, I64, I64, I32}, false);
+  Function *Task = Function::Create(TaskTy, GlobalValue::InternalLinkage,
+                                    F->getName() + ".dae_task", M);
+  Task->addAttributes(AttributeSet::FunctionIndex,
+                      F->getAttributes().getFnAttributes());
+  Task->addFnAttr(Attribute::NoUnwind);
+  Task->addFnAttr(DAE_ATTR_TASK);
+  Function::arg_iterator A = Task->arg_begin();
+  Value *Args = &*A++;
+  Value *Lo = &*A++;
+  Value *Hi = &*A++;
+  Value *Worker = &*A;
+  Args->setName("args");
+  Lo->setName("lo");
+  Hi->setName("hi");
+  Worker->setName("worker");
+
+  // unpack the live-ins
+  BasicBlock *Entry = BasicBlock::Create(C, "entry", Task);
+  IRBuilder<> Builder(Entry);
+  Value *Packed = Builder.CreateBitCast(Args, PointerType::getUnqual(ArgsTy));
+  DenseMap<Value *, Value *> Map;
+  unsigned Field = 0;
+  for (Value *V : Inputs)
+    Map[V] = Builder.CreateLoad(
+        Builder.CreateStructGEP(ArgsTy, Packed, Field++), V->getName());
+  std::vector<Value *> Slots;
+  for (ParallelReduction &R : P.Reductions)
+    Slots.push_back(
+        Builder.CreateLoad(Builder.CreateStructGEP(ArgsTy, Packed, Field++),
+                           R.Phi->getName() + ".slots"));
+
+  // move L
+  BasicBlock *Done =
+      BasicBlock::Create(C, Twine(H->getName() + "_task_done"), Task);
+  for (Loop::block_iterator BB = L->block_begin(), BE = L->block_end();
+       BB != BE; ++BB) {
+    (*BB)->removeFromParent();
+    (*BB)->insertInto(Task, Done);
+  }
+  for (Value *V : Inputs) {
+    std::vector<Use *> Uses;
+    for (Use &U : V->uses())
+      if (Instruction *I = dyn_cast<Instruction>(U.getUser()))
+        if (I->getParent()->getParent() == Task)
+          Uses.push_back(&U);
+    for (Use *U : Uses)
+      U->set(Map[V]);
+  }
+
+  // start at iteration lo
+  for (auto &IV : P.IVs) {
+    PHINode *phi = IV.first;
+    Value *Step = Map.count(IV.second) ? Map[IV.second] : IV.second;
+    int idx = phi->getBasicBlockIndex(Pre);
+    Value *Start = phi->getIncomingValue(idx);
+    Value *Off =
+        Builder.CreateMul(Builder.CreateZExtOrTrunc(Lo, Step->getType()), Step);
+    if (phi->getType()->isPointerTy()) {
+      Type *I8P =
+          Type::getInt8PtrTy(C, phi->getType()->getPointerAddressSpace());
+      Value *Ptr = Builder.CreatePointerCast(Start, I8P);
+      Ptr = Builder.CreateGEP(Ptr, Off);
+      Start = Builder.CreatePointerCast(Ptr, phi->getType(),
+                                        phi->getName() + ".task");
+    } else {
+      Start = Builder.CreateAdd(Start, Off, phi->getName() + ".task");
+    }
+    phi->setIncomingValue(idx, Start);
+    phi->setIncomingBlock(idx, Entry);
+  }
+  for (ParallelReduction &R : P.Reductions) {
+    int idx = R.Phi->getBasicBlockIndex(Pre);
+    R.Phi->setIncomingValue(idx, reductionIdentity(R.Op, R.Phi->getType()));
+    R.Phi->setIncomingBlock(idx, Entry);
+  }
+  Builder.CreateBr(H);
+
+  // stop at iteration hi
+  PHINode *TaskI = PHINode::Create(I64, 2, "dae_task_i", &H->front());
+  TaskI->addIncoming(Lo, Entry);
+  TaskI->addIncoming(BinaryOperator::CreateAdd(TaskI, ConstantInt::get(I64, 1),
+                                               "dae_task_i_inc",
+                                               Latch->getTerminator()),
+                     Latch);
+  BranchInst *Br = cast<BranchInst>(H->getTerminator());
+  Builder.SetInsertPoint(Br);
+  if (L->contains(Br->getSuccessor(0)))
+    Br->setCondition(Builder.CreateAnd(
+        Br->getCondition(), Builder.CreateICmpULT(TaskI, Hi, "dae_task_cmp")));
+  else
+    Br->setCondition(Builder.CreateOr(
+        Br->getCondition(), Builder.CreateICmpUGE(TaskI, Hi, "dae_task_cmp")));
+  Br->replaceUsesOfWith(P.Exit, Done);
+
+  // fold the task's reductions into the slots of its worker
+  Builder.SetInsertPoint(Done);
+  for (unsigned r = 0, e = P.Reductions.size(); r != e; ++r) {
+    ParallelReduction &R = P.Reductions[r];
+    Value *Idx = Builder.CreateMul(
+        Builder.CreateZExt(Worker, I64),
+        ConstantInt::get(I64, slotStride(R.Phi->getType(), DL)));
+    Value *Slot = Builder.CreateGEP(Slots[r], Idx);
+    Builder.CreateStore(
+        Builder.CreateBinOp(R.Op, Builder.CreateLoad(Slot), R.Phi), Slot);
+  }
+  Builder.CreateRetVoid();
+
+  // in F, the pool runs the tasks in place of L
+  BasicBlock *Run = BasicBlock::Create(
+      C, Twine(H->getName() + "_parallel"), F, P.Exit);
+  Pre->getTerminator()->replaceUsesOfWith(H, Run);
+  std::vector<BasicBlock *> NewBlocks(1, Run);
+  IRBuilder<> Alloca(&*F->getEntryBlock().getFirstInsertionPt());
+  Value *Buf = Alloca.CreateAlloca(ArgsTy, nullptr, "dae_task.args");
+  Builder.SetInsertPoint(Run);
+  Field = 0;
+  for (Value *V : Inputs)
+    Builder.CreateStore(V, Builder.CreateStructGEP(ArgsTy, Buf, Field++));
+
+  std::vector<Value *> Firsts;
+  for (ParallelReduction &R : P.Reductions) {
+    Type *Ty = R.Phi->getType();
+    Value *Arr = Alloca.CreateAlloca(
+        ArrayType::get(Ty, DAE_MAX_WORKERS * slotStride(Ty, DL)), nullptr,
+        R.Phi->getName() + ".slots");
+    Firsts.push_back(Builder.CreateBitCast(Arr, PointerType::getUnqual(Ty)));
+    Builder.CreateStore(Firsts.back(),
+                        Builder.CreateStructGEP(ArgsTy, Buf, Field++));
+  }
+
+  std::vector<Value *> Results;
+  if (!P.Reductions.empty()) {
+    BasicBlock *Init = BasicBlock::Create(C, "dae_slots_init", F, P.Exit);
+    BasicBlock *Call = BasicBlock::Create(C, "dae_parallel_call", F, P.Exit);
+    BasicBlock *Fold = BasicBlock::Create(C, "dae_slots_fold", F, P.Exit);
+    NewBlocks.push_back(Init);
+    NewBlocks.push_back(Call);
+    NewBlocks.push_back(Fold);
+    Builder.CreateBr(Init);
+
+    Builder.SetInsertPoint(Init);
+    PHINode *W = Builder.CreatePHI(I64, 2, "dae_worker");
+    W->addIncoming(ConstantInt::get(I64, 0), Run);
+    for (unsigned r = 0, e = P.Reductions.size(); r != e; ++r) {
+      ParallelReduction &R = P.Reductions[r];
+      Type *Ty = R.Phi->getType();
+      Value *Idx =
+          Builder.CreateMul(W, ConstantInt::get(I64, slotStride(Ty, DL)));
+      Builder.CreateStore(reductionIdentity(R.Op, Ty),
+                          Builder.CreateGEP(Firsts[r], Idx));
+    }
+    Value *Next = Builder.CreateAdd(W, ConstantInt::get(I64, 1));
+    W->addIncoming(Next, Init);
+    Builder.CreateCondBr(
+        Builder.CreateICmpULT(Next, ConstantInt::get(I64, DAE_MAX_WORKERS)),
+        Init, Call);
+    Builder.SetInsertPoint(Call);
+  }
+
+  FunctionType *ForTy = FunctionType::get(
+      Type::getVoidTy(C), {I64, I64, PointerType::getUnqual(TaskTy), I8Ptr},
+      false);
+  Constant *For = M->getOrInsertFunction("dae_parallel_for", ForTy);
+  Builder.CreateCall(For, {P.Iterations, ConstantInt::get(I64, grain), Task,
+                           Builder.CreateBitCast(Buf, I8Ptr)});
+  BasicBlock *Last = Builder.GetInsertBlock();
+
+  if (!P.Reductions.empty()) {
+    BasicBlock *Fold = NewBlocks.back();
+    Builder.CreateBr(Fold);
+    Builder.SetInsertPoint(Fold);
+    PHINode *W = Builder.CreatePHI(I64, 2, "dae_worker");
+    W->addIncoming(ConstantInt::get(I64, 0), Last);
+    for (unsigned r = 0, e = P.Reductions.size(); r != e; ++r) {
+      ParallelReduction &R = P.Reductions[r];
+      Type *Ty = R.Phi->getType();
+      PHINode *Acc = Builder.CreatePHI(Ty, 2, R.Phi->getName() + ".fold");
+      Acc->addIncoming(Starts[r], Last);
+      Value *Idx =
+          Builder.CreateMul(W, ConstantInt::get(I64, slotStride(Ty, DL)));
+      Value *V = Builder.CreateBinOp(
+          R.Op, Acc, Builder.CreateLoad(Builder.CreateGEP(Firsts[r], Idx)),
+          R.Phi->getName() + ".result");
+      Acc->addIncoming(V, Fold);
+      Results.push_back(V);
+    }
+    Value *Next = Builder.CreateAdd(W, ConstantInt::get(I64, 1));
+    W->addIncoming(Next, Fold);
+    Builder.CreateCondBr(
+        Builder.CreateICmpULT(Next, ConstantInt::get(I64, DAE_MAX_WORKERS)),
+        Fold, P.Exit);
+    Last = Fold;
+  } else {
+    Builder.CreateBr(P.Exit);
+  }
+
+  // after L, the reductions are the folded values
+  for (unsigned r = 0, e = P.Reductions.size(); r != e; ++r) {
+    std::vector<Use *> Uses;
+    for (Use &U : P.Reductions[r].Phi->uses())
+      if (cast<Instruction>(U.getUser())->getParent()->getParent() == F)
+        Uses.push_back(&U);
+    for (Use *U : Uses)
+      U->set(Results[r]);
+  }
+  for (BasicBlock::iterator I = P.Exit->begin(); isa<PHINode>(I); ++I) {
+    PHINode *phi = cast<PHINode>(&*I);
+    phi->setIncomingBlock(phi->getBasicBlockIndex(H), Last);
+  }
+
+  // update loop info
+  if (Loop *Lp = L->getParentLoop())
+    for (BasicBlock *BB : NewBlocks)
+      Lp->addBasicBlockToLoop(BB, *LI);
+  return Task;
+}
+
+#endif
@@ -0,0 +1,504 @@
+//===- PrefetchIdioms.cpp - Access code for sparse and hash idioms --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file PrefetchIdioms.cpp
+///
+/// \brief Access code for sparse and hash idioms
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// This file recognises inner loops of an access phase whose structure allows
+// cheaper access code than the generic slice:
+//
+//  - Range: a unit-step counted loop over invariant bounds, as the row loop
+//    of a CSR kernel (for j in row_ptr[i]..row_ptr[i+1]). Its unit-stride
+//    loads (col[j], val[j]) are replaced by one prefetch per cache line of
+//    the whole range, issued before the loop. Gathers through them
+//    (x[col[j]]) are left to the generic slice.
+//
+//  - Chase: a loop walking a chain of pointers (p = p->next), as the bucket
+//    walk of a hash probe (tab[hash(k)] is prefetched by the generic slice).
+//    When the chain ends with a null pointer, the access phase walks it
+//    instead of the loop: a bare walk of at most MaxLines nodes, which
+//    prefetches the fields of each node that the loop loads. Otherwise it
+//    only prefetches the head, and leaves the loop to the generic slice.
+//    Walks are not batched across the keys of a chunk here; the interleaved
+//    targets (Interleave.cpp) do that.
+//
+// A loop that no longer needs to run in the access phase is bypassed.
+//
+//===----------------------------------------------------------------------===//
+#ifndef PrefetchIdioms_
+#define PrefetchIdioms_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+using namespace llvm;
+using namespace std;
+
+struct PrefetchIdiom {
+  enum IdiomKind { Range, Chase };
+
+  IdiomKind Kind;
+  Loop *L;
+  BasicBlock *Preheader;
+
+  // Range: the induction variable runs over [Lo, Hi)
+  Value *Lo, *Hi;
+  SmallVector<GetElementPtrInst *, 4> Streams; // one unit-stride GEP per base
+
+  // Chase: first node of the chain, current node and load of the next one
+  Value *Head;
+  PHINode *Node;
+  LoadInst *Next;
+  // Chase: the loads of the walk, which are access code of their own
+  SmallVector<LoadInst *, 1> Walk;
+
+  // Loads whose prefetches the idiom code replaces
+  SmallVector<LoadInst *, 8> Covered;
+  // Range: the loop has no loads besides the streams
+  bool OnlyStreams;
+};
+
+void findPrefetchIdioms(LoopInfo &LI, std::vector<PrefetchIdiom> &Idioms);
+bool applyPrefetchIdiom(PrefetchIdiom &I, set<Instruction *> &Keep,
+                        unsigned LineSize, unsigned MaxLines);
+
+/* true if V is IV, possibly extended to index a GEP */
+static bool isIndexOf(Value *V, PHINode *IV) {
+  if (V == IV)
+    return true;
+  if (isa<SExtInst>(V) || isa<ZExtInst>(V))
+    return cast<CastInst>(V)->getOperand(0) == IV;
+  return false;
+}
+
+/* the unit-step integer induction variable of L, with its bounds */
+static PHINode *findUnitIV(Loop *L, Value *&Lo, Value *&Hi) {
+  BasicBlock *H = L->getHeader();
+  BasicBlock *P = L->getLoopPreheader();
+  BasicBlock *Latch = L->getLoopLatch();
+  BasicBlock *Exiting = L->getExitingBlock();
+  if (!P || !Latch || !Exiting)
+    return nullptr;
+
+  BranchInst *Br = dyn_cast<BranchInst>(Exiting->getTerminator());
+  if (!Br || !Br->isConditional())
+    return nullptr;
+  ICmpInst *Cmp = dyn_cast<ICmpInst>(Br->getCondition());
+  if (!Cmp)
+    return nullptr;
+
+  for (BasicBlock::iterator I = H->begin(); isa<PHINode>(I); ++I) {
+    PHINode *Phi = cast<PHINode>(I);
+    if (!Phi->getType()->isIntegerTy() || Phi->getNumIncomingValues() != 2)
+      continue;
+
+    BinaryOperator *Next =
+        dyn_cast<BinaryOperator>(Phi->getIncomingValueForBlock(Latch));
+    if (!Next || Next->getOpcode() != Instruction::Add)
+      continue;
+    Value *Step = Next->getOperand(0) == Phi ? Next->getOperand(1)
+                                             : Next->getOperand(0);
+    ConstantInt *One = dyn_cast<ConstantInt>(Step);
+    if (!One || !One->isOne() ||
+        (Next->getOperand(0) != Phi && Next->getOperand(1) != Phi))
+      continue;
+
+    // Accept "iv < hi" or "iv != hi" (on iv or iv + 1) keeping the loop
+    // running, so that the loop covers [lo, hi).
+    Value *Op0 = Cmp->getOperand(0), *Op1 = Cmp->getOperand(1);
+    ICmpInst::Predicate Pred = Cmp->getPredicate();
+    if (Op1 == Phi || Op1 == Next) {
+      std::swap(Op0, Op1);
+      Pred = Cmp->getSwappedPredicate();
+    }
+    if ((Op0 != Phi && Op0 != Next) || !L->isLoopInvariant(Op1))
+      continue;
+
+    bool StaysWhenTrue = L->contains(Br->getSuccessor(0));
+    if (!StaysWhenTrue)
+      Pred = CmpInst::getInversePredicate(Pred);
+    if (Pred != ICmpInst::ICMP_SLT && Pred != ICmpInst::ICMP_ULT &&
+        Pred != ICmpInst::ICMP_NE)
+      continue;
+
+    Lo = Phi->getIncomingValueForBlock(P);
+    Hi = Op1;
+    return Phi;
+  }
+  return nullptr;
+}
+
+/* true if V is derived from the pointer P by casts and GEPs */
+static bool isDerivedFrom(Value *V, Value *P) {
+  while (true) {
+    if (V == P)
+      return true;
+    if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(V))
+      V = GEP->getPointerOperand();
+    else if (BitCastInst *BC = dyn_cast<BitCastInst>(V))
+      V = BC->getOperand(0);
+    else
+      return false;
+  }
+}
+
+static bool findRangeIdiom(Loop *L, PrefetchIdiom &I) {
+  PHINode *IV = findUnitIV(L, I.Lo, I.Hi);
+  if (!IV)
+    return false;
+  I.OnlyStreams = true;
+
+  for (auto BI = L->block_begin(), BE = L->block_end(); BI != BE; ++BI) {
+    for (BasicBlock::iterator II = (*BI)->begin(), IE = (*BI)->end();
+         II != IE; ++II) {
+      LoadInst *LInst = dyn_cast<LoadInst>(II);
+      if (!LInst)
+        continue;
+      GetElementPtrInst *GEP =
+          dyn_cast<GetElementPtrInst>(LInst->getPointerOperand());
+      if (!GEP || GEP->getNumIndices() != 1 ||
+          !L->isLoopInvariant(GEP->getPointerOperand()) ||
+          !isIndexOf(GEP->getOperand(1), IV)) {
+        I.OnlyStreams = false;
+        continue;
+      }
+
+      I.Covered.push_back(LInst);
+      bool NewBase = true;
+      for (auto S : I.Streams)
+        if (S->getPointerOperand() == GEP->getPointerOperand() &&
+            S->getType() == GEP->getType())
+          NewBase = false;
+      if (NewBase)
+        I.Streams.push_back(GEP);
+    }
+  }
+
+  I.Kind = PrefetchIdiom::Range;
+  return !I.Streams.empty();
+}
+
+static bool findChaseIdiom(Loop *L, PrefetchIdiom &I) {
+  BasicBlock *P = L->getLoopPreheader();
+  BasicBlock *Latch = L->getLoopLatch();
+  if (!P || !Latch)
+    return false;
+
+  for (BasicBlock::iterator II = L->getHeader()->begin(); isa<PHINode>(II);
+       ++II) {
+    PHINode *Phi = cast<PHINode>(II);
+    if (!Phi->getType()->isPointerTy() || Phi->getNumIncomingValues() != 2)
+      continue;
+
+    // p = phi [head, preheader], [load(p->next), latch]
+    LoadInst *Next = dyn_cast<LoadInst>(Phi->getIncomingValueForBlock(Latch));
+    if (!Next || !isDerivedFrom(Next->getPointerOperand(), Phi))
+      continue;
+
+    I.Kind = PrefetchIdiom::Chase;
+    I.Head = Phi->getIncomingValueForBlock(P);
+    I.Node = Phi;
+    I.Next = Next;
+    for (auto BI = L->block_begin(), BE = L->block_end(); BI != BE; ++BI)
+      for (BasicBlock::iterator LI = (*BI)->begin(), LE = (*BI)->end();
+           LI != LE; ++LI)
+        if (LoadInst *LInst = dyn_cast<LoadInst>(LI))
+          if (isDerivedFrom(LInst->getPointerOperand(), Phi))
+            I.Covered.push_back(LInst);
+    return true;
+  }
+  return false;
+}
+
+/* inner loops of the access phase, outermost loop being the chunk */
+void findPrefetchIdioms(LoopInfo &LI, std::vector<PrefetchIdiom> &Idioms) {
+  std::vector<Loop *> Work(LI.begin(), LI.end());
+  while (!Work.empty()) {
+    Loop *L = Work.back();
+    Work.pop_back();
+    Work.insert(Work.end(), L->getSubLoops().begin(), L->getSubLoops().end());
+    if (L->getLoopDepth() < 2 || !L->getSubLoops().empty())
+      continue;
+
+    PrefetchIdiom I;
+    I.L = L;
+    I.Preheader = L->getLoopPreheader();
+    I.Lo = I.Hi = I.Head = nullptr;
+    I.Node = nullptr;
+    I.Next = nullptr;
+    I.OnlyStreams = false;
+    if (findChaseIdiom(L, I) || findRangeIdiom(L, I))
+      Idioms.push_back(I);
+  }
+}
+
+static CallInst *createPrefetch(IRBuilder<> &Builder, Value *Ptr) {
+  Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+  Type *I32 = Builder.getInt32Ty();
+  Value *PrefFun = Intrinsic::getDeclaration(M, Intrinsic::prefetch);
+  return Builder.CreateCall(
+      PrefFun, {Ptr, ConstantInt::get(I32, 0),                        // read
+                ConstantInt::get(I32, 3), ConstantInt::get(I32, 1)}); // data
+}
+
+/*
+  a loop can be skipped by the access phase if nothing after it depends on
+  it: a single exit block without PHI nodes, no value used outside the loop
+  and no stores
+*/
+static bool canBypass(Loop *L) {
+  BasicBlock *Exit = L->getUniqueExitBlock();
+  if (!Exit || isa<PHINode>(Exit->begin()))
+    return false;
+
+  for (auto BI = L->block_begin(), BE = L->block_end(); BI != BE; ++BI)
+    for (BasicBlock::iterator I = (*BI)->begin(), E = (*BI)->end(); I != E;
+         ++I) {
+      if (isa<StoreInst>(I) || (isa<CallInst>(I) && !isa<IntrinsicInst>(I)))
+        return false;
+      for (User *U : I->users())
+        if (!L->contains(cast<Instruction>(U)->getParent()))
+          return false;
+    }
+  return true;
+}
+
+/* true if L leaves when its node, or the next one, is null: the chain ends
+   with a null pointer, so that a walk of it stops there */
+static bool isNullEnded(Loop *L, PHINode *Node, LoadInst *Next) {
+  SmallVector<BasicBlock *, 4> Exiting;
+  L->getExitingBlocks(Exiting);
+  for (auto BB : Exiting) {
+    BranchInst *Br = dyn_cast<BranchInst>(BB->getTerminator());
+    ICmpInst *Cmp = Br && Br->isConditional()
+                        ? dyn_cast<ICmpInst>(Br->getCondition())
+                        : nullptr;
+    if (!Cmp || !Cmp->isEquality())
+      continue;
+    for (unsigned o = 0; o != 2; ++o)
+      if (isa<ConstantPointerNull>(Cmp->getOperand(o)) &&
+          (Cmp->getOperand(1 - o) == Node || Cmp->getOperand(1 - o) == Next))
+        return true;
+  }
+  return false;
+}
+
+/* true if V, derived from Node (see isDerivedFrom), only adds offsets known
+   before L to it */
+static bool isNodeOffset(Value *V, PHINode *Node, Loop *L) {
+  for (; V != Node; V = cast<Instruction>(V)->getOperand(0)) {
+    Instruction *I = cast<Instruction>(V);
+    for (unsigned o = 1, e = I->getNumOperands(); o != e; ++o) {
+      Instruction *Op = dyn_cast<Instruction>(I->getOperand(o));
+      if (Op && L->contains(Op))
+        return false;
+    }
+  }
+  return true;
+}
+
+/* a copy of V, an offset of Node (see isNodeOffset), from Walk instead */
+static Value *cloneNodeOffset(IRBuilder<> &Builder, Value *V, PHINode *Node,
+                              Value *Walk) {
+  if (V == Node)
+    return Walk;
+  Instruction *I = cast<Instruction>(V);
+  Value *Base = cloneNodeOffset(Builder, I->getOperand(0), Node, Walk);
+  Instruction *Copy = I->clone();
+  Copy->setOperand(0, Base);
+  return Builder.Insert(Copy);
+}
+
+/*
+  walks the chain of a chase idiom in front of its loop, prefetching the
+  fields of each node that the loop loads:
+    chase_cond: node = phi [head, P], [next, chase_body]; n = phi ...
+                node && n < MaxNodes ? chase_body : loop
+    chase_body: prefetch the fields of node; next = node->next
+  Returns false, and changes nothing, if a field is not at an offset known
+  before the loop.
+*/
+static bool insertChaseWalk(PrefetchIdiom &I, set<Instruction *> &Keep,
+                            unsigned MaxNodes) {
+  BasicBlock *P = I.Preheader;
+  BasicBlock *H = I.L->getHeader();
+  LLVMContext &C = H->getContext();
+  Function *F = H->getParent();
+  if (!isNodeOffset(I.Next->getPointerOperand(), I.Node, I.L))
+    return false;
+  for (auto LInst : I.Covered)
+    if (!isNodeOffset(LInst->getPointerOperand(), I.Node, I.L))
+      return false;
+
+  BasicBlock *Cont = SplitBlock(P, P->getTerminator());
+  BasicBlock *Cond =
+      BasicBlock::Create(C, H->getName() + "_chase_cond", F, Cont);
+  BasicBlock *Body =
+      BasicBlock::Create(C, H->getName() + "_chase_body", F, Cont);
+  P->getTerminator()->setSuccessor(0, Cond);
+
+  IRBuilder<> Builder(Cond);
+  PHINode *Walk = Builder.CreatePHI(I.Head->getType(), 2, "chase_node");
+  PHINode *N = Builder.CreatePHI(Builder.getInt32Ty(), 2, "chase_n");
+  Value *More = Builder.CreateAnd(
+      Builder.CreateICmpNE(Walk, Constant::getNullValue(Walk->getType())),
+      Builder.CreateICmpULT(N, Builder.getInt32(MaxNodes)));
+  Builder.CreateCondBr(More, Body, Cont);
+
+  Builder.SetInsertPoint(Body);
+  set<Value *> Fields;
+  for (auto LInst : I.Covered) {
+    if (!Fields.insert(LInst->getPointerOperand()).second)
+      continue;
+    Value *Addr = cloneNodeOffset(Builder, LInst->getPointerOperand(), I.Node,
+                                  Walk);
+    createPrefetch(Builder, Builder.CreatePointerCast(
+                                Addr, Builder.getInt8PtrTy(
+                                          Addr->getType()
+                                              ->getPointerAddressSpace())));
+  }
+  LoadInst *Next = Builder.CreateLoad(
+      cloneNodeOffset(Builder, I.Next->getPointerOperand(), I.Node, Walk),
+      "chase_next");
+  I.Walk.push_back(Next);
+  Value *Inc = Builder.CreateAdd(N, Builder.getInt32(1));
+  Builder.CreateBr(Cond);
+
+  Walk->addIncoming(I.Head, P);
+  Walk->addIncoming(Next, Body);
+  N->addIncoming(Builder.getInt32(0), P);
+  N->addIncoming(Inc, Body);
+  for (auto BB : {Cond, Body})
+    for (BasicBlock::iterator II = BB->begin(), IE = BB->end(); II != IE; ++II)
+      Keep.insert(&*II);
+  I.Preheader = Cont;
+  return true;
+}
+
+/* computes begin and end of one stream of a range idiom in the preheader */
+static void rangeBounds(IRBuilder<> &Builder, PrefetchIdiom &I,
+                        GetElementPtrInst *GEP, Value *&Begin, Value *&End) {
+  Value *Idx = GEP->getOperand(1);
+  Value *Lo = I.Lo, *Hi = I.Hi;
+  if (isa<SExtInst>(Idx)) {
+    Lo = Builder.CreateSExt(Lo, Idx->getType());
+    Hi = Builder.CreateSExt(Hi, Idx->getType());
+  } else if (isa<ZExtInst>(Idx)) {
+    Lo = Builder.CreateZExt(Lo, Idx->getType());
+    Hi = Builder.CreateZExt(Hi, Idx->getType());
+  }
+  Type *I8Ptr = Builder.getInt8PtrTy(GEP->getPointerAddressSpace());
+  Begin = Builder.CreatePointerCast(
+      Builder.CreateGEP(GEP->getPointerOperand(), Lo), I8Ptr, "range_begin");
+  End = Builder.CreatePointerCast(
+      Builder.CreateGEP(GEP->getPointerOperand(), Hi), I8Ptr, "range_end");
+}
+
+/*
+  inserts the idiom's access code in front of its loop, and bypasses the loop
+  if its remaining work is covered. Every inserted instruction is added to
+  Keep. A chase that is not walked covers no load: Covered is emptied, and
+  its loads are left to the generic slice. Returns true if the loop was
+  bypassed.
+*/
+bool applyPrefetchIdiom(PrefetchIdiom &I, set<Instruction *> &Keep,
+                        unsigned LineSize, unsigned MaxLines) {
+  BasicBlock *P = I.Preheader;
+  BasicBlock *H = I.L->getHeader();
+  LLVMContext &C = H->getContext();
+  Function *F = H->getParent();
+
+  // Remember what lies outside before the CFG changes.
+  bool Bypass = canBypass(I.L);
+  BasicBlock *Exit = I.L->getUniqueExitBlock();
+
+  if (I.Kind == PrefetchIdiom::Chase) {
+    // the walk replaces the loop, up to its null end
+    Bypass = Bypass && isNullEnded(I.L, I.Node, I.Next) &&
+             insertChaseWalk(I, Keep, MaxLines);
+    if (!Bypass) {
+      IRBuilder<> Builder(P->getTerminator());
+      Value *Ptr = Builder.CreatePointerCast(
+          I.Head,
+          Builder.getInt8PtrTy(
+              cast<PointerType>(I.Head->getType())->getAddressSpace()));
+      Instruction *Pref = createPrefetch(Builder, Ptr);
+      Keep.insert(Pref);
+      if (Instruction *Cast = dyn_cast<Instruction>(Ptr))
+        Keep.insert(Cast);
+      I.Covered.clear();
+    }
+  } else {
+    // P: bounds, then per stream
+    // range_cond: p < end ? range_body : next; range_body: prefetch p
+    set<Instruction *> Original;
+    for (BasicBlock::iterator II = P->begin(), IE = P->end(); II != IE; ++II)
+      Original.insert(&*II);
+    BasicBlock *Cont = SplitBlock(P, P->getTerminator());
+    BasicBlock *Pred = P;
+    for (auto GEP : I.Streams) {
+      IRBuilder<> Builder(P->getTerminator());
+      Value *Begin, *End;
+      rangeBounds(Builder, I, GEP, Begin, End);
+      Value *Cap =
+          Builder.CreateGEP(Begin, Builder.getInt64(LineSize * MaxLines));
+      Value *Short = Builder.CreateICmpULT(End, Cap);
+      End = Builder.CreateSelect(Short, End, Cap, "range_end_cap");
+
+      BasicBlock *Cond =
+          BasicBlock::Create(C, H->getName() + "_range_cond", F, Cont);
+      BasicBlock *Body =
+          BasicBlock::Create(C, H->getName() + "_range_body", F, Cont);
+      TerminatorInst *T = Pred->getTerminator();
+      for (unsigned s = 0, e = T->getNumSuccessors(); s != e; ++s)
+        if (T->getSuccessor(s) == Cont)
+          T->setSuccessor(s, Cond);
+
+      Builder.SetInsertPoint(Cond);
+      PHINode *Ptr = Builder.CreatePHI(Begin->getType(), 2, "range_ptr");
+      Value *More = Builder.CreateICmpULT(Ptr, End);
+      Builder.CreateCondBr(More, Body, Cont);
+
+      Builder.SetInsertPoint(Body);
+      createPrefetch(Builder, Ptr);
+      Value *Next = Builder.CreateGEP(Ptr, Builder.getInt64(LineSize));
+      Builder.CreateBr(Cond);
+
+      Ptr->addIncoming(Begin, Pred);
+      Ptr->addIncoming(Next, Body);
+      Pred = Cond;
+
+      for (auto BB : {Cond, Body})
+        for (BasicBlock::iterator II = BB->begin(), IE = BB->end(); II != IE;
+             ++II)
+          Keep.insert(&*II);
+    }
+    // the bounds and the new branch out of P
+    for (BasicBlock::iterator II = P->begin(), IE = P->end(); II != IE; ++II)
+      if (!Original.count(&*II))
+        Keep.insert(&*II);
+    I.Preheader = Cont;
+    Bypass = Bypass && I.OnlyStreams;
+  }
+
+  if (Bypass) {
+    TerminatorInst *T = I.Preheader->getTerminator();
+    for (unsigned s = 0, e = T->getNumSuccessors(); s != e; ++s)
+      if (T->getSuccessor(s) == H) {
+        H->removePredecessor(I.Preheader);
+        T->setSuccessor(s, Exit);
+      }
+  }
+  return Bypass;
+}
+
+#endif
@@ -0,0 +1,437 @@
+//===- ReorderChunks.cpp - Iterations of a chunk in locality order --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file ReorderChunks.cpp
+///
+/// \brief Iterations of a chunk in locality order
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// An inspector-executor schedule for the chunk loops whose iterations are
+// independent. The access phase, which walks the chunk anyway, inspects it:
+// iteration k stores the line (or page) of its deepest prefetch, the one
+// with the most loads in its slice, in the thread-local buffer of the
+// kernel, <kernel>_inspect (see inspect.h in libDAE_inspect):
+//
+//   keys[min(k, MAX - 1)] = address >> shift;  n = min(k, MAX - 1) + 1
+//
+// and once the chunk is walked, dae_inspect_order sorts [0, n) by key into
+// order. The execute phase then runs iteration order[k] in place of
+// iteration k, for k < n:
+//
+//   header: PHIs; the chunk bound      (iteration k)
+//   enter:  the exit of the loop        (iteration k)
+//   body:   j = k < n ? order[k] : k;   x_j = x + (j - k) * step
+//           the rest of the iteration  (iteration j)
+//
+// Only the body runs iteration j: the header and the exit test, and the
+// updates of the induction variables, keep iteration k, so that the chunk
+// runs as many iterations as before and leaves the loop with the same
+// values. The values of the exit test that the body uses are recomputed
+// for iteration j.
+//
+// The iterations of a chunk loop are reordered when:
+//  - the loop only exits from its header (the chunk bound) and from the
+//    block that follows (the exit of the original loop), which writes no
+//    memory;
+//  - its header PHIs are affine induction variables, or reductions (which
+//    accumulate in the new order);
+//  - no loop-carried dependence links its loads and stores, and it has no
+//    call that writes memory or may throw (see ParallelChunks.cpp);
+//  - a prefetch of the access phase runs in every iteration.
+//
+// Both phases of a chunk must run one after the other on the same thread.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ReorderChunks_
+#define ReorderChunks_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "ParallelChunks.cpp"
+
+using namespace llvm;
+using namespace std;
+
+/* the iterations of a chunk that are reordered, see inspect.h */
+#define DAE_INSPECT_MAX 4096
+
+/// Fields of the buffer <kernel>_inspect, { i32 n, [DAE_INSPECT_MAX x i32]
+/// order, [DAE_INSPECT_MAX x i64] keys }.
+#define DAE_INSPECT_N 0
+#define DAE_INSPECT_ORDER 1
+#define DAE_INSPECT_KEYS 2
+
+struct ReorderedLoop {
+  Loop *C;
+  PHINode *VI;
+  BasicBlock *Enter; // the exit test of an iteration
+  BasicBlock *Body;  // the rest of the iteration, entered from Enter only
+  std::vector<std::pair<PHINode *, Value *>> IVs; // IVs and steps
+  SetVector<Instruction *> Remat; // recomputed for iteration j, in order
+  set<Instruction *> Updates;     // the updates of the IVs
+};
+
+bool analyzeReorder(Loop *C, PHINode *VI, ScalarEvolution &SE,
+                    DependenceAnalysis *DA, ReorderedLoop &R,
+                    std::string &Why);
+IntrinsicInst *findInspectedPrefetch(Loop *C, DominatorTree &DT,
+                                     LoopInfo &LI, unsigned &Loads);
+GlobalVariable *inspectBuffer(Function *Kernel);
+void insertInspector(Loop *C, PHINode *VI, IntrinsicInst *Pref,
+                     GlobalVariable *Buf, unsigned Shift);
+void reorderIterations(ReorderedLoop &R, DominatorTree &DT,
+                       GlobalVariable *Buf);
+
+/* adds the instructions of C that V depends on, up to Stop, to Set */
+static bool collectUpdate(Value *V, PHINode *Stop, Loop *C,
+                          set<Instruction *> &Set) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || I == Stop || !C->contains(I) || Set.count(I))
+    return true;
+  if (isa<PHINode>(I) || !isSafeToSpeculativelyExecute(I))
+    return false;
+  for (Value *Op : I->operands())
+    if (!collectUpdate(Op, Stop, C, Set))
+      return false;
+  Set.insert(I);
+  return true;
+}
+
+/* adds I, of the exit test, and its operands there to R.Remat */
+static bool collectRemat(Instruction *I, ReorderedLoop &R,
+                         set<PHINode *> &IVPhis, Instruction *&Blocking) {
+  if (R.Remat.count(I))
+    return true;
+  LoadInst *LD = dyn_cast<LoadInst>(I);
+  if (isa<PHINode>(I) || (LD && !LD->isSimple()) ||
+      (!LD && !isSafeToSpeculativelyExecute(I))) {
+    Blocking = I;
+    return false;
+  }
+  for (Value *Op : I->operands()) {
+    Instruction *OI = dyn_cast<Instruction>(Op);
+    if (!OI || !R.C->contains(OI))
+      continue;
+    if (PHINode *P = dyn_cast<PHINode>(OI)) {
+      if (!IVPhis.count(P)) {
+        Blocking = I;
+        return false;
+      }
+    } else if (OI->getParent() == R.Enter) {
+      if (!collectRemat(OI, R, IVPhis, Blocking))
+        return false;
+    } else {
+      Blocking = I;
+      return false;
+    }
+  }
+  R.Remat.insert(I);
+  return true;
+}
+
+/*
+  checks that the iterations of the chunk loop C, counted by VI, may run in
+  any order, and collects what reorderIterations needs; the steps of the
+  IVs are expanded in the preheader of C
+*/
+bool analyzeReorder(Loop *C, PHINode *VI, ScalarEvolution &SE,
+                    DependenceAnalysis *DA, ReorderedLoop &R,
+                    std::string &Why) {
+  BasicBlock *Hd = C->getHeader();
+  BasicBlock *Pre = C->getLoopPreheader();
+  R.C = C;
+  R.VI = VI;
+  R.Enter = R.Body = nullptr;
+  if (!Pre || !C->getLoopLatch() || VI->getParent() != Hd) {
+    Why = "unsupported loop shape";
+    return false;
+  }
+  for (BasicBlock *S : successors(Hd))
+    if (C->contains(S))
+      R.Enter = R.Enter ? Hd : S;
+  if (R.Enter && R.Enter != Hd)
+    for (BasicBlock *S : successors(R.Enter))
+      if (C->contains(S))
+        R.Body = R.Body ? Hd : S;
+  if (!R.Body || R.Body == Hd || R.Body->getSinglePredecessor() != R.Enter) {
+    Why = "unsupported loop shape";
+    return false;
+  }
+  SmallVector<BasicBlock *, 4> Exiting;
+  C->getExitingBlocks(Exiting);
+  for (BasicBlock *BB : Exiting)
+    if (BB != Hd && BB != R.Enter) {
+      Why = "exit from " + BB->getName().str();
+      return false;
+    }
+
+  std::vector<std::pair<PHINode *, const SCEV *>> Steps;
+  set<PHINode *> IVPhis;
+  R.Updates.clear();
+  for (BasicBlock::iterator I = Hd->begin(); isa<PHINode>(I); ++I) {
+    PHINode *Phi = cast<PHINode>(&*I);
+    if (Phi == VI)
+      continue;
+    if (const SCEVAddRecExpr *AR = getParallelIV(Phi, C, &SE)) {
+      Value *Next = Phi->getIncomingValueForBlock(C->getLoopLatch());
+      if (!collectUpdate(Next, Phi, C, R.Updates)) {
+        Why = "update of " + Phi->getName().str();
+        return false;
+      }
+      Steps.push_back(std::make_pair(Phi, AR->getStepRecurrence(SE)));
+      IVPhis.insert(Phi);
+      continue;
+    }
+    ParallelReduction Red;
+    if (!isParallelReduction(Phi, C, Red)) {
+      Why = "loop carries " + Phi->getName().str();
+      return false;
+    }
+  }
+
+  for (Loop::block_iterator BB = C->block_begin(), BE = C->block_end();
+       BB != BE; ++BB)
+    for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E;
+         ++I) {
+      if (isa<DbgInfoIntrinsic>(I))
+        continue;
+      if ((*BB == Hd || *BB == R.Enter) && I->mayWriteToMemory()) {
+        Why = "the exit test writes memory";
+        return false;
+      }
+      LoadInst *LD = dyn_cast<LoadInst>(I);
+      StoreInst *ST = dyn_cast<StoreInst>(I);
+      if ((LD && !LD->isSimple()) || (ST && !ST->isSimple()) ||
+          (!ST && I->mayWriteToMemory()) || I->mayThrow()) {
+        Why = std::string("side effects of ") + I->getOpcodeName();
+        return false;
+      }
+    }
+
+  // the updates keep iteration k, nothing else may use them
+  for (Instruction *I : R.Updates)
+    for (User *U : I->users())
+      if (!R.Updates.count(cast<Instruction>(U)) &&
+          !(isa<PHINode>(U) && cast<Instruction>(U)->getParent() == Hd)) {
+        Why = "the body uses " + I->getName().str();
+        return false;
+      }
+
+  // the values of the exit test that the body uses
+  R.Remat.clear();
+  for (Instruction &I : *R.Enter) {
+    if (&I == R.Enter->getTerminator())
+      break;
+    bool InBody = false;
+    for (User *U : I.users()) {
+      BasicBlock *UB = cast<Instruction>(U)->getParent();
+      InBody |= C->contains(UB) && UB != Hd && UB != R.Enter;
+    }
+    Instruction *Blocking = nullptr;
+    if (InBody && !collectRemat(&I, R, IVPhis, Blocking)) {
+      Why = "the body uses " + Blocking->getName().str();
+      return false;
+    }
+  }
+
+  LCDResult LCD = parallelLCD(C, DA);
+  if (LCD != NoLCD) {
+    Why = getStringRep(LCD) + " between iterations";
+    return false;
+  }
+
+  // everything checked, expand the steps
+  SCEVExpander Expander(SE, Hd->getModule()->getDataLayout(), "reorder");
+  R.IVs.clear();
+  for (auto &S : Steps)
+    R.IVs.push_back(std::make_pair(
+        S.first, Expander.expandCodeFor(S.second, S.second->getType(),
+                                        Pre->getTerminator())));
+  return true;
+}
+
+/* the number of distinct loads that V depends on */
+static unsigned countSliceLoads(Value *V, set<Instruction *> &Seen) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || !Seen.insert(I).second)
+    return 0;
+  unsigned Loads = isa<LoadInst>(I) ? 1 : 0;
+  if (!isa<PHINode>(I))
+    for (Value *Op : I->operands())
+      Loads += countSliceLoads(Op, Seen);
+  return Loads;
+}
+
+/* the prefetch of C, run by every iteration, with the most loads in its
+   slice; null if there is none */
+IntrinsicInst *findInspectedPrefetch(Loop *C, DominatorTree &DT,
+                                     LoopInfo &LI, unsigned &Loads) {
+  IntrinsicInst *Best = nullptr;
+  Loads = 0;
+  for (BasicBlock *BB : C->blocks()) {
+    if (LI.getLoopFor(BB) != C || !DT.dominates(BB, C->getLoopLatch()))
+      continue;
+    for (Instruction &I : *BB) {
+      IntrinsicInst *II = dyn_cast<IntrinsicInst>(&I);
+      if (!II || II->getIntrinsicID() != Intrinsic::prefetch)
+        continue;
+      set<Instruction *> Seen;
+      unsigned N = countSliceLoads(II->getArgOperand(0), Seen);
+      if (!Best || N > Loads) {
+        Best = II;
+        Loads = N;
+      }
+    }
+  }
+  return Best;
+}
+
+/* the thread-local buffer shared by the phases of Kernel */
+GlobalVariable *inspectBuffer(Function *Kernel) {
+  Module *M = Kernel->getParent();
+  std::string name = Kernel->getName().str() + "_inspect";
+  if (GlobalVariable *Buf = M->getNamedGlobal(name))
+    return Buf;
+
+  LLVMContext &C = M->getContext();
+  Type *I32 = Type::getInt32Ty(C);
+  Type *I64 = Type::getInt64Ty(C);
+  StructType *Ty =
+      StructType::get(C, {I32, ArrayType::get(I32, DAE_INSPECT_MAX),
+                          ArrayType::get(I64, DAE_INSPECT_MAX)});
+  GlobalVariable *Buf = new GlobalVariable(
+      *M, Ty, false, GlobalValue::InternalLinkage, Constant::getNullValue(Ty),
+      name, nullptr, GlobalVariable::GeneralDynamicTLSModel);
+  Buf->setAlignment(DAE_LINE_SIZE);
+  return Buf;
+}
+
+/* the address of field Field (element Index of an array field) of Buf */
+static Value *inspectField(IRBuilder<> &Builder, GlobalVariable *Buf,
+                           unsigned Field, Value *Index = nullptr) {
+  Type *I32 = Builder.getInt32Ty();
+  if (!Index)
+    return Builder.CreateInBoundsGEP(
+        Buf, {ConstantInt::get(I32, 0), ConstantInt::get(I32, Field)});
+  return Builder.CreateInBoundsGEP(
+      Buf, {ConstantInt::get(I32, 0), ConstantInt::get(I32, Field), Index});
+}
+
+/* makes the access phase of the chunk loop C, counted by VI, record the
+   key of each iteration at Pref and order them before it returns */
+void insertInspector(Loop *C, PHINode *VI, IntrinsicInst *Pref,
+                     GlobalVariable *Buf, unsigned Shift) {
+  Function *F = C->getHeader()->getParent();
+  Module *M = F->getParent();
+  LLVMContext &Ctx = F->getContext();
+  Type *I32 = Type::getInt32Ty(Ctx);
+  Type *I64 = Type::getInt64Ty(Ctx);
+
+  IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
+  Builder.CreateStore(ConstantInt::get(I32, 0),
+                      inspectField(Builder, Buf, DAE_INSPECT_N));
+
+  // slot = min(k, MAX - 1); keys[slot] = address >> shift; n = slot + 1
+  Builder.SetInsertPoint(Pref);
+  Value *K = Builder.CreateSub(VI, getChunkStart(C, VI), "inspect_k");
+  Value *Last = ConstantInt::get(I64, DAE_INSPECT_MAX - 1);
+  Value *Slot = Builder.CreateSelect(Builder.CreateICmpULT(K, Last), K, Last,
+                                     "inspect_slot");
+  Value *Key = Builder.CreateLShr(
+      Builder.CreatePtrToInt(Pref->getArgOperand(0), I64), Shift,
+      "inspect_key");
+  Builder.CreateStore(Key, inspectField(Builder, Buf, DAE_INSPECT_KEYS, Slot));
+  Builder.CreateStore(
+      Builder.CreateTrunc(Builder.CreateAdd(Slot, ConstantInt::get(I64, 1)),
+                          I32),
+      inspectField(Builder, Buf, DAE_INSPECT_N));
+
+  Constant *Order = M->getOrInsertFunction(
+      "dae_inspect_order", Type::getVoidTy(Ctx), Buf->getType(), nullptr);
+  for (BasicBlock &BB : *F)
+    if (ReturnInst *Ret = dyn_cast<ReturnInst>(BB.getTerminator()))
+      CallInst::Create(Order, {Buf}, "", Ret);
+}
+
+/* makes the body of the chunk loop of R run the iterations in the order
+   recorded in Buf; DT is the dominator tree of the execute phase */
+void reorderIterations(ReorderedLoop &R, DominatorTree &DT,
+                       GlobalVariable *Buf) {
+  Function *F = R.Body->getParent();
+  Type *I64 = Type::getInt64Ty(F->getContext());
+
+  IRBuilder<> Builder(F->getEntryBlock().getTerminator());
+  Value *N = Builder.CreateZExt(
+      Builder.CreateLoad(inspectField(Builder, Buf, DAE_INSPECT_N)), I64,
+      "inspect_n");
+
+  // j = k < n ? order[k] : k
+  Builder.SetInsertPoint(&*R.Body->getFirstInsertionPt());
+  Value *K = Builder.CreateSub(R.VI, getChunkStart(R.C, R.VI), "inspect_k");
+  Value *InOrder = Builder.CreateICmpULT(K, N);
+  Value *Slot = Builder.CreateSelect(InOrder, K, ConstantInt::get(I64, 0));
+  Value *Ordered = Builder.CreateZExt(
+      Builder.CreateLoad(
+          inspectField(Builder, Buf, DAE_INSPECT_ORDER, Slot)),
+      I64);
+  Value *J = Builder.CreateSelect(InOrder, Ordered, K, "inspect_j");
+  Value *Delta = Builder.CreateSub(J, K);
+
+  ValueToValueMapTy VMap;
+  set<Instruction *> New;
+  for (auto &IV : R.IVs) {
+    PHINode *P = IV.first;
+    Value *Step = IV.second;
+    Value *Off = Builder.CreateMul(
+        Builder.CreateSExtOrTrunc(Delta, Step->getType()), Step);
+    Value *Pj;
+    if (P->getType()->isPointerTy()) {
+      Value *Raw = Builder.CreatePointerCast(
+          P, Builder.getInt8PtrTy(P->getType()->getPointerAddressSpace()));
+      Pj = Builder.CreatePointerCast(Builder.CreateGEP(Raw, Off), P->getType(),
+                                     P->getName() + ".j");
+    } else {
+      Pj = Builder.CreateAdd(P, Off, P->getName() + ".j");
+    }
+    VMap[P] = Pj;
+  }
+  for (Instruction *I : R.Remat) {
+    Instruction *Clone = I->clone();
+    if (I->hasName())
+      Clone->setName(I->getName() + ".j");
+    Builder.Insert(Clone);
+    RemapInstruction(Clone, VMap, RF_IgnoreMissingEntries);
+    VMap[I] = Clone;
+  }
+  for (BasicBlock::iterator I = R.Body->begin(),
+                            E = Builder.GetInsertPoint();
+       I != E; ++I)
+    New.insert(&*I);
+
+  // the body, but for the updates of the IVs, runs iteration j
+  SmallVector<Use *, 16> Uses;
+  for (auto &IV : R.IVs)
+    for (Use &U : IV.first->uses())
+      Uses.push_back(&U);
+  for (Instruction *I : R.Remat)
+    for (Use &U : I->uses())
+      Uses.push_back(&U);
+  for (Use *U : Uses) {
+    Instruction *UI = cast<Instruction>(U->getUser());
+    if (New.count(UI) || R.Updates.count(UI) ||
+        !DT.dominates(R.Body, UI->getParent()))
+      continue;
+    U->set(VMap[U->get()]);
+  }
+}
+
+#endif
@@ -0,0 +1,374 @@
+//===- TileChunks.cpp - Two-dimensional chunks of loop nests --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file TileChunks.cpp
+///
+/// \brief Two-dimensional chunks of loop nests
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See
+/// the LICENSE file for details.
+//
+// A chunk of a marked loop L normally covers whole iterations of L, i.e.
+// whole rows of a nest such as
+//
+//   for (i = 0; i < n; ++i)      // L, chunked by granularity
+//     for (j = 0; j < m; ++j)    // In
+//       ...
+//
+// In a tiled nest the chunk also covers only a window of tile_width
+// iterations of the inner loop In, and the rows of the chunk are walked once
+// per window before moving on to the next chunk:
+//
+//   for (lo = 0; ; lo += granularity)          // dcb
+//     for (col = 0; ; col += tile_width)       // tile_cols
+//       for (i = lo; i < min(lo + gran, n); ++i)  // the chunk, extracted
+//         for (j = col; j < min(col + tile_width, m); ++j)
+//
+// so that the access phase of one chunk prefetches a tile of the nest. The
+// window enters In with its induction variables advanced by col steps and
+// leaves it after tile_width iterations; the tile loop stops once col
+// reaches the trip count of In. Both loops may be rotated, as at -O3: the
+// trip count of an In tested in its latch is then one more than its
+// backedge count, and only holds when In is entered, so that its guard, if
+// invariant in L, selects 0 columns otherwise.
+//
+// Walking the tiles interchanges the rows of a chunk with the windows, which
+// is only legal when:
+//  - the nest is perfect for side effects: only In writes memory, and the
+//    rest of L (recomputed for every window) reads nothing In writes;
+//  - L and In only carry affine induction variables, and no value of In is
+//    used after it;
+//  - In has an invariant trip count and a single exit, tested in its header
+//    or in its latch, and L a single exit;
+//  - no loop-carried dependence of In runs forward in L and backward in In
+//    (direction (<, >)), which the new order would reverse.
+//
+//===----------------------------------------------------------------------===//
+#ifndef TileChunks_
+#define TileChunks_
+
+#include "DAE/Utils/SkelUtils/headers.h"
+#include "Util/Analysis/LoopCarriedDependencyAnalysis.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "CFGhacking.cpp"
+
+using namespace llvm;
+using namespace std;
+using namespace util;
+
+struct ChunkTile {
+  Loop *Inner;
+  BasicBlock *Exiting; // the block of L that leaves it
+  BasicBlock *Exit;    // the exit of L
+  Value *Columns;    // the trip count of Inner, computed before L
+  std::vector<std::pair<PHINode *, Value *>> IVs; // Inner IVs and steps
+};
+
+bool analyzeChunkTile(Loop *L, ScalarEvolution *SE, DependenceAnalysis *DA,
+                      ChunkTile &T, std::string &Why);
+LCDResult tileLCD(Loop *L, Loop *In, DependenceAnalysis *DA);
+void insertChunkTile(Loop *L, ChunkTile &T, BasicBlock *H, BasicBlock *entry,
+                     BasicBlock *dcb, GlobalVariable *state,
+                     unsigned fixedTile, LoopInfo *LI);
+
+/* affine induction variable of L, or null */
+static const SCEVAddRecExpr *getAffineIV(PHINode *P, Loop *L,
+                                         ScalarEvolution *SE) {
+  const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(P));
+  if (!AR || AR->getLoop() != L || !AR->isAffine())
+    return 0;
+  return AR;
+}
+
+/* the condition, invariant in L, under which the guard of In enters it, as
+   (Cond, Taken); null if In has no such guard */
+static Value *getInnerGuard(Loop *L, Loop *In, bool &Taken) {
+  BasicBlock *InPre = In->getLoopPreheader();
+  BasicBlock *G = InPre->getSinglePredecessor();
+  BranchInst *Br =
+      G && L->contains(G) ? dyn_cast<BranchInst>(G->getTerminator()) : 0;
+  if (!Br || !Br->isConditional() || !L->isLoopInvariant(Br->getCondition()))
+    return 0;
+  Taken = Br->getSuccessor(0) == InPre;
+  return Br->getCondition();
+}
+
+/*
+  checks that the nest rooted at L can be walked by tiles and collects what
+  insertChunkTile needs; the trip count and the steps of the inner loop are
+  expanded in the preheader of L
+*/
+bool analyzeChunkTile(Loop *L, ScalarEvolution *SE, DependenceAnalysis *DA,
+                      ChunkTile &T, std::string &Why) {
+  if (L->getSubLoops().size() != 1) {
+    Why = "not a 2-D nest";
+    return false;
+  }
+  Loop *In = L->getSubLoops()[0];
+  BasicBlock *H = L->getHeader();
+  BasicBlock *InH = In->getHeader();
+  BasicBlock *InLatch = In->getLoopLatch();
+  BasicBlock *InExiting = In->getExitingBlock();
+  T.Inner = In;
+  T.Exiting = L->getExitingBlock();
+  T.Exit = L->getExitBlock();
+
+  BranchInst *InBr =
+      InExiting ? dyn_cast<BranchInst>(InExiting->getTerminator()) : 0;
+  if (!In->getSubLoops().empty() || !In->getLoopPreheader() || !InLatch ||
+      (InExiting != InH && InExiting != InLatch) || !InBr ||
+      !InBr->isConditional() || !T.Exiting || !T.Exit ||
+      !L->getLoopPreheader()) {
+    Why = "unsupported loop shape";
+    return false;
+  }
+
+  for (BasicBlock::iterator I = H->begin(); isa<PHINode>(I); ++I)
+    if (!getAffineIV(cast<PHINode>(&*I), L, SE)) {
+      Why = "outer loop carries " + I->getName().str();
+      return false;
+    }
+
+  std::vector<std::pair<PHINode *, const SCEV *>> Steps;
+  for (BasicBlock::iterator I = InH->begin(); isa<PHINode>(I); ++I) {
+    const SCEVAddRecExpr *AR = getAffineIV(cast<PHINode>(&*I), In, SE);
+    if (!AR || !SE->isLoopInvariant(AR->getStepRecurrence(*SE), L)) {
+      Why = "inner loop carries " + I->getName().str();
+      return false;
+    }
+    Steps.push_back(std::make_pair(cast<PHINode>(&*I),
+                                   AR->getStepRecurrence(*SE)));
+  }
+
+  for (Loop::block_iterator BB = L->block_begin(), BE = L->block_end();
+       BB != BE; ++BB)
+    for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E;
+         ++I) {
+      if (In->contains(*BB)) {
+        for (User *U : I->users())
+          if (!In->contains(cast<Instruction>(U)->getParent())) {
+            Why = I->getName().str() + " is used after the inner loop";
+            return false;
+          }
+        if (isa<CallInst>(I) && I->mayReadOrWriteMemory()) {
+          Why = "call in the inner loop";
+          return false;
+        }
+      } else if (I->mayHaveSideEffects()) {
+        Why = "side effects outside the inner loop";
+        return false;
+      }
+    }
+
+  const SCEV *BTC = SE->getBackedgeTakenCount(In);
+  if (isa<SCEVCouldNotCompute>(BTC) || !SE->isLoopInvariant(BTC, L)) {
+    Why = "inner trip count is not invariant";
+    return false;
+  }
+
+  LCDResult R = tileLCD(L, In, DA);
+  if (R != NoLCD) {
+    Why = getStringRep(R) + " against the tile order";
+    return false;
+  }
+
+  // everything checked, expand the invariants
+  SCEVExpander Expander(*SE, H->getModule()->getDataLayout(), "tile");
+  Instruction *PT = L->getLoopPreheader()->getTerminator();
+  IRBuilder<> Builder(PT);
+  Type *I64 = Type::getInt64Ty(H->getContext());
+  T.Columns = Builder.CreateZExtOrTrunc(
+      Expander.expandCodeFor(BTC, BTC->getType(), PT), I64, "tile_columns");
+  if (InExiting == InLatch) {
+    // tested after each iteration: one more than the backedges, if entered
+    T.Columns = Builder.CreateAdd(T.Columns, ConstantInt::get(I64, 1),
+                                  "tile_columns");
+    bool Taken;
+    if (Value *Guard = getInnerGuard(L, In, Taken))
+      T.Columns = Builder.CreateSelect(
+          Taken ? Guard : Builder.CreateNot(Guard), T.Columns,
+          ConstantInt::get(I64, 0), "tile_columns");
+  }
+  T.IVs.clear();
+  for (auto &S : Steps)
+    T.IVs.push_back(std::make_pair(
+        S.first, Expander.expandCodeFor(S.second, S.second->getType(), PT)));
+  return true;
+}
+
+/*
+  loop-carried dependences that forbid the tile order: any dependence
+  touching the rest of L, which is recomputed for every window, and the
+  (<, >) dependences of In
+*/
+LCDResult tileLCD(Loop *L, Loop *In, DependenceAnalysis *DA) {
+  SmallVector<Instruction *, 16> MemInst;
+  for (Loop::block_iterator BB = L->block_begin(), BE = L->block_end();
+       BB != BE; ++BB)
+    for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E;
+         ++I)
+      if (isa<LoadInst>(I) || isa<StoreInst>(I))
+        MemInst.push_back(&*I);
+
+  unsigned OuterLevel = L->getLoopDepth(), InnerLevel = In->getLoopDepth();
+  LCDResult R = NoLCD;
+  for (unsigned i = 0, e = MemInst.size(); i != e; ++i)
+    for (unsigned j = i; j != e; ++j) {
+      Instruction *Src = MemInst[i], *Dst = MemInst[j];
+      if (!Src->mayWriteToMemory() && !Dst->mayWriteToMemory())
+        continue;
+      std::unique_ptr<Dependence> D = DA->depends(Src, Dst, true);
+      if (!D)
+        continue;
+      if (!In->contains(Src) || !In->contains(Dst)) {
+        R = LoopCarriedDependencyAnalysis::combineLCD(R, MustLCD);
+        continue;
+      }
+      if (D->isConfused() || D->getLevels() < InnerLevel) {
+        R = LoopCarriedDependencyAnalysis::combineLCD(R, MayLCD);
+        continue;
+      }
+      unsigned Outer = D->getDirection(OuterLevel);
+      unsigned Inner = D->getDirection(InnerLevel);
+      bool Reversed = ((Outer & Dependence::DVEntry::LT) &&
+                       (Inner & Dependence::DVEntry::GT)) ||
+                      ((Outer & Dependence::DVEntry::GT) &&
+                       (Inner & Dependence::DVEntry::LT));
+      if (Reversed)
+        R = LoopCarriedDependencyAnalysis::combineLCD(
+            R, (Outer == Dependence::DVEntry::LT ||
+                Outer == Dependence::DVEntry::GT) &&
+                       (Inner == Dependence::DVEntry::LT ||
+                        Inner == Dependence::DVEntry::GT)
+                   ? MustLCD
+                   : MayLCD);
+    }
+  return R;
+}
+
+/*
+  L is the chunk loop built by LoopChunk (headed by the chunk condition), H
+  its original header:
+    entry:     tile_width = granularity of the windows (0: whole rows)
+    dcb:       -> tile_cols
+    tile_cols: col = phi [0, dcb], [col + tile_width, exitChunk/tile_exit]
+    exitChunk, tile_exit: next window of the same rows, or move on
+  and the inner loop is entered at column col for tile_width iterations
+*/
+void insertChunkTile(Loop *L, ChunkTile &T, BasicBlock *H, BasicBlock *entry,
+                     BasicBlock *dcb, GlobalVariable *state,
+                     unsigned fixedTile, LoopInfo *LI) {
+  LLVMContext &C = H->getContext();
+  Type *I64 = Type::getInt64Ty(C);
+  BasicBlock *cond = L->getHeader();
+  BasicBlock *exitChunk = cond->getTerminator()->getSuccessor(1);
+  Loop *In = T.Inner;
+
+  // the width of the windows, once per execution of the loop
+  IRBuilder<> Builder(entry->getTerminator());
+  Value *width;
+  if (fixedTile) {
+    width = ConstantInt::get(I64, fixedTile);
+  } else {
+    Value *w = Builder.CreateLoad(chunkStateField(state, DAE_CHUNK_TILE),
+                                  "tile_width_value");
+    width = Builder.CreateSelect(
+        Builder.CreateICmpEQ(w, ConstantInt::get(I64, 0)),
+        ConstantInt::get(I64, -1), w, "tile_width");
+  }
+
+  BasicBlock *cols = BasicBlock::Create(
+      C, Twine(H->getName() + "_tile_cols"), H->getParent(), cond);
+  PHINode *col = PHINode::Create(I64, 3, "tile_col", cols);
+  col->addIncoming(ConstantInt::get(I64, 0), dcb);
+  BranchInst::Create(cond, cols);
+  dcb->getTerminator()->replaceUsesOfWith(cond, cols);
+  for (BasicBlock::iterator I = cond->begin(); isa<PHINode>(I); ++I) {
+    PHINode *phi = cast<PHINode>(&*I);
+    phi->setIncomingBlock(phi->getBasicBlockIndex(dcb), cols);
+  }
+
+  // the original exit of the rows also moves on to the next window
+  BasicBlock *tileExit = BasicBlock::Create(
+      C, Twine(H->getName() + "_tile_exit"), H->getParent(), T.Exit);
+  BranchInst::Create(T.Exit, tileExit);
+  T.Exiting->getTerminator()->replaceUsesOfWith(T.Exit, tileExit);
+  for (BasicBlock::iterator I = T.Exit->begin(); isa<PHINode>(I); ++I) {
+    PHINode *phi = cast<PHINode>(&*I);
+    phi->setIncomingBlock(phi->getBasicBlockIndex(T.Exiting), tileExit);
+  }
+
+  BasicBlock *Next[] = {exitChunk, tileExit};
+  for (BasicBlock *BB : Next) {
+    TerminatorInst *Term = BB->getTerminator();
+    BasicBlock *Done = Term->getSuccessor(0);
+    Builder.SetInsertPoint(Term);
+    Value *next = Builder.CreateAdd(col, width, "tile_col_next");
+    Builder.CreateCondBr(Builder.CreateICmpULT(next, T.Columns, "tile_more"),
+                         cols, Done);
+    Term->eraseFromParent();
+    col->addIncoming(next, BB);
+  }
+
+  // the window: start at column col, leave after tile_width iterations
+  BasicBlock *InPre = In->getLoopPreheader();
+  BasicBlock *InH = In->getHeader();
+  BasicBlock *InLatch = In->getLoopLatch();
+  Builder.SetInsertPoint(InPre->getTerminator());
+  for (auto &IV : T.IVs) {
+    PHINode *phi = IV.first;
+    Value *Step = IV.second;
+    int idx = phi->getBasicBlockIndex(InPre);
+    Value *Start = phi->getIncomingValue(idx);
+    Value *Off = Builder.CreateMul(
+        Builder.CreateZExtOrTrunc(col, Step->getType()), Step);
+    if (phi->getType()->isPointerTy()) {
+      Type *I8Ptr = Type::getInt8PtrTy(
+          C, phi->getType()->getPointerAddressSpace());
+      Value *P = Builder.CreatePointerCast(Start, I8Ptr);
+      P = Builder.CreateGEP(P, Off);
+      Start = Builder.CreatePointerCast(P, phi->getType(),
+                                        phi->getName() + ".tile");
+    } else {
+      Start = Builder.CreateAdd(Start, Off, phi->getName() + ".tile");
+    }
+    phi->setIncomingValue(idx, Start);
+  }
+
+  PHINode *tj = PHINode::Create(I64, 2, "tile_j", &InH->front());
+  Value *tjInc = BinaryOperator::CreateAdd(tj, ConstantInt::get(I64, 1),
+                                           "tile_j_inc",
+                                           InLatch->getTerminator());
+  tj->addIncoming(ConstantInt::get(I64, 0), InPre);
+  tj->addIncoming(tjInc, InLatch);
+
+  // tested before iteration tj in the header, after it in the latch
+  BasicBlock *InExiting = In->getExitingBlock();
+  Value *done = InExiting == InLatch ? tjInc : tj;
+  BranchInst *InBr = cast<BranchInst>(InExiting->getTerminator());
+  Builder.SetInsertPoint(InBr);
+  if (In->contains(InBr->getSuccessor(0)))
+    InBr->setCondition(Builder.CreateAnd(
+        InBr->getCondition(),
+        Builder.CreateICmpULT(done, width, "tile_j_cmp")));
+  else
+    InBr->setCondition(Builder.CreateOr(
+        InBr->getCondition(),
+        Builder.CreateICmpUGE(done, width, "tile_j_cmp")));
+
+  // update loop info
+  Loop *Lp = L->getParentLoop();
+  if (Lp) {
+    Lp->addBasicBlockToLoop(cols, *LI);
+    Lp->addBasicBlockToLoop(tileExit, *LI);
+  }
+}
+
+#endif
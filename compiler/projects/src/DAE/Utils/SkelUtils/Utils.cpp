@@ -19,15 +19,27 @@ using namespace std;
 #ifndef Utils_
 #define Utils_
 
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
 #include "llvm/Analysis/LoopAccessAnalysis.h"
 #include "DAE/Utils/SkelUtils/headers.h"
 #include <algorithm>
 #include <llvm/IR/BasicBlock.h>
 
-void declareExternalGlobal(Value *v, int val);
+void declareExternalGlobal(Value *v, int val, bool fixed = false);
+StructType *getChunkStateType(LLVMContext &C);
+void declareExternalChunkState(GlobalVariable *GV, int gran,
+                               bool fixed = false, int tile = 0,
+                               bool tileFixed = false,
+                               uint64_t footprint = 0);
 bool loopToBeDAE(Loop *L, std::string benchmarkName);
+bool getDAEHint(const Loop *L, StringRef Name, unsigned &Val);
+void setDAEHint(Loop *L, StringRef Name, unsigned Val);
+bool getDAEFnHint(const Function *F, StringRef Name, unsigned &Val);
 bool isDAEkernel(Function *F);
 bool isMain(Function *F);
+bool mayClobberLoad(Instruction *W, LoadInst *LD, DependenceAnalysis *DA,
+                    AliasAnalysis &AA);
 
 /////////////////////////////////////////////////////////////
 //
@@ -176,6 +188,135 @@ private:
   const Loop *TheLoop;
 }; // end LoopVectorizeHints
 
+/////////////////////////////////////////////////////////////
+//
+//              Per-loop DAE parameters
+//
+/////////////////////////////////////////////////////////////
+
+/// Per-loop DAE parameters are carried as loop metadata, in the same form as
+/// the "llvm.loop.vectorize.*" hints, e.g. !{!"llvm.loop.dae.granularity", i32
+/// 64}. Once a loop has been extracted, LoopExtract copies them to string
+/// attributes of the new function, e.g. "dae-indirection"="2".
+#define DAE_HINT_ENABLE "llvm.loop.dae.enable"
+#define DAE_HINT_GRANULARITY "llvm.loop.dae.granularity"
+#define DAE_HINT_INDIRECTION "llvm.loop.dae.indirection"
+#define DAE_HINT_TILE "llvm.loop.dae.tile"
+#define DAE_HINT_DISTANCE "llvm.loop.dae.distance"
+#define DAE_HINT_GATHER "llvm.loop.dae.gather"
+
+/// Loads of marked loops carry a module-unique name, e.g. !DAELoadID
+/// !{!"__kernel__main0.3"}, that survives chunking, extraction and cloning.
+#define DAE_LOAD_ID_MD "DAELoadID"
+
+#define DAE_ATTR_GRANULARITY "dae-granularity"
+#define DAE_ATTR_INDIRECTION "dae-indirection"
+#define DAE_ATTR_DISTANCE "dae-distance"
+#define DAE_ATTR_GATHER "dae-gather"
+
+/// Set on a chunk kernel that only dispatches to its versions specialized
+/// for a granularity (LoopExtract -specialize-gran); it is not decoupled.
+#define DAE_ATTR_DISPATCH "dae-dispatch"
+
+/// Set on a specialized chunk kernel whose loop exit was dropped: it always
+/// runs its full chunk, so its bound must not be changed (e.g. for L2).
+#define DAE_ATTR_FULL_CHUNK "dae-full-chunk"
+
+/// Set on the task that runs a range of the iterations of a parallel loop
+/// (LoopChunk -dae-parallel); its own loop is chunked, not run in parallel.
+#define DAE_ATTR_TASK "dae-task"
+
+/// The chunking state of a kernel is one cache line shared by all the
+/// threads, { i64 granularity, i64 granularity_l2, i64 tile_width,
+/// i64 footprint, [4 x i64] }, that the kernels only read: the granularity
+/// once per entry into the loop. granularity_l2 is the size of the
+/// super-chunks prefetched into L2 by the two-level access phase (0 disables
+/// it). tile_width is the number of inner iterations of a tile of a tiled
+/// nest (0: whole rows). footprint is the estimated number of bytes one
+/// iteration prefetches (see ChunkFootprint.cpp); the runtime refines the
+/// granularities of the blocks where it is not 0.
+#define DAE_CHUNK_GRAN 0
+#define DAE_CHUNK_GRAN_L2 1
+#define DAE_CHUNK_TILE 2
+#define DAE_CHUNK_FOOTPRINT 3
+#define DAE_CHUNK_STATE_ALIGN 64
+
+/// The bounds of a chunk live in registers, so that a kernel may run in
+/// several threads, or recursively, at once. Each thread mirrors the bounds
+/// of its last chunk, for observation, in its own block <state>_bounds,
+/// thread_local { i64 vi, i64 lsup }.
+#define DAE_BOUNDS_VI 0
+#define DAE_BOUNDS_LSUP 1
+
+/// The state blocks are laid out next to each other in this section, where
+/// the runtime finds them through __start_dae_chunks and __stop_dae_chunks.
+#define DAE_CHUNK_STATE_SECTION "dae_chunks"
+
+/// The chunk compare of a chunked loop names the loop's state block.
+#define DAE_CHUNK_STATE_MD "DAEChunkState"
+
+/// The chunk compare of a tiled loop (see TileChunks.cpp) also has this
+/// kind: its kernel is called once per window with the same chunk bounds.
+#define DAE_CHUNK_TILED_MD "DAEChunkTiled"
+
+/// Reads the DAE hint Name of L into Val. Returns false if L has no such hint.
+bool getDAEHint(const Loop *L, StringRef Name, unsigned &Val) {
+  MDNode *LoopID = L->getLoopID();
+  if (!LoopID)
+    return false;
+
+  for (unsigned i = 1, ie = LoopID->getNumOperands(); i < ie; ++i) {
+    const MDNode *MD = dyn_cast<MDNode>(LoopID->getOperand(i));
+    if (!MD || MD->getNumOperands() != 2)
+      continue;
+    const MDString *S = dyn_cast<MDString>(MD->getOperand(0));
+    if (!S || S->getString() != Name)
+      continue;
+    const ConstantInt *C = mdconst::dyn_extract<ConstantInt>(MD->getOperand(1));
+    if (!C)
+      continue;
+    Val = C->getZExtValue();
+    return true;
+  }
+  return false;
+}
+
+/// Sets the DAE hint Name of L to Val, replacing any previous value.
+void setDAEHint(Loop *L, StringRef Name, unsigned Val) {
+  LLVMContext &Context = L->getHeader()->getContext();
+  SmallVector<Metadata *, 4> MDs;
+  // Reserve first location for self reference to the LoopID metadata node.
+  MDs.push_back(nullptr);
+
+  if (MDNode *LoopID = L->getLoopID()) {
+    for (unsigned i = 1, ie = LoopID->getNumOperands(); i < ie; ++i) {
+      const MDNode *MD = dyn_cast<MDNode>(LoopID->getOperand(i));
+      const MDString *S =
+          MD && MD->getNumOperands() ? dyn_cast<MDString>(MD->getOperand(0))
+                                     : nullptr;
+      if (!S || S->getString() != Name)
+        MDs.push_back(LoopID->getOperand(i));
+    }
+  }
+
+  Metadata *Hint[] = {MDString::get(Context, Name),
+                      ConstantAsMetadata::get(ConstantInt::get(
+                          Type::getInt32Ty(Context), Val))};
+  MDs.push_back(MDNode::get(Context, Hint));
+
+  MDNode *NewLoopID = MDNode::get(Context, MDs);
+  // Set operand 0 to refer to the loop id itself.
+  NewLoopID->replaceOperandWith(0, NewLoopID);
+  L->setLoopID(NewLoopID);
+}
+
+/// Reads the DAE attribute Name of an extracted kernel F into Val.
+bool getDAEFnHint(const Function *F, StringRef Name, unsigned &Val) {
+  if (!F->hasFnAttribute(Name))
+    return false;
+  return !F->getFnAttribute(Name).getValueAsString().getAsInteger(10, Val);
+}
+
 bool isDAEkernel(Function *F) {
   bool ok = false;
   size_t found = F->getName().str().find("_clone");
@@ -185,20 +326,74 @@ bool isDAEkernel(Function *F) {
   return ok;
 }
 
-void declareExternalGlobal(Value *v, int val) {
+/* fixed globals hold a per-loop value that the build must not overwrite */
+void declareExternalGlobal(Value *v, int val, bool fixed) {
+  std::string path = "Globals.ll";
+  std::error_code err;
+  llvm::raw_fd_ostream out(path.c_str(), err, llvm::sys::fs::F_Append);
+
+  out << "\n@\"" << v->getName() << "\" = global i64 " << val << "  ";
+  if (fixed)
+    out << "; dae-fixed";
+  out << "\n";
+  out.close();
+}
+
+StructType *getChunkStateType(LLVMContext &C) {
+  Type *I64 = Type::getInt64Ty(C);
+  return StructType::get(C, {I64, I64, I64, I64, ArrayType::get(I64, 4)});
+}
+
+/* the granularities sit on their own lines so that the build can rewrite them */
+void declareExternalChunkState(GlobalVariable *GV, int gran, bool fixed,
+                               int tile, bool tileFixed, uint64_t footprint) {
   std::string path = "Globals.ll";
   std::error_code err;
   llvm::raw_fd_ostream out(path.c_str(), err, llvm::sys::fs::F_Append);
 
-  out << "\n@\"" << v->getName() << "\" = global i64 " << val << "  \n";
+  out << "\n@\"" << GV->getName() << "\" = global " << *GV->getValueType()
+      << " {\n"
+      << "  i64 " << gran << ", ; dae-granularity";
+  if (fixed)
+    out << " dae-fixed";
+  out << "\n  i64 0, ; dae-granularity-l2\n"
+      << "  i64 " << tile << ", ; dae-tile-width";
+  if (tileFixed)
+    out << " dae-fixed";
+  out << "\n  i64 " << footprint << ", ; dae-footprint\n"
+      << "  [4 x i64] zeroinitializer }, section \"" DAE_CHUNK_STATE_SECTION
+      << "\", align " << DAE_CHUNK_STATE_ALIGN << "\n";
   out.close();
 }
 
+/* the value of VI, the virtual iterator of the chunk loop C, when C is
+   entered: the first iteration of the chunk */
+Value *getChunkStart(Loop *C, PHINode *VI) {
+  for (unsigned i = 0, e = VI->getNumIncomingValues(); i != e; ++i)
+    if (!C->contains(VI->getIncomingBlock(i)))
+      return VI->getIncomingValue(i);
+  return nullptr;
+}
+
+/* true iff W may write the memory that LD reads, in the same iteration of
+   their loops or in another one: alias analysis alone only answers for the
+   same iteration (b[i + 1] and b[i] do not alias) */
+bool mayClobberLoad(Instruction *W, LoadInst *LD, DependenceAnalysis *DA,
+                    AliasAnalysis &AA) {
+  if (isa<StoreInst>(W))
+    return DA->depends(W, LD, true) || DA->depends(LD, W, true);
+  return AA.getModRefInfo(W, MemoryLocation::get(LD)) & MRI_Mod;
+}
+
 bool isMain(Function *F) { return F->getName().str().compare("main") == 0; }
 
 bool loopToBeDAE(Loop *L, std::string benchmarkName) {
   int MAGIC_TRANSFORM = 1337;
 
+  unsigned Enable;
+  if (getDAEHint(L, DAE_HINT_ENABLE, Enable))
+    return Enable != 0;
+
   LoopVectorizeHints Hints(L, false);
   if (Hints.getWidth() >= MAGIC_TRANSFORM) {
       return true;
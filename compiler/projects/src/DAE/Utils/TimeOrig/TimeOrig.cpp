@@ -39,8 +39,8 @@ struct TimeOrig : public FunctionPass {
       for (llvm::Value::user_iterator II = F.user_begin(), EE = F.user_end();
            II != EE; ++II) {
         if (llvm::Instruction *user = llvm::dyn_cast<llvm::Instruction>(*II))
-          if (isa<CallInst>(user)) {
-            insertCallOrigToPAPI(llvm::dyn_cast<llvm::CallInst>(user));
+          if (isa<CallInst>(user) || isa<InvokeInst>(user)) {
+            insertCallOrigToPAPI(user);
           }
       }
     } else {
@@ -0,0 +1,53 @@
+/// \file combine.h
+///
+/// \brief Scattered stores of the execute phase, written grouped by line
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include <stdint.h>
+
+#ifndef __DAE_COMBINE_H__
+#define __DAE_COMBINE_H__
+
+/*
+ * With -dae-combine, the execute phase of a kernel stages the S scattered
+ * stores of its chunk loop instead of doing them: iteration k of a chunk
+ * of n iterations appends { address, value, size } to stores, and the
+ * loop writes them all at its exits, grouped by blocks of 2^shift bytes
+ * (a cache line by default, or a page):
+ *
+ *   stores = dae_combine_reserve(&<kernel>_combine, max(granularity, n) * S);
+ *   ...
+ *   dae_combine_flush(stores, count, shift);
+ *
+ * The buffer of a kernel is thread-local, and allocated once per thread:
+ * it only grows with the granularity. It is freed when the thread exits.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Layout known to the compiler: { i8*, i64, i64 } */
+struct dae_combine_store {
+  void *addr;
+  uint64_t value; /* the first size bytes are stored */
+  uint64_t size;
+};
+
+/* Layout known to the compiler: { { i8*, i64, i64 }*, i64 } */
+struct dae_combine {
+  struct dae_combine_store *stores;
+  uint64_t capacity;
+};
+
+/* Inserted by the -dae-combine option of the -f-kernel-prefetch pass */
+extern struct dae_combine_store *dae_combine_reserve(struct dae_combine *buf,
+                                                     uint64_t capacity);
+extern void dae_combine_flush(struct dae_combine_store *stores, uint64_t count,
+                              uint32_t shift);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DAE_COMBINE_H__ */
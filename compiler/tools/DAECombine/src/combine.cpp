@@ -0,0 +1,60 @@
+/// \file combine.cpp
+///
+/// \brief Scattered stores of the execute phase, written grouped by line
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include "combine.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define CACHE_LINE 64
+
+/* The buffers of the kernels run by a thread, freed when it exits */
+struct Owned {
+  std::vector<dae_combine *> buffers;
+  ~Owned() {
+    for (dae_combine *buf : buffers) {
+      free(buf->stores);
+      buf->stores = nullptr;
+      buf->capacity = 0;
+    }
+  }
+};
+
+static thread_local Owned owned;
+
+struct dae_combine_store *dae_combine_reserve(struct dae_combine *buf,
+                                              uint64_t capacity) {
+  if (capacity <= buf->capacity)
+    return buf->stores;
+
+  // a line-aligned buffer, doubled past a granularity refined upwards
+  uint64_t size = buf->capacity ? buf->capacity : 1;
+  while (size < capacity)
+    size *= 2;
+  void *stores = nullptr;
+  if (posix_memalign(&stores, CACHE_LINE, size * sizeof(dae_combine_store)))
+    abort();
+  if (!buf->stores)
+    owned.buffers.push_back(buf);
+  free(buf->stores);
+  buf->stores = (dae_combine_store *)stores;
+  buf->capacity = size;
+  return buf->stores;
+}
+
+void dae_combine_flush(struct dae_combine_store *stores, uint64_t count,
+                       uint32_t shift) {
+  // stable: the stores to one address stay in program order
+  std::stable_sort(stores, stores + count,
+                   [shift](const dae_combine_store &a,
+                           const dae_combine_store &b) {
+                     return ((uintptr_t)a.addr >> shift) <
+                            ((uintptr_t)b.addr >> shift);
+                   });
+  for (uint64_t i = 0; i < count; ++i)
+    memcpy(stores[i].addr, &stores[i].value, stores[i].size);
+}
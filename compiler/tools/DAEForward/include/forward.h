@@ -0,0 +1,43 @@
+/// \file forward.h
+///
+/// \brief Addresses forwarded from the access to the execute phase
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include <stdint.h>
+
+#ifndef __DAE_FORWARD_H__
+#define __DAE_FORWARD_H__
+
+/*
+ * With -dae-forward, the access phase of a kernel stores the P indirect
+ * addresses it prefetches in iteration k of its chunk of n iterations in
+ * base[p * n + k], one column per load, and the execute phase reads them
+ * from there instead of computing them again. With -dae-gather, a column
+ * holds the values a read-only gather loads instead of their addresses.
+ * Before its chunk loop, the access phase calls
+ *
+ *   base = dae_forward_reserve(&<kernel>_forward, max(granularity, n) * P);
+ *
+ * for a chunk of n iterations. The buffer of a kernel is thread-local, and
+ * allocated once per thread: it only grows with the granularity. It is
+ * freed when the thread exits.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Layout known to the compiler: { i8**, i64 } */
+struct dae_forward {
+  void **base;
+  uint64_t slots;
+};
+
+/* Inserted by the -dae-forward option of the -f-kernel-prefetch pass */
+extern void **dae_forward_reserve(struct dae_forward *buf, uint64_t slots);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DAE_FORWARD_H__ */
@@ -0,0 +1,44 @@
+/// \file forward.cpp
+///
+/// \brief Addresses forwarded from the access to the execute phase
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include "forward.h"
+
+#include <stdlib.h>
+#include <vector>
+
+#define CACHE_LINE 64
+
+/* The buffers of the kernels run by a thread, freed when it exits */
+struct Owned {
+  std::vector<dae_forward *> buffers;
+  ~Owned() {
+    for (dae_forward *buf : buffers) {
+      free(buf->base);
+      buf->base = nullptr;
+      buf->slots = 0;
+    }
+  }
+};
+
+static thread_local Owned owned;
+
+void **dae_forward_reserve(struct dae_forward *buf, uint64_t slots) {
+  if (slots <= buf->slots)
+    return buf->base;
+
+  // a line-aligned buffer, doubled past a granularity refined upwards
+  uint64_t size = buf->slots ? buf->slots : 1;
+  while (size < slots)
+    size *= 2;
+  void *base = nullptr;
+  if (posix_memalign(&base, CACHE_LINE, size * sizeof(void *)))
+    abort();
+  if (!buf->base)
+    owned.buffers.push_back(buf);
+  free(buf->base);
+  buf->base = (void **)base;
+  buf->slots = size;
+  return buf->base;
+}
@@ -0,0 +1,56 @@
+/// \file helper.h
+///
+/// \brief SMT helper threads running DAE access phases
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include <stdint.h>
+
+#ifndef __DAE_HELPER_H__
+#define __DAE_HELPER_H__
+
+/*
+ * With -helper-thread, each call to a kernel becomes
+ *
+ *   task_DAE(<access>_task, &args, sizeof(args));
+ *   <execute>(args...);
+ *   task_DAE_sync();
+ *
+ * The first task of an application thread starts a helper thread pinned to
+ * a sibling hyperthread of the CPU it runs on, unless another thread's
+ * helper already uses that core. The application thread is not pinned: if
+ * it moves to another core, its helper follows it when that core is free,
+ * and its tasks run inline otherwise. The helper is stopped and joined when
+ * the application thread exits. A task is
+ * handed over through one mailbox: the arguments are copied and the task
+ * is published by incrementing a sequence number, which the helper
+ * acknowledges once the access phase has run. Each side only writes its
+ * own counter, so no lock is needed. task_DAE first waits for a task that
+ * is still running, should its task_DAE_sync have been skipped, before it
+ * moves the helper or posts the next one. The helper is at most one task ahead
+ * of the execute thread: with -pipeline-chunks, the access phase of chunk
+ * k+1 while chunk k executes.
+ *
+ * Without a sibling hyperthread, on a core that already has a helper, or
+ * with DAE_HELPER=0 in the environment, task_DAE runs the access phase
+ * inline, before the execute phase.
+ */
+
+/* Largest argument block a task can carry; larger ones run inline */
+#define DAE_TASK_ARGS_SIZE 192
+
+/* Idle polls of the helper before it starts sleeping between polls */
+#define DAE_HELPER_SPINS (1 << 16)
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Inserted by the -helper-thread option of the -f-kernel-prefetch pass */
+extern void task_DAE(void (*access)(void *), void *args, uint64_t size);
+extern void task_DAE_sync(void);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DAE_HELPER_H__ */
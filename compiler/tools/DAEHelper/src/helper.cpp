@@ -0,0 +1,217 @@
+/// \file helper.cpp
+///
+/// \brief SMT helper threads running DAE access phases
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "helper.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+
+struct Helper {
+  /* written by the execute thread */
+  volatile uint64_t posted __attribute__((aligned(CACHE_LINE)));
+  void (*access)(void *);
+  char args[DAE_TASK_ARGS_SIZE];
+  volatile bool stop;
+
+  /* written by the helper */
+  volatile uint64_t done __attribute__((aligned(CACHE_LINE)));
+
+  /* the core it shares with the execute thread */
+  pthread_t thread;
+  int cpu, sibling;
+};
+
+/* The CPUs of the cores that have a helper, one helper per core */
+static pthread_mutex_t claims_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::set<int> claimed;
+
+static bool claim(int cpu, int sibling) {
+  pthread_mutex_lock(&claims_lock);
+  bool unclaimed = !claimed.count(cpu) && !claimed.count(sibling);
+  if (unclaimed) {
+    claimed.insert(cpu);
+    claimed.insert(sibling);
+  }
+  pthread_mutex_unlock(&claims_lock);
+  return unclaimed;
+}
+
+static void release(int cpu, int sibling) {
+  pthread_mutex_lock(&claims_lock);
+  claimed.erase(cpu);
+  claimed.erase(sibling);
+  pthread_mutex_unlock(&claims_lock);
+}
+
+/* The helper of the calling thread; null until its first task, or if it
+   runs its tasks inline. It is stopped when the thread exits. */
+struct Owned {
+  Helper *helper = nullptr;
+  bool run_inline = false;
+  ~Owned() {
+    if (!helper)
+      return;
+    helper->stop = true;
+    pthread_join(helper->thread, NULL);
+    release(helper->cpu, helper->sibling);
+    free(helper);
+    helper = nullptr;
+  }
+};
+
+static thread_local Owned owned;
+
+static __inline__ void cpu_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__("pause" ::: "memory");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* A hyperthread sharing the core of cpu, or -1 */
+static int sibling_cpu(int cpu) {
+  char path[96];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+
+  /* e.g. "0,4" or "0-1" */
+  int sibling = -1, first, last;
+  char sep = ',';
+  while (sibling < 0 && sep == ',' && fscanf(f, "%d", &first) == 1) {
+    last = first;
+    if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+      if (fscanf(f, "%d", &last) != 1 || fscanf(f, "%c", &sep) != 1)
+        sep = '\n';
+    }
+    for (int c = first; c <= last && sibling < 0; ++c)
+      if (c != cpu)
+        sibling = c;
+  }
+  fclose(f);
+  return sibling;
+}
+
+static void *helper_main(void *arg) {
+  Helper *h = (Helper *)arg;
+  uint64_t seen = 0;
+  unsigned idle = 0;
+  while (!h->stop) {
+    uint64_t posted = __atomic_load_n(&h->posted, __ATOMIC_ACQUIRE);
+    if (posted == seen) {
+      if (++idle < DAE_HELPER_SPINS) {
+        cpu_relax();
+      } else {
+        // outside of the kernels: leave the core to the execute thread
+        struct timespec pause = {0, 20000};
+        nanosleep(&pause, NULL);
+      }
+      continue;
+    }
+    idle = 0;
+    h->access(h->args);
+    seen = posted;
+    __atomic_store_n(&h->done, seen, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* Starts the helper of the calling thread on the sibling of the CPU it runs
+   on, or returns null if it has to run its tasks inline */
+static Helper *start_helper(void) {
+  const char *env = getenv("DAE_HELPER");
+  if (env && !strcmp(env, "0"))
+    return NULL;
+
+  int cpu = sched_getcpu();
+  int sibling = cpu < 0 ? -1 : sibling_cpu(cpu);
+  if (sibling < 0 || !claim(cpu, sibling))
+    return NULL;
+
+  Helper *h;
+  if (posix_memalign((void **)&h, CACHE_LINE, sizeof(Helper))) {
+    release(cpu, sibling);
+    return NULL;
+  }
+  memset(h, 0, sizeof(Helper));
+  h->cpu = cpu;
+  h->sibling = sibling;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(sibling, &set);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  int err = pthread_create(&h->thread, &attr, helper_main, h);
+  pthread_attr_destroy(&attr);
+  if (err) {
+    release(cpu, sibling);
+    free(h);
+    return NULL;
+  }
+  return h;
+}
+
+/* Moves the helper h, idle, next to the CPU that the execute thread moved
+   to, if that core has no helper yet; false if it has */
+static bool follow(Helper *h, int cpu) {
+  int sibling = cpu < 0 ? -1 : sibling_cpu(cpu);
+  if (sibling < 0 || !claim(cpu, sibling))
+    return false;
+  release(h->cpu, h->sibling);
+  h->cpu = cpu;
+  h->sibling = sibling;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(sibling, &set);
+  pthread_setaffinity_np(h->thread, sizeof(set), &set);
+  return true;
+}
+
+void task_DAE(void (*access)(void *), void *args, uint64_t size) {
+  if (!owned.helper && !owned.run_inline) {
+    owned.helper = start_helper();
+    owned.run_inline = !owned.helper;
+  }
+  Helper *helper = owned.helper;
+  // a task left running (its sync skipped by an unwind) is waited for
+  // before the helper moves or its task is overwritten
+  if (helper)
+    task_DAE_sync();
+  // the execute thread is not pinned: a task whose execute thread left the
+  // core of its helper runs inline, unless the helper can follow it
+  if (owned.run_inline || size > DAE_TASK_ARGS_SIZE ||
+      (sched_getcpu() != helper->cpu && !follow(helper, sched_getcpu()))) {
+    access(args);
+    return;
+  }
+
+  helper->access = access;
+  memcpy(helper->args, args, size);
+  __atomic_store_n(&helper->posted, helper->posted + 1, __ATOMIC_RELEASE);
+}
+
+void task_DAE_sync(void) {
+  Helper *helper = owned.helper;
+  if (!helper)
+    return;
+  while (__atomic_load_n(&helper->done, __ATOMIC_ACQUIRE) != helper->posted)
+    cpu_relax();
+}
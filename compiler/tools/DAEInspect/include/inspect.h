@@ -0,0 +1,50 @@
+/// \file inspect.h
+///
+/// \brief Locality order of the iterations of a DAE chunk
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include <stdint.h>
+
+#ifndef __DAE_INSPECT_H__
+#define __DAE_INSPECT_H__
+
+/*
+ * With -dae-reorder, the access phase of a kernel whose iterations are
+ * independent also inspects its chunk: iteration k stores the line or page
+ * of its deepest prefetch in keys[k] (the first DAE_INSPECT_MAX iterations
+ * of a chunk, the last slot taking the rest) and n = k + 1. Once the chunk
+ * is walked, the access phase calls
+ *
+ *   dae_inspect_order(&<kernel>_inspect);
+ *
+ * which sorts the iterations [0, n) by key into order. The execute phase
+ * then runs iteration order[k] as its k-th iteration, for k < n, and the
+ * other iterations in place.
+ *
+ * The buffer of a kernel is thread-local, and is only valid between the
+ * two phases of the same chunk.
+ */
+
+/* Iterations of a chunk that are reordered */
+#define DAE_INSPECT_MAX 4096
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Layout known to the compiler: { i32, [DAE_INSPECT_MAX x i32],
+   [DAE_INSPECT_MAX x i64] } */
+struct dae_inspect {
+  uint32_t n;
+  uint32_t order[DAE_INSPECT_MAX];
+  uint64_t keys[DAE_INSPECT_MAX];
+};
+
+/* Inserted by the -dae-reorder option of the -f-kernel-prefetch pass */
+extern void dae_inspect_order(struct dae_inspect *buf);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DAE_INSPECT_H__ */
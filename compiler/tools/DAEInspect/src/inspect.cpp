@@ -0,0 +1,33 @@
+/// \file inspect.cpp
+///
+/// \brief Locality order of the iterations of a DAE chunk
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include "inspect.h"
+
+#include <algorithm>
+
+/* Orders the keys of the chunk, the iterations of one key in their
+   original order */
+struct ByKey {
+  const uint64_t *keys;
+  bool operator()(uint32_t a, uint32_t b) const {
+    return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+  }
+};
+
+void dae_inspect_order(struct dae_inspect *buf) {
+  uint32_t n = buf->n < DAE_INSPECT_MAX ? buf->n : DAE_INSPECT_MAX;
+  for (uint32_t k = 0; k < n; ++k)
+    buf->order[k] = k;
+
+  // already in order: the common case of streams and repeated lines
+  bool sorted = true;
+  for (uint32_t k = 1; k < n && sorted; ++k)
+    sorted = buf->keys[k - 1] <= buf->keys[k];
+  if (sorted)
+    return;
+
+  ByKey cmp = {buf->keys};
+  std::sort(buf->order, buf->order + n, cmp);
+}
@@ -0,0 +1,58 @@
+/// \file parallel.h
+///
+/// \brief Work-stealing pool running the chunks of parallel DAE loops
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include <stdint.h>
+
+#ifndef __DAE_PARALLEL_H__
+#define __DAE_PARALLEL_H__
+
+/*
+ * With -dae-parallel, a loop whose iterations are independent becomes
+ *
+ *   dae_parallel_for(n, grain, <F>.dae_task, &args);
+ *
+ * where the task runs the iterations [lo, hi) of the loop, chunk by chunk,
+ * each chunk as an access and an execute phase. worker is the index of the
+ * thread running it, below DAE_MAX_WORKERS, which the task uses to fold its
+ * reductions into a slot of its own.
+ *
+ * The iterations are cut into tasks of grain iterations, and each worker
+ * starts with an equal share of consecutive tasks. A worker takes its tasks
+ * from the front of its share; once it is empty, it steals the back half of
+ * the share of another worker. The calling thread is worker 0 and returns
+ * once all the tasks have run.
+ *
+ * The pool has one worker per CPU the program may run on, or DAE_THREADS
+ * (in the environment). A call from inside a task, or while another thread
+ * uses the pool, runs all its iterations inline as one task.
+ *
+ * Each worker counts its own phases in the profiler (libDAE_prof_PT).
+ */
+
+/* Largest pool; the compiler allocates this many reduction slots */
+#define DAE_MAX_WORKERS 64
+
+/* Tasks per worker when the compiler leaves the grain to the runtime */
+#define DAE_TASKS_PER_WORKER 8
+
+/* Idle polls of a worker before it sleeps until the next loop */
+#define DAE_POOL_SPINS (1 << 14)
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+typedef void (*dae_task_fn)(void *args, uint64_t lo, uint64_t hi,
+                            uint32_t worker);
+
+/* Inserted by the -dae-parallel option of the -loop-chunk pass */
+extern void dae_parallel_for(uint64_t n, uint64_t grain, dae_task_fn task,
+                             void *args);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DAE_PARALLEL_H__ */
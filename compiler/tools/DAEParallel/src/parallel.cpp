@@ -0,0 +1,224 @@
+/// \file parallel.cpp
+///
+/// \brief Work-stealing pool running the chunks of parallel DAE loops
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "parallel.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+
+/* The tasks [begin, end) left to a worker, packed as end << 32 | begin so
+   that its owner and the thieves update both bounds with one CAS. A task is
+   in one share at a time and leaves it for good, so a share never comes
+   back to a value it had before. */
+struct Share {
+  volatile uint64_t bounds __attribute__((aligned(CACHE_LINE)));
+};
+
+struct Pool {
+  unsigned workers;
+
+  /* the current loop, written by its caller before the generation moves */
+  dae_task_fn task;
+  void *args;
+  uint64_t n;
+  uint64_t grain;
+  volatile uint64_t remaining __attribute__((aligned(CACHE_LINE)));
+  volatile unsigned busy;
+
+  volatile uint64_t generation __attribute__((aligned(CACHE_LINE)));
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+  /* one loop at a time */
+  pthread_mutex_t owner;
+
+  Share shares[DAE_MAX_WORKERS];
+};
+
+static Pool pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* Set on the workers of the pool, whose nested loops run inline */
+static __thread bool in_pool = false;
+
+static __inline__ void cpu_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__("pause" ::: "memory");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static __inline__ uint64_t pack(uint64_t begin, uint64_t end) {
+  return end << 32 | begin;
+}
+
+/* The next task of worker self, from the front of its share */
+static bool pop(unsigned self, uint64_t &t) {
+  Share *s = &pool.shares[self];
+  uint64_t old = __atomic_load_n(&s->bounds, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint64_t begin = old & 0xffffffff, end = old >> 32;
+    if (begin >= end)
+      return false;
+    if (__atomic_compare_exchange_n(&s->bounds, &old, pack(begin + 1, end),
+                                    false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      t = begin;
+      return true;
+    }
+  }
+}
+
+/* Moves the back half of the share of another worker to the (empty) share
+   of worker self */
+static bool steal(unsigned self) {
+  for (unsigned k = 1; k < pool.workers; ++k) {
+    Share *s = &pool.shares[(self + k) % pool.workers];
+    uint64_t old = __atomic_load_n(&s->bounds, __ATOMIC_ACQUIRE);
+    uint64_t begin = old & 0xffffffff, end = old >> 32;
+    if (begin >= end)
+      continue;
+    uint64_t mid = begin + (end - begin) / 2;
+    if (__atomic_compare_exchange_n(&s->bounds, &old, pack(begin, mid), false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&pool.shares[self].bounds, pack(mid, end),
+                       __ATOMIC_RELEASE);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Runs tasks of the current loop until none is left */
+static void run_loop(unsigned self) {
+  uint64_t t;
+  while (__atomic_load_n(&pool.remaining, __ATOMIC_ACQUIRE)) {
+    if (pop(self, t)) {
+      uint64_t lo = t * pool.grain;
+      uint64_t hi = lo + pool.grain < pool.n ? lo + pool.grain : pool.n;
+      pool.task(pool.args, lo, hi, self);
+      __atomic_sub_fetch(&pool.remaining, 1, __ATOMIC_ACQ_REL);
+    } else if (!steal(self)) {
+      cpu_relax();
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  unsigned self = (unsigned)(uintptr_t)arg;
+  in_pool = true;
+  uint64_t seen = 0;
+  for (;;) {
+    unsigned idle = 0;
+    while (__atomic_load_n(&pool.generation, __ATOMIC_ACQUIRE) == seen) {
+      if (++idle < DAE_POOL_SPINS) {
+        // leave the CPU to the threads it may be shared with
+        if (idle % 64 == 0)
+          sched_yield();
+        else
+          cpu_relax();
+        continue;
+      }
+      // between loops: sleep until the next one
+      pthread_mutex_lock(&pool.lock);
+      while (__atomic_load_n(&pool.generation, __ATOMIC_ACQUIRE) == seen)
+        pthread_cond_wait(&pool.wake, &pool.lock);
+      pthread_mutex_unlock(&pool.lock);
+    }
+    seen = __atomic_load_n(&pool.generation, __ATOMIC_ACQUIRE);
+    run_loop(self);
+    __atomic_sub_fetch(&pool.busy, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* The CPUs the program may run on, or DAE_THREADS */
+static unsigned pool_size(void) {
+  const char *env = getenv("DAE_THREADS");
+  long workers = env ? atol(env) : 0;
+  if (workers <= 0) {
+    cpu_set_t set;
+    if (!sched_getaffinity(0, sizeof(set), &set))
+      workers = CPU_COUNT(&set);
+    else
+      workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers < 1)
+    workers = 1;
+  return workers > DAE_MAX_WORKERS ? DAE_MAX_WORKERS : workers;
+}
+
+static void start_pool(void) {
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  pthread_mutex_init(&pool.owner, NULL);
+  pool.workers = 1;
+
+  unsigned workers = pool_size();
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (unsigned w = 1; w < workers; ++w) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, worker_main, (void *)(uintptr_t)w))
+      break;
+    ++pool.workers;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void dae_parallel_for(uint64_t n, uint64_t grain, dae_task_fn task,
+                      void *args) {
+  if (!n)
+    return;
+  pthread_once(&pool_once, start_pool);
+  if (in_pool || pool.workers == 1 || pthread_mutex_trylock(&pool.owner)) {
+    task(args, 0, n, 0);
+    return;
+  }
+
+  unsigned workers = pool.workers;
+  if (!grain)
+    grain = n / ((uint64_t)workers * DAE_TASKS_PER_WORKER);
+  if (!grain)
+    grain = 1;
+  if (n / grain >= 0xffffffff)
+    grain = n / 0xffffffff + 1;
+  uint64_t tasks = (n + grain - 1) / grain;
+
+  pool.task = task;
+  pool.args = args;
+  pool.n = n;
+  pool.grain = grain;
+  for (unsigned w = 0; w < workers; ++w)
+    pool.shares[w].bounds =
+        pack(tasks * w / workers, tasks * (w + 1) / workers);
+  pool.remaining = tasks;
+  pool.busy = workers - 1;
+
+  pthread_mutex_lock(&pool.lock);
+  __atomic_add_fetch(&pool.generation, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  in_pool = true;
+  run_loop(0);
+  in_pool = false;
+
+  // the workers may still look at the shares and the arguments
+  while (__atomic_load_n(&pool.busy, __ATOMIC_ACQUIRE))
+    cpu_relax();
+  pthread_mutex_unlock(&pool.owner);
+}
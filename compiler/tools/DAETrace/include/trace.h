@@ -0,0 +1,51 @@
+/// \file trace.h
+///
+/// \brief Memory traces of DAE kernels
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef __DAE_TRACE_H__
+#define __DAE_TRACE_H__
+
+/*
+ * Trace file layout: the 8 byte magic below followed by a stream of events.
+ * Every event starts with a LEB128 varint holding (index << 2) | tag.
+ *
+ *   TRACE_DEF_LOOP  defines loop <index>: NUL terminated name
+ *   TRACE_DEF_LOAD  defines load <index>: NUL terminated name, varint
+ *                   indirection level, varint lowest indirection level of
+ *                   the loads whose address depends on it (0: none)
+ *   TRACE_ITER      an iteration of loop <index> starts: varint static size
+ *   TRACE_LOAD      load <index> reads: zigzag varint of the address minus
+ *                   the previous address of the same load
+ *
+ * Indices are assigned in order of first appearance, so definitions always
+ * precede uses. Strided loads compress to one or two bytes per access.
+ */
+#define TRACE_MAGIC "DAETRC02"
+#define TRACE_MAGIC_SIZE 8
+
+#define TRACE_ITER 0
+#define TRACE_LOAD 1
+#define TRACE_DEF_LOOP 2
+#define TRACE_DEF_LOAD 3
+
+/* Output file, unless overridden by the DAE_TRACE_FILE environment variable */
+#define TRACE_DEFAULT_FILE "dae.trace"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Inserted by the -dae-mem-trace pass */
+extern void dae_trace_iter(const char *loop, uint32_t insts);
+extern void dae_trace_load(const char *load, uint32_t indir, uint32_t feeds,
+                           const void *addr);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DAE_TRACE_H__ */
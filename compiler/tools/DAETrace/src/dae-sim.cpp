@@ -0,0 +1,555 @@
+/// \file dae-sim.cpp
+///
+/// \brief Offline cache simulator for DAE memory traces
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+///
+/// Replays a trace recorded by the -dae-mem-trace pass through a configurable
+/// L1/L2/LLC hierarchy, once for the original code and once for every
+/// (granularity, indirection) variant, and predicts the speedup of each
+/// variant. Loads whose prefetches (almost) never save latency in any
+/// variant, i.e. serve fewer demand accesses than -min-useful percent of the
+/// prefetches issued, are listed, and optionally written to a file that FKernelPrefetch reads with
+/// -prune-prefetches.
+///
+/// The timing model is first order: execute phases (and the original code)
+/// stall on every load; access phases overlap the loads of one indirection
+/// level across the whole chunk, bounded by the number of MSHRs, and only wait
+/// between levels for the loads that a prefetched load depends on. Other
+/// prefetches never stall.
+#include "trace.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct Event {
+  uint32_t type;
+  uint32_t index;
+  uint64_t value; // static size for TRACE_ITER, address for TRACE_LOAD
+};
+
+struct Trace {
+  std::vector<std::string> loops;
+  std::vector<std::string> loads;
+  std::vector<unsigned> indir;
+  std::vector<unsigned> feeds; // lowest level depending on a load, 0: none
+  std::vector<Event> events;
+};
+
+struct Config {
+  unsigned line;
+  unsigned size[3];  // KiB
+  unsigned assoc[3];
+  unsigned lat[3];   // cycles
+  unsigned mem;      // cycles
+  unsigned mshr;
+  double cpi;
+  unsigned call_cost; // cycles per chunk for calling the two phases
+  double min_useful;  // percent of prefetches that must serve a demand access
+  std::vector<unsigned> grans;
+  std::vector<unsigned> indirs;
+  const char *prune_file;
+  const char *trace_file;
+};
+
+/*************  Trace reading  ***********/
+
+static bool read_varint(FILE *f, uint64_t &v) {
+  v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int c = getc_unlocked(f);
+    if (c == EOF)
+      return false;
+    v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static bool read_string(FILE *f, std::string &s) {
+  s.clear();
+  int c;
+  while ((c = getc_unlocked(f)) != EOF && c != 0)
+    s.push_back((char)c);
+  return c == 0;
+}
+
+static bool read_trace(const char *path, Trace &T) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+
+  char magic[TRACE_MAGIC_SIZE];
+  if (fread(magic, 1, TRACE_MAGIC_SIZE, f) != TRACE_MAGIC_SIZE ||
+      memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE)) {
+    fprintf(stderr, "%s: not a DAE trace\n", path);
+    fclose(f);
+    return false;
+  }
+
+  std::vector<uint64_t> last_addr;
+  uint64_t head, v;
+  std::string name;
+  bool ok = true;
+  while (ok && read_varint(f, head)) {
+    uint32_t index = (uint32_t)(head >> 2);
+    switch (head & 3) {
+    case TRACE_DEF_LOOP:
+      ok = read_string(f, name) && index == T.loops.size();
+      T.loops.push_back(name);
+      break;
+    case TRACE_DEF_LOAD: {
+      uint64_t feeds;
+      ok = read_string(f, name) && read_varint(f, v) &&
+           read_varint(f, feeds) && index == T.loads.size();
+      T.loads.push_back(name);
+      T.indir.push_back((unsigned)v);
+      T.feeds.push_back((unsigned)feeds);
+      last_addr.push_back(0);
+      break;
+    }
+    case TRACE_ITER:
+      ok = read_varint(f, v) && index < T.loops.size();
+      T.events.push_back({TRACE_ITER, index, v});
+      break;
+    case TRACE_LOAD:
+      ok = read_varint(f, v) && index < T.loads.size();
+      if (ok) {
+        int64_t delta = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+        last_addr[index] += (uint64_t)delta;
+        T.events.push_back({TRACE_LOAD, index, last_addr[index]});
+      }
+      break;
+    }
+  }
+  fclose(f);
+
+  if (!ok)
+    fprintf(stderr, "%s: truncated or corrupt trace\n", path);
+  return ok;
+}
+
+/*************  Cache model  ***********/
+
+struct Line {
+  uint64_t tag;
+  uint64_t ready; // cycle at which the data arrives
+  uint64_t lru;
+  int pref;       // load whose prefetch brought the line, -1 if none
+  bool valid;
+};
+
+class Cache {
+public:
+  Cache(unsigned size_kb, unsigned assoc, unsigned line)
+      : assoc(assoc), tick(0) {
+    sets = std::max(1u, size_kb * 1024 / line / assoc);
+    lines.assign((size_t)sets * assoc, Line());
+  }
+
+  Line *lookup(uint64_t lineaddr) {
+    Line *set = &lines[(lineaddr % sets) * assoc];
+    for (unsigned w = 0; w < assoc; ++w)
+      if (set[w].valid && set[w].tag == lineaddr) {
+        set[w].lru = ++tick;
+        return &set[w];
+      }
+    return NULL;
+  }
+
+  // Returns the evicted line (valid == false if a free way was used).
+  Line install(uint64_t lineaddr, uint64_t ready, int pref) {
+    Line *set = &lines[(lineaddr % sets) * assoc];
+    Line *victim = &set[0];
+    for (unsigned w = 0; w < assoc; ++w) {
+      if (!set[w].valid) {
+        victim = &set[w];
+        break;
+      }
+      if (set[w].lru < victim->lru)
+        victim = &set[w];
+    }
+    Line old = *victim;
+    victim->tag = lineaddr;
+    victim->ready = ready;
+    victim->lru = ++tick;
+    victim->pref = pref;
+    victim->valid = true;
+    return old;
+  }
+
+private:
+  unsigned sets, assoc;
+  uint64_t tick;
+  std::vector<Line> lines;
+};
+
+struct LoadStats {
+  uint64_t issued; // prefetches issued (not the loads of the access phase)
+  uint64_t useful; // demand accesses served by a pending prefetched line
+  uint64_t late;   // ... of which the data had not arrived yet
+};
+
+class Hierarchy {
+public:
+  Hierarchy(const Config &C, size_t nloads) : C(C), stats(nloads) {
+    for (unsigned l = 0; l < 3; ++l)
+      levels.push_back(Cache(C.size[l], C.assoc[l], C.line));
+  }
+
+  // Demand access at cycle now. Returns the cycle at which the data is
+  // available.
+  uint64_t load(uint64_t addr, uint64_t now) {
+    uint64_t lineaddr = addr / C.line;
+    Line *L1 = levels[0].lookup(lineaddr);
+    if (L1) {
+      uint64_t avail = std::max(now + C.lat[0], L1->ready);
+      if (L1->pref >= 0) {
+        ++stats[L1->pref].useful;
+        if (L1->ready > now + C.lat[0])
+          ++stats[L1->pref].late;
+        L1->pref = -1;
+      }
+      return avail;
+    }
+    uint64_t avail = fetch(lineaddr, now);
+    fill(lineaddr, avail, 0, 1, -1);
+    return avail;
+  }
+
+  // Software prefetch on behalf of load id. Returns the cycle at which the
+  // line arrives; lines already in L1 are not refetched.
+  uint64_t prefetch(uint64_t addr, uint64_t now, int id) {
+    uint64_t lineaddr = addr / C.line;
+    ++stats[id].issued;
+    Line *L1 = levels[0].lookup(lineaddr);
+    if (L1)
+      return L1->ready;
+    uint64_t avail = fetch(lineaddr, now);
+    fill(lineaddr, avail, 0, 1, id);
+    return avail;
+  }
+
+  bool inL1(uint64_t addr) { return levels[0].lookup(addr / C.line) != NULL; }
+
+  std::vector<LoadStats> &getStats() { return stats; }
+
+private:
+  const Config &C;
+  std::vector<Cache> levels;
+  std::vector<LoadStats> stats;
+
+  // Looks an L1 miss up in the lower levels, filling the levels between L1
+  // and the one that hit. The caller fills L1.
+  uint64_t fetch(uint64_t lineaddr, uint64_t now) {
+    for (unsigned l = 1; l < 3; ++l) {
+      Line *hit = levels[l].lookup(lineaddr);
+      if (hit) {
+        uint64_t avail = std::max(now + C.lat[l], hit->ready);
+        fill(lineaddr, avail, 1, l, -1);
+        return avail;
+      }
+    }
+    uint64_t avail = now + C.mem;
+    fill(lineaddr, avail, 1, 3, -1);
+    return avail;
+  }
+
+  // Installs the line in levels [from, below). Only the L1 copy remembers
+  // the prefetch that brought it.
+  void fill(uint64_t lineaddr, uint64_t ready, unsigned from, unsigned below,
+            int pref) {
+    for (unsigned l = from; l < below; ++l)
+      levels[l].install(lineaddr, ready, l == 0 ? pref : -1);
+  }
+};
+
+/*************  Timing  ***********/
+
+struct Iteration {
+  uint32_t loop;
+  uint64_t insts;
+  size_t first, last; // load events [first, last)
+};
+
+static void split_iterations(const Trace &T, std::vector<Iteration> &iters) {
+  for (size_t e = 0; e < T.events.size(); ++e) {
+    const Event &E = T.events[e];
+    if (E.type == TRACE_ITER) {
+      iters.push_back({E.index, E.value, e + 1, e + 1});
+    } else if (!iters.empty()) {
+      iters.back().last = e + 1;
+    }
+  }
+}
+
+static uint64_t run_execute(const Config &C, const Trace &T, Hierarchy &H,
+                            const Iteration &it, uint64_t now) {
+  now += (uint64_t)(it.insts * C.cpi);
+  for (size_t e = it.first; e < it.last; ++e)
+    now = std::max(now, H.load(T.events[e].value, now));
+  return now;
+}
+
+static uint64_t simulate_original(const Config &C, const Trace &T,
+                                  const std::vector<Iteration> &iters) {
+  Hierarchy H(C, T.loads.size());
+  uint64_t now = 0;
+  for (size_t i = 0; i < iters.size(); ++i)
+    now = run_execute(C, T, H, iters[i], now);
+  return now;
+}
+
+// Access phase of one chunk: level by level, every load that a load of the
+// chunk within the indirection limit depends on is performed and waited
+// for, and every other load is only prefetched.
+static uint64_t run_access(const Config &C, const Trace &T, Hierarchy &H,
+                           const std::vector<Iteration> &iters, size_t begin,
+                           size_t end, unsigned Y, uint64_t now) {
+  std::priority_queue<uint64_t, std::vector<uint64_t>,
+                      std::greater<uint64_t>> mshr;
+
+  // a limit past the deepest load of the chunk prefetches the same
+  unsigned deepest = 0;
+  for (size_t i = begin; i < end; ++i)
+    for (size_t e = iters[i].first; e < iters[i].last; ++e)
+      deepest = std::max(deepest, T.indir[T.events[e].index]);
+  Y = std::min(Y, deepest);
+
+  for (unsigned level = 0; level <= Y; ++level) {
+    uint64_t level_done = now;
+    for (size_t i = begin; i < end; ++i) {
+      for (size_t e = iters[i].first; e < iters[i].last; ++e) {
+        const Event &E = T.events[e];
+        if (T.indir[E.index] != level)
+          continue;
+        unsigned feeds = T.feeds[E.index];
+        bool wait = feeds && feeds <= Y;
+
+        now += 1; // issue
+        if (H.inL1(E.value)) {
+          if (wait)
+            level_done = std::max(level_done, H.load(E.value, now));
+          else
+            H.prefetch(E.value, now, E.index);
+          continue;
+        }
+        while (!mshr.empty() && mshr.top() <= now)
+          mshr.pop();
+        if (mshr.size() >= C.mshr) {
+          now = std::max(now, mshr.top());
+          mshr.pop();
+        }
+        if (wait) {
+          uint64_t avail = H.load(E.value, now);
+          mshr.push(avail);
+          level_done = std::max(level_done, avail);
+        } else {
+          mshr.push(H.prefetch(E.value, now, E.index));
+        }
+      }
+    }
+    now = std::max(now, level_done);
+  }
+  return now;
+}
+
+static uint64_t simulate_dae(const Config &C, const Trace &T,
+                             const std::vector<Iteration> &iters, unsigned G,
+                             unsigned Y, std::vector<LoadStats> &stats) {
+  Hierarchy H(C, T.loads.size());
+  uint64_t now = 0;
+  size_t i = 0;
+  while (i < iters.size()) {
+    // a chunk is up to G consecutive iterations of the same loop
+    size_t end = i + 1;
+    while (end < iters.size() && end - i < G && iters[end].loop == iters[i].loop)
+      ++end;
+
+    now += C.call_cost;
+    now = run_access(C, T, H, iters, i, end, Y, now);
+    for (size_t k = i; k < end; ++k)
+      now = run_execute(C, T, H, iters[k], now);
+    i = end;
+  }
+  stats = H.getStats();
+  return now;
+}
+
+/*************  Driver  ***********/
+
+static bool parse_list(const char *s, std::vector<unsigned> &list) {
+  list.clear();
+  char *end;
+  while (*s) {
+    unsigned long v = strtoul(s, &end, 10);
+    if (end == s || v == 0)
+      return false;
+    list.push_back((unsigned)v);
+    s = *end == ',' ? end + 1 : end;
+    if (*end && *end != ',')
+      return false;
+  }
+  return !list.empty();
+}
+
+static bool parse_level(const char *s, Config &C, unsigned l) {
+  return sscanf(s, "%u:%u:%u", &C.size[l], &C.assoc[l], &C.lat[l]) == 3 &&
+         C.size[l] && C.assoc[l];
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] <trace>\n"
+          "  -l1 KiB:assoc:latency   L1 data cache      (default 32:8:4)\n"
+          "  -l2 KiB:assoc:latency   L2 cache           (default 256:8:12)\n"
+          "  -llc KiB:assoc:latency  last level cache   (default 8192:16:40)\n"
+          "  -mem cycles             memory latency     (default 200)\n"
+          "  -line bytes             cache line size    (default 64)\n"
+          "  -mshr n                 outstanding misses (default 10)\n"
+          "  -cpi x                  cycles per instruction (default 1.0)\n"
+          "  -call-cost cycles       per-chunk call overhead (default 20)\n"
+          "  -gran list              granularities      (default 2,4,8)\n"
+          "  -indir list             indirections       (default 1,2,4,8)\n"
+          "  -min-useful pct         useful prefetch threshold (default 1.0)\n"
+          "  -prune file             write never-helping prefetches\n",
+          prog);
+}
+
+static bool parse_args(int argc, char *argv[], Config &C) {
+  C.line = 64;
+  C.size[0] = 32, C.assoc[0] = 8, C.lat[0] = 4;
+  C.size[1] = 256, C.assoc[1] = 8, C.lat[1] = 12;
+  C.size[2] = 8192, C.assoc[2] = 16, C.lat[2] = 40;
+  C.mem = 200;
+  C.mshr = 10;
+  C.cpi = 1.0;
+  C.call_cost = 20;
+  C.min_useful = 1.0;
+  C.grans = {2, 4, 8};
+  C.indirs = {1, 2, 4, 8};
+  C.prune_file = NULL;
+  C.trace_file = NULL;
+
+  for (int a = 1; a < argc; ++a) {
+    std::string opt = argv[a];
+    const char *val = a + 1 < argc ? argv[a + 1] : NULL;
+    bool ok = true;
+    if (opt[0] != '-') {
+      C.trace_file = argv[a];
+      continue;
+    }
+    if (!val)
+      return false;
+    ++a;
+    if (opt == "-l1")
+      ok = parse_level(val, C, 0);
+    else if (opt == "-l2")
+      ok = parse_level(val, C, 1);
+    else if (opt == "-llc")
+      ok = parse_level(val, C, 2);
+    else if (opt == "-mem")
+      C.mem = (unsigned)atoi(val);
+    else if (opt == "-line")
+      ok = (C.line = (unsigned)atoi(val)) > 0;
+    else if (opt == "-mshr")
+      ok = (C.mshr = (unsigned)atoi(val)) > 0;
+    else if (opt == "-cpi")
+      C.cpi = atof(val);
+    else if (opt == "-call-cost")
+      C.call_cost = (unsigned)atoi(val);
+    else if (opt == "-min-useful")
+      C.min_useful = atof(val);
+    else if (opt == "-gran")
+      ok = parse_list(val, C.grans);
+    else if (opt == "-indir")
+      ok = parse_list(val, C.indirs);
+    else if (opt == "-prune")
+      C.prune_file = val;
+    else
+      ok = false;
+    if (!ok) {
+      fprintf(stderr, "invalid option %s %s\n", opt.c_str(), val);
+      return false;
+    }
+  }
+  return C.trace_file != NULL;
+}
+
+int main(int argc, char *argv[]) {
+  Config C;
+  if (!parse_args(argc, argv, C)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Trace T;
+  if (!read_trace(C.trace_file, T))
+    return 1;
+
+  std::vector<Iteration> iters;
+  split_iterations(T, iters);
+  printf("Trace: %zu loops, %zu loads, %zu iterations, %zu events\n\n",
+         T.loops.size(), T.loads.size(), iters.size(), T.events.size());
+
+  uint64_t orig = simulate_original(C, T, iters);
+  printf("%-20s %15s %10s\n", "variant", "cycles", "speedup");
+  printf("%-20s %15lu %10.3f\n", "original", (unsigned long)orig, 1.0);
+
+  std::vector<uint64_t> useful(T.loads.size(), 0), issued(T.loads.size(), 0);
+  double best = 0.0;
+  std::string best_name;
+  for (unsigned g : C.grans) {
+    for (unsigned y : C.indirs) {
+      std::vector<LoadStats> stats;
+      uint64_t cycles = simulate_dae(C, T, iters, g, y, stats);
+      double speedup = cycles ? (double)orig / (double)cycles : 0.0;
+      std::string name =
+          "gran" + std::to_string(g) + ".indir" + std::to_string(y);
+      printf("%-20s %15lu %10.3f\n", name.c_str(), (unsigned long)cycles,
+             speedup);
+      if (speedup > best) {
+        best = speedup;
+        best_name = name;
+      }
+      for (size_t l = 0; l < stats.size(); ++l) {
+        useful[l] += stats[l].useful;
+        issued[l] += stats[l].issued;
+      }
+    }
+  }
+  printf("\nBest variant: %s (%.3fx)\n", best_name.c_str(), best);
+
+  FILE *prune = NULL;
+  if (C.prune_file && !(prune = fopen(C.prune_file, "w"))) {
+    perror(C.prune_file);
+    return 1;
+  }
+
+  printf("\nPrefetches that never help:\n");
+  unsigned never = 0;
+  for (size_t l = 0; l < T.loads.size(); ++l) {
+    if (issued[l] && 100.0 * useful[l] < C.min_useful * issued[l]) {
+      printf("  %s (indirection %u, %lu issued, %lu useful)\n",
+             T.loads[l].c_str(), T.indir[l], (unsigned long)issued[l],
+             (unsigned long)useful[l]);
+      if (prune)
+        fprintf(prune, "%s\n", T.loads[l].c_str());
+      ++never;
+    }
+  }
+  if (!never)
+    printf("  none\n");
+
+  if (prune)
+    fclose(prune);
+  return 0;
+}
@@ -0,0 +1,97 @@
+/// \file trace.cpp
+///
+/// \brief Memory trace runtime for the -dae-mem-trace pass
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include "trace.h"
+
+#include <stdlib.h>
+#include <unordered_map>
+
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+struct LoadState {
+  uint64_t index;
+  uint64_t last_addr;
+};
+
+static FILE *trace_file = NULL;
+static uint64_t num_loops = 0;
+static uint64_t num_loads = 0;
+
+/* Keyed by the address of the name constant emitted by the pass */
+static std::unordered_map<const char *, uint64_t> loops;
+static std::unordered_map<const char *, LoadState> loads;
+
+static void trace_close(void) {
+  if (trace_file) {
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+}
+
+static void trace_open(void) {
+  const char *path = getenv("DAE_TRACE_FILE");
+  if (!path)
+    path = TRACE_DEFAULT_FILE;
+
+  trace_file = fopen(path, "wb");
+  if (!trace_file) {
+    perror("dae_trace: cannot open trace file");
+    exit(1);
+  }
+  setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+  fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, trace_file);
+  atexit(trace_close);
+}
+
+static __inline__ void trace_put_varint(uint64_t v) {
+  while (v >= 0x80) {
+    putc_unlocked((int)(v & 0x7f) | 0x80, trace_file);
+    v >>= 7;
+  }
+  putc_unlocked((int)v, trace_file);
+}
+
+static __inline__ void trace_put_string(const char *s) {
+  fputs(s, trace_file);
+  putc_unlocked(0, trace_file);
+}
+
+void dae_trace_iter(const char *loop, uint32_t insts) {
+  if (!trace_file)
+    trace_open();
+
+  std::unordered_map<const char *, uint64_t>::iterator it = loops.find(loop);
+  if (it == loops.end()) {
+    it = loops.insert(std::make_pair(loop, num_loops++)).first;
+    trace_put_varint((it->second << 2) | TRACE_DEF_LOOP);
+    trace_put_string(loop);
+  }
+
+  trace_put_varint((it->second << 2) | TRACE_ITER);
+  trace_put_varint(insts);
+}
+
+void dae_trace_load(const char *load, uint32_t indir, uint32_t feeds,
+                    const void *addr) {
+  if (!trace_file)
+    trace_open();
+
+  std::unordered_map<const char *, LoadState>::iterator it = loads.find(load);
+  if (it == loads.end()) {
+    LoadState s = {num_loads++, 0};
+    it = loads.insert(std::make_pair(load, s)).first;
+    trace_put_varint((s.index << 2) | TRACE_DEF_LOAD);
+    trace_put_string(load);
+    trace_put_varint(indir);
+    trace_put_varint(feeds);
+  }
+
+  uint64_t a = (uint64_t)addr;
+  int64_t delta = (int64_t)(a - it->second.last_addr);
+  it->second.last_addr = a;
+
+  trace_put_varint((it->second.index << 2) | TRACE_LOAD);
+  trace_put_varint(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
@@ -0,0 +1,45 @@
+/// \file granularity.h
+///
+/// \brief Run-time refinement of the DAE chunk granularities
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include <stdint.h>
+
+#ifndef __DAE_GRANULARITY_H__
+#define __DAE_GRANULARITY_H__
+
+#define DAE_LINE_SIZE 64
+#define DAE_MAX_AUTO_GRAN 4096
+
+/*
+ * The chunking state of a loop, as emitted by the -loop-chunk pass into
+ * Globals.ll (see DAE_CHUNK_* in SkelUtils/Utils.cpp). The blocks of all
+ * the chunked loops of a program lie next to each other in the section
+ * dae_chunks. footprint is the number of bytes one iteration prefetches;
+ * it is 0 for the loops whose granularity is fixed. The blocks are shared
+ * by the threads; the bounds of their chunks are in <block>_bounds, one
+ * { vi, lsup } per thread.
+ */
+struct dae_chunk_state {
+  uint64_t granularity;
+  uint64_t granularity_l2;
+  uint64_t tile_width;
+  uint64_t footprint;
+  uint64_t padding[4];
+} __attribute__((aligned(DAE_LINE_SIZE)));
+
+/* Cache directory of the CPU the granularities are computed for */
+#define DAE_CACHE_SYSFS "/sys/devices/system/cpu/cpu0/cache"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Called at start-up by the binaries built with AUTO_GRAN (AutoGran.ll) */
+extern void dae_refine_granularity(void);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DAE_GRANULARITY_H__ */
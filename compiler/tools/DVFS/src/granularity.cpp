@@ -0,0 +1,84 @@
+/// \file granularity.cpp
+///
+/// \brief Run-time refinement of the DAE chunk granularities
+///
+/// \copyright Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+#include "granularity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Defined by the linker when the program has chunked loops */
+extern "C" {
+extern struct dae_chunk_state __start_dae_chunks[] __attribute__((weak));
+extern struct dae_chunk_state __stop_dae_chunks[] __attribute__((weak));
+}
+
+/* Reads the first line of the file index<index>/<name> into buf */
+static bool read_cache_attr(unsigned index, const char *name, char *buf,
+                            size_t size) {
+  char path[128];
+  snprintf(path, sizeof(path), DAE_CACHE_SYSFS "/index%u/%s", index, name);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return false;
+  bool ok = fgets(buf, size, f) != NULL;
+  fclose(f);
+  return ok;
+}
+
+/* Size in bytes of the data (or unified) cache of the given level, 0 if it
+   is not listed */
+static uint64_t cache_size(unsigned level) {
+  char buf[64];
+  for (unsigned index = 0; read_cache_attr(index, "level", buf, sizeof(buf));
+       ++index) {
+    if ((unsigned)atoi(buf) != level)
+      continue;
+    if (!read_cache_attr(index, "type", buf, sizeof(buf)) ||
+        !strncmp(buf, "Instruction", 11))
+      continue;
+    if (!read_cache_attr(index, "size", buf, sizeof(buf)))
+      return 0;
+    char *unit;
+    uint64_t size = strtoull(buf, &unit, 10);
+    if (*unit == 'K')
+      size <<= 10;
+    else if (*unit == 'M')
+      size <<= 20;
+    return size;
+  }
+  return 0;
+}
+
+/* Same rule as granularityForCache (SkelUtils/ChunkFootprint.cpp): the
+   largest power of two whose chunk footprint fits half of the cache */
+static uint64_t granularity_for_cache(uint64_t footprint, uint64_t cache) {
+  uint64_t gran = 1;
+  while (gran < DAE_MAX_AUTO_GRAN && 2 * gran * footprint <= cache / 2)
+    gran *= 2;
+  return gran;
+}
+
+void dae_refine_granularity(void) {
+  const char *env = getenv("DAE_AUTO_GRAN");
+  if (env && !strcmp(env, "0"))
+    return;
+
+  uint64_t l1 = cache_size(1);
+  uint64_t l2 = cache_size(2);
+  for (struct dae_chunk_state *s = __start_dae_chunks; s < __stop_dae_chunks;
+       ++s) {
+    if (!s->footprint)
+      continue;
+    if (l1)
+      s->granularity = granularity_for_cache(s->footprint, l1);
+    // a super-chunk covers whole chunks; both are powers of two
+    if (l2 && s->granularity_l2) {
+      s->granularity_l2 = granularity_for_cache(s->footprint, l2);
+      if (s->granularity_l2 < s->granularity)
+        s->granularity_l2 = s->granularity;
+    }
+  }
+}
@@ -132,19 +132,32 @@ static __inline__ void profiler_unlock(volatile unsigned *lock) {
   __sync_lock_release(lock);
 }
 
+/* the counters of the last thread id asked for by each thread, so that the
+   map, which other threads may be inserting into, is only searched (under
+   the lock) the first time, e.g. by each worker of libDAE_parallel */
+static __thread volatile struct Statistics *_p_counters = NULL;
+static __thread uint64_t _p_tid;
+
 volatile void *profiler_get_counters(uint64_t tid) {
+  if (_p_counters && _p_tid == tid)
+    return _p_counters;
+
   std::map<uint64_t, volatile struct Statistics *>::iterator s_it;
+  volatile struct Statistics *ts;
 
+  profiler_lock(&_p_lock);
   s_it = stat.find(tid);
   if (s_it != stat.end()) {
-    return s_it->second;
+    ts = s_it->second;
   } else {
-    volatile struct Statistics *ts = new struct Statistics();
-    profiler_lock(&_p_lock);
+    ts = new struct Statistics();
     stat[tid] = ts;
-    profiler_unlock(&_p_lock);
-    return ts;
   }
+  profiler_unlock(&_p_lock);
+
+  _p_counters = ts;
+  _p_tid = tid;
+  return ts;
 }
 
 void profiler_stats_normalize(void) {
@@ -0,0 +1,9 @@
+; Copyright (C) Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+;
+; Appended to the globals of the binaries built with AUTO_GRAN: the chunk
+; granularities are refined from the cache sizes of the machine (see
+; dae_refine_granularity in libDAE_prof) before any other constructor runs.
+
+@llvm.global_ctors = appending global [1 x { i32, void ()*, i8* }] [{ i32, void ()*, i8* } { i32 101, void ()* @dae_refine_granularity, i8* null }]
+
+declare void @dae_refine_granularity()
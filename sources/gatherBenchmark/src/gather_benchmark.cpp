@@ -0,0 +1,64 @@
+/** # Copyright (C) Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+ *
+ * # A gather that the loop writes at a constant offset */
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+
+using namespace std;
+
+#define MAX_SIZE (1 << 22)
+
+/** Global arrays, so that alias analysis tells them apart in the kernel:
+ * a[idx[i]] is read, and a[idx[i] + 1] written, idx being random.
+ */
+static double a[MAX_SIZE];
+static unsigned int idx[MAX_SIZE];
+
+
+int main(int argc, char* argv[]){
+  int vecSize, seed;
+
+  //if no argument is given, default setting is used
+  if(argc == 1){
+    vecSize = MAX_SIZE;
+    seed = 0;
+  }
+  else if(argc == 2){
+    vecSize = atoi(argv[1]);
+    seed = time(NULL);
+    cout << "default random with time..." << endl;
+  }
+  else{
+    vecSize = atoi(argv[1]);
+    seed = atoi(argv[2]);
+  }
+  if(vecSize <= 1 || vecSize > MAX_SIZE){
+    vecSize = MAX_SIZE;
+  }
+  srand(seed);
+
+  //values, and random indices below the last one
+  for(int i = 0; i < vecSize; i++){
+    a[i] = i % 1000;
+    idx[i] = rand() % (vecSize - 1);
+  }
+
+  //a later iteration may read the a[idx[i] + 1] written by this one: a
+  //copy of a[idx[j]] made before the chunk runs would be stale
+  double sum = 0;
+#pragma clang loop vectorize_width(1337)
+  for(int i = 0; i < vecSize; ++i){
+    double v = a[idx[i]];
+    sum += v;
+    a[idx[i] + 1] = v * 0.5 + 1.0;
+  }
+
+  //print a checksum of the sum and of a
+  for(int i = 0; i < vecSize; i++){
+    sum += a[i] * (i % 7);
+  }
+  cout << "checksum=" << sum << endl;
+  return 0;
+}
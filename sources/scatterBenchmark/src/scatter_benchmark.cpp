@@ -0,0 +1,71 @@
+/** # Copyright (C) Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+ *
+ * # A scatter through a random permutation */
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+
+using namespace std;
+
+#define MAX_SIZE (1 << 22)
+
+/** Global arrays, so that alias analysis tells them apart in the kernel:
+ * out[perm[i]] is written from in[i], perm being a random permutation.
+ */
+static double in[MAX_SIZE];
+static double out[MAX_SIZE];
+static unsigned int perm[MAX_SIZE];
+
+
+int main(int argc, char* argv[]){
+  int vecSize, seed;
+
+  //if no argument is given, default setting is used
+  if(argc == 1){
+    vecSize = MAX_SIZE;
+    seed = 0;
+  }
+  else if(argc == 2){
+    vecSize = atoi(argv[1]);
+    seed = time(NULL);
+    cout << "default random with time..." << endl;
+  }
+  else{
+    vecSize = atoi(argv[1]);
+    seed = atoi(argv[2]);
+  }
+  if(vecSize <= 0 || vecSize > MAX_SIZE){
+    vecSize = MAX_SIZE;
+  }
+  srand(seed);
+
+  //inputs, and the identity permutation
+  for(int i = 0; i < vecSize; i++){
+    in[i] = i % 1000;
+    perm[i] = i;
+  }
+
+  //shuffle the permutation (Fisher-Yates)
+  for(int i = vecSize - 1; i > 0; --i){
+    int j = rand() % (i + 1);
+    unsigned int t = perm[i];
+    perm[i] = perm[j];
+    perm[j] = t;
+  }
+
+  //every iteration writes a random line of out, which no other iteration
+  //writes and no iteration reads
+#pragma clang loop vectorize_width(1337)
+  for(int i = 0; i < vecSize; ++i){
+    out[perm[i]] = in[i] * 2.0 + 1.0;
+  }
+
+  //print a checksum of out
+  double sum = 0;
+  for(int i = 0; i < vecSize; i++){
+    sum += out[i] * (i % 7);
+  }
+  cout << "checksum=" << sum << endl;
+  return 0;
+}
@@ -0,0 +1,66 @@
+/** # Copyright (C) Eta Scale AB. Licensed under the Eta Scale Open Source License. See the LICENSE file for details.
+ *
+ * # Column sums of a matrix, a nest rotated by -O3 */
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+
+using namespace std;
+
+#define MAX_SIZE (1 << 22)
+#define MAX_COLS (1 << 14)
+
+/** Global arrays, so that alias analysis tells them apart in the kernel:
+ * sums[j] adds up m[i * cols + j] over the rows i.
+ */
+static double m[MAX_SIZE];
+static double sums[MAX_COLS];
+
+
+int main(int argc, char* argv[]){
+  int cols, seed;
+
+  //if no argument is given, default setting is used
+  if(argc == 1){
+    cols = 4096;
+    seed = 0;
+  }
+  else if(argc == 2){
+    cols = atoi(argv[1]);
+    seed = time(NULL);
+    cout << "default random with time..." << endl;
+  }
+  else{
+    cols = atoi(argv[1]);
+    seed = atoi(argv[2]);
+  }
+  if(cols <= 0 || cols > MAX_COLS){
+    cols = 4096;
+  }
+  int rows = MAX_SIZE / cols;
+  srand(seed);
+
+  //random entries
+  for(int i = 0; i < rows * cols; i++){
+    m[i] = rand() % 1000;
+  }
+
+  //both loops are tested in their latches once rotated; the trip count of
+  //the inner one holds under its guard, cols > 0
+#pragma clang loop vectorize_width(1337)
+  for(int i = 0; i < rows; ++i){
+#pragma clang loop vectorize(disable) unroll(disable)
+    for(int j = 0; j < cols; ++j){
+      sums[j] += m[i * cols + j];
+    }
+  }
+
+  //print a checksum of the sums
+  double sum = 0;
+  for(int j = 0; j < cols; j++){
+    sum += sums[j] * (j % 7);
+  }
+  cout << "checksum=" << sum << endl;
+  return 0;
+}